@@ -0,0 +1,480 @@
+/*
+  bundle.c - job bundle archive mounted in place
+
+  Part of SDCard plugin for grblHAL
+
+  A job bundle (.gjb) packs the main program with the macros and other files it
+  needs into a single file with a central directory. The bundle is mounted read
+  only at BUNDLE_PATH and its members are read from the bundle file through a
+  seek, the central directory is loaded on mount and members are not extracted.
+  All members share a single open handle to the bundle file.
+
+  Macro calls resolve to members when a bundle is mounted. A bundle mounted by
+  running it as a job is unmounted when the job ends, and any mounted bundle is
+  unmounted when its file is written, renamed or deleted.
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sdcard.h"
+
+#if SDCARD_ENABLE && SDCARD_BUNDLE_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef ARDUINO
+#include "../grbl/vfs.h"
+#else
+#include "grbl/vfs.h"
+#endif
+
+#include "bundle.h"
+#include "memstats.h"
+
+#ifndef BUNDLE_MAX_ENTRIES
+#define BUNDLE_MAX_ENTRIES 64
+#endif
+
+#define BUNDLE_NO_POS 0xFFFFFFFF
+
+typedef struct {
+    uint32_t offset;        // Offset of member data in the bundle file.
+    uint32_t pos;
+    uint8_t gen;            // Mount generation, reads fail after the bundle is unmounted.
+} bundle_file_t;
+
+typedef struct {
+    uint_fast16_t idx;
+} bundle_dir_t;
+
+static struct {
+    vfs_file_t *file;       // Bundle file, shared by all members.
+    uint32_t pos;           // Current position in the bundle file.
+    uint_fast8_t open;      // Number of members open.
+    uint8_t gen;
+    bool job;               // Mounted by a job, unmounted when it ends.
+    size_t size;
+    time_t mtime;
+    bundle_header_t hdr;
+    bundle_entry_t *entry;
+    char path[64];
+    char main[sizeof(BUNDLE_PATH) + sizeof(((bundle_entry_t *)0)->name)];
+} bundle = {0};
+
+static on_vfs_unmount_ptr on_vfs_unmount;
+
+static const bundle_entry_t *find_entry (const char *name)
+{
+    uint_fast16_t idx;
+
+    if(*name == '/')
+        name++;
+
+    for(idx = 0; idx < bundle.hdr.n_entries; idx++) {
+        if(!strcmp(bundle.entry[idx].name, name))
+            return &bundle.entry[idx];
+    }
+
+    return NULL;
+}
+
+static inline bool is_root (const char *path)
+{
+    return *path == '\0' || !strcmp(path, "/");
+}
+
+static vfs_file_t *bundle_fopen (const char *filename, const char *mode)
+{
+    vfs_file_t *file = NULL;
+    const bundle_entry_t *entry;
+
+    if(bundle.file && !(strchr(mode, 'w') || strchr(mode, 'a') || strchr(mode, '+')) && (entry = find_entry(filename)) &&
+        (file = MEMSTATS_ALLOC(MemGroup_Jobs, sizeof(vfs_file_t) + sizeof(bundle_file_t)))) {
+
+        bundle_file_t *f = (bundle_file_t *)&file->handle;
+
+        memset(file, 0, sizeof(vfs_file_t));
+        file->size = entry->size;
+        f->offset = entry->offset;
+        f->pos = 0;
+        f->gen = bundle.gen;
+        bundle.open++;
+    }
+
+    return file;
+}
+
+static void bundle_fclose (vfs_file_t *file)
+{
+    if(((bundle_file_t *)&file->handle)->gen == bundle.gen && bundle.open)
+        bundle.open--;
+
+    MEMSTATS_FREE(MemGroup_Jobs, file);
+}
+
+static size_t bundle_fread (void *buffer, size_t size, size_t count, vfs_file_t *file)
+{
+    size_t len = size * count, res = 0;
+    bundle_file_t *f = (bundle_file_t *)&file->handle;
+    uint32_t pos = f->offset + f->pos;
+
+    if(bundle.file == NULL || f->gen != bundle.gen)
+        return 0;
+
+    if(len > file->size - f->pos)
+        len = file->size - f->pos;
+
+    // Seek only when switching between members, sequential reads continue where the last one ended.
+    if(len && bundle.pos != pos) {
+        if(vfs_seek(bundle.file, pos) == 0)
+            bundle.pos = pos;
+        else {
+            bundle.pos = BUNDLE_NO_POS;
+            len = 0;
+        }
+    }
+
+    if(len) {
+        res = vfs_read(buffer, 1, len, bundle.file);
+        f->pos += res;
+        bundle.pos += res;
+    }
+
+    return res;
+}
+
+static size_t bundle_ftell (vfs_file_t *file)
+{
+    return ((bundle_file_t *)&file->handle)->pos;
+}
+
+static int bundle_fseek (vfs_file_t *file, size_t offset)
+{
+    if(offset > file->size)
+        return -1;
+
+    ((bundle_file_t *)&file->handle)->pos = offset;
+
+    return 0;
+}
+
+static bool bundle_feof (vfs_file_t *file)
+{
+    return ((bundle_file_t *)&file->handle)->pos == file->size;
+}
+
+static int bundle_frename (const char *from, const char *to)
+{
+    return -1;
+}
+
+// Shared by unlink, mkdir and rmdir, the bundle is read only.
+static int bundle_fmodify (const char *path)
+{
+    return -1;
+}
+
+static int bundle_fchdir (const char *path)
+{
+    return is_root(path) ? 0 : -1;
+}
+
+static vfs_dir_t *bundle_fopendir (const char *path)
+{
+    vfs_dir_t *dir = NULL;
+
+    if(bundle.file && is_root(path) && (dir = MEMSTATS_ALLOC(MemGroup_Jobs, sizeof(vfs_dir_t) + sizeof(bundle_dir_t)))) {
+        memset(dir, 0, sizeof(vfs_dir_t));
+        ((bundle_dir_t *)&dir->handle)->idx = 0;
+    }
+
+    return dir;
+}
+
+static char *bundle_readdir (vfs_dir_t *dir, vfs_dirent_t *dirent)
+{
+    bundle_dir_t *d = (bundle_dir_t *)&dir->handle;
+
+    *dirent->name = '\0';
+
+    if(bundle.file == NULL || d->idx >= bundle.hdr.n_entries)
+        return NULL;
+
+    strcpy(dirent->name, bundle.entry[d->idx].name);
+    dirent->size = bundle.entry[d->idx].size;
+    dirent->st_mode.mode = 0;
+    dirent->st_mode.read_only = On;
+    d->idx++;
+
+    return dirent->name;
+}
+
+static void bundle_fclosedir (vfs_dir_t *dir)
+{
+    if(dir)
+        MEMSTATS_FREE(MemGroup_Jobs, dir);
+}
+
+static int bundle_fstat (const char *filename, vfs_stat_t *st)
+{
+    const bundle_entry_t *entry = NULL;
+
+    if(bundle.file == NULL || !(is_root(filename) || (entry = find_entry(filename))))
+        return -1;
+
+    st->st_size = entry ? entry->size : 0;
+    st->st_mode.mode = 0;
+    st->st_mode.read_only = On;
+    st->st_mode.directory = entry == NULL;
+#if ESP_PLATFORM
+    st->st_mtim = bundle.mtime;
+#else
+    st->st_mtime = bundle.mtime;
+#endif
+
+    return 0;
+}
+
+static int bundle_futime (const char *filename, struct tm *modified)
+{
+    return -1;
+}
+
+static bool bundle_fgetfree (vfs_free_t *free)
+{
+    free->size = free->used = bundle.size;
+
+    return bundle.file != NULL;
+}
+
+static const vfs_t bundle_fs = {
+    .fs_name = "bundle",
+    .fopen = bundle_fopen,
+    .fclose = bundle_fclose,
+    .fread = bundle_fread,
+    .ftell = bundle_ftell,
+    .fseek = bundle_fseek,
+    .feof = bundle_feof,
+    .frename = bundle_frename,
+    .funlink = bundle_fmodify,
+    .fmkdir = bundle_fmodify,
+    .fchdir = bundle_fchdir,
+    .frmdir = bundle_fmodify,
+    .fopendir = bundle_fopendir,
+    .readdir = bundle_readdir,
+    .fclosedir = bundle_fclosedir,
+    .fstat = bundle_fstat,
+    .futime = bundle_futime,
+    .fgetfree = bundle_fgetfree
+};
+
+static void bundle_release (void)
+{
+    if(bundle.file) {
+        vfs_close(bundle.file);
+        bundle.file = NULL;
+    }
+
+    if(bundle.entry) {
+        MEMSTATS_FREE(MemGroup_Jobs, bundle.entry);
+        bundle.entry = NULL;
+    }
+
+    bundle.hdr.n_entries = 0;
+    bundle.open = 0;
+    bundle.job = false;
+    *bundle.path = *bundle.main = '\0';
+}
+
+static bool bundle_unmount (void)
+{
+    if(bundle.open)
+        return false;
+
+    if(bundle.file) {
+        vfs_unmount(BUNDLE_PATH);
+        bundle_release();
+    }
+
+    return true;
+}
+
+static bool bundle_mount (char *filename)
+{
+    bool ok;
+    uint_fast16_t idx;
+    vfs_stat_t st;
+    vfs_file_t *file;
+    bundle_header_t hdr;
+    bundle_entry_t *entry = NULL;
+    vfs_st_mode_t mode = { .read_only = On };
+
+    if(vfs_stat(filename, &st) != 0)
+        return false;
+
+#if ESP_PLATFORM
+    if(bundle.file && !strcmp(bundle.path, filename) && bundle.size == st.st_size && bundle.mtime == st.st_mtim)
+#else
+    if(bundle.file && !strcmp(bundle.path, filename) && bundle.size == st.st_size && bundle.mtime == st.st_mtime)
+#endif
+        return true; // Already mounted and unchanged.
+
+    if(strlen(filename) >= sizeof(bundle.path) || !bundle_unmount() || (file = vfs_open(filename, "r")) == NULL)
+        return false;
+
+    ok = vfs_read(&hdr, sizeof(bundle_header_t), 1, file) == sizeof(bundle_header_t) &&
+          !memcmp(hdr.magic, BUNDLE_MAGIC, sizeof(hdr.magic)) &&
+           hdr.n_entries > 0 && hdr.n_entries <= BUNDLE_MAX_ENTRIES && hdr.main < hdr.n_entries &&
+            hdr.dir_offset >= sizeof(bundle_header_t) && hdr.dir_offset <= file->size &&
+             hdr.n_entries * sizeof(bundle_entry_t) <= file->size - hdr.dir_offset &&
+              (entry = MEMSTATS_ALLOC(MemGroup_Jobs, hdr.n_entries * sizeof(bundle_entry_t))) &&
+               vfs_seek(file, hdr.dir_offset) == 0 &&
+                vfs_read(entry, sizeof(bundle_entry_t), hdr.n_entries, file) == hdr.n_entries * sizeof(bundle_entry_t);
+
+    for(idx = 0; ok && idx < hdr.n_entries; idx++) {
+        entry[idx].name[sizeof(entry[idx].name) - 1] = '\0';
+        ok = *entry[idx].name && strchr(entry[idx].name, '/') == NULL &&
+              entry[idx].offset >= sizeof(bundle_header_t) && entry[idx].offset <= file->size &&
+               entry[idx].size <= file->size - entry[idx].offset;
+    }
+
+    if(ok) {
+        bundle.file = file;
+        bundle.entry = entry;
+        bundle.size = file->size;
+        bundle.pos = BUNDLE_NO_POS;
+        bundle.gen++;
+#if ESP_PLATFORM
+        bundle.mtime = st.st_mtim;
+#else
+        bundle.mtime = st.st_mtime;
+#endif
+        memcpy(&bundle.hdr, &hdr, sizeof(bundle_header_t));
+        strcpy(bundle.path, filename);
+        strcat(strcat(strcpy(bundle.main, BUNDLE_PATH), "/"), entry[hdr.main].name);
+
+        if(!(ok = vfs_mount(BUNDLE_PATH, &bundle_fs, mode)))
+            bundle_release();
+    } else {
+        if(entry)
+            MEMSTATS_FREE(MemGroup_Jobs, entry);
+        vfs_close(file);
+    }
+
+    return ok;
+}
+
+bool bundle_is_mounted (void)
+{
+    return bundle.file != NULL;
+}
+
+// Mounts bundle if filename is one and returns the path to its main program, else filename.
+// Returns NULL if the bundle could not be mounted.
+char *bundle_open (char *filename)
+{
+    char *ext = strrchr(filename, '.');
+
+    if(ext == NULL || strlen(ext) != 4 || LCAPS(ext[1]) != 'g' || LCAPS(ext[2]) != 'j' || LCAPS(ext[3]) != 'b')
+        return filename;
+
+    if(!bundle_mount(filename))
+        return NULL;
+
+    bundle.job = true;
+
+    return bundle.main;
+}
+
+// Unmounts the bundle if it was mounted by the job, called when the job ends.
+// Members still open, e.g. by an aborted macro, fail on read after this.
+void bundle_job_end (void)
+{
+    if(bundle.job) {
+        bundle.open = 0;
+        bundle_unmount();
+    }
+}
+
+static inline const char *skip_root (const char *path)
+{
+    return *path == '/' ? path + 1 : path;
+}
+
+// Unmounts the bundle when its file is written, renamed or deleted.
+void bundle_file_changed (const char *path)
+{
+    if(bundle.file && !strcmp(skip_root(bundle.path), skip_root(path))) {
+        bundle.open = 0;
+        bundle_unmount();
+    }
+}
+
+// Release the bundle file when the file system holding it goes away.
+static void bundle_on_unmount (const char *path)
+{
+    size_t len = strlen(path);
+
+    if(bundle.file && strcmp(path, BUNDLE_PATH) &&
+        (!strcmp(path, "/") || (!strncmp(bundle.path, path, len) && bundle.path[len] == '/'))) {
+        bundle.open = 0;
+        bundle_unmount();
+    }
+
+    if(on_vfs_unmount)
+        on_vfs_unmount(path);
+}
+
+// $FG[=<filename>] - mount job bundle or unmount current.
+static status_code_t sd_cmd_bundle (sys_state_t state, char *args)
+{
+    char buf[100];
+
+    if(args == NULL)
+        return bundle_unmount() ? Status_OK : Status_IdleError;
+
+    if(!bundle_mount(args))
+        return Status_FileOpenFailed;
+
+    bundle.job = false;
+
+    snprintf(buf, sizeof(buf), "[BUNDLE:%s|%d|%s]" ASCII_EOL, bundle.path, bundle.hdr.n_entries, bundle.main);
+    hal.stream.write(buf);
+
+    return Status_OK;
+}
+
+void bundle_init (void)
+{
+    PROGMEM static const sys_command_t bundle_command_list[] = {
+        {"FG", sd_cmd_bundle, {}, { .str = "$FG[=<filename>] - mount job bundle, unmount if no filename given" } }
+    };
+
+    static sys_commands_t bundle_commands = {
+        .n_commands = sizeof(bundle_command_list) / sizeof(sys_command_t),
+        .commands = bundle_command_list
+    };
+
+    system_register_commands(&bundle_commands);
+
+    MEMSTATS_STATIC(MemGroup_Jobs, sizeof(bundle));
+
+    on_vfs_unmount = vfs.on_unmount;
+    vfs.on_unmount = bundle_on_unmount;
+}
+
+#endif // SDCARD_ENABLE && SDCARD_BUNDLE_ENABLE
@@ -0,0 +1,53 @@
+/*
+  bundle.h - job bundle archive mounted in place
+
+  Part of SDCard plugin for grblHAL
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#define BUNDLE_MAGIC "GJB1"
+#define BUNDLE_PATH "/bundle"   // Mount point of the members.
+
+/*
+  Bundle file layout, all values little endian:
+
+  bundle_header_t header;
+  uint8_t data[];                                   // Member data, stored uncompressed.
+  bundle_entry_t entry[header.n_entries];           // Central directory at header.dir_offset.
+*/
+
+typedef struct {
+    char magic[4];          // BUNDLE_MAGIC
+    uint16_t n_entries;
+    uint16_t main;          // Index of the entry for the main program.
+    uint32_t dir_offset;    // Offset of the central directory.
+} bundle_header_t;
+
+typedef struct {
+    char name[40];          // Member name, no directories.
+    uint32_t offset;        // Offset of member data from the start of the bundle.
+    uint32_t size;
+    uint32_t crc;           // CRC32 of member data, 0 if not set.
+} bundle_entry_t;
+
+void bundle_init (void);
+bool bundle_is_mounted (void);
+char *bundle_open (char *filename);
+void bundle_job_end (void);
+void bundle_file_changed (const char *path);
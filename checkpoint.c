@@ -0,0 +1,390 @@
+/*
+  checkpoint.c - job checkpoint and resume
+
+  Part of SDCard plugin for grblHAL
+
+  Saves the execution context of a running job to a checkpoint file: the job
+  position, the macro call stack with the file offset of each frame and the
+  parameters in use. A checkpoint is only saved on request by $FK, with the
+  planner empty, and $FKR resumes the job from it by reopening the job and
+  macro files at the saved offsets.
+
+  The flow control stack is private to the core and cannot be rebuilt, so a
+  checkpoint can only be saved outside flow control blocks. Open blocks are
+  found by scanning the source of each frame up to its offset.
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sdcard.h"
+
+#if SDCARD_ENABLE && SDCARD_CHECKPOINT_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef ARDUINO
+#include "../grbl/planner.h"
+#include "../grbl/state_machine.h"
+#include "../grbl/vfs.h"
+#else
+#include "grbl/planner.h"
+#include "grbl/state_machine.h"
+#include "grbl/vfs.h"
+#endif
+
+#include "checkpoint.h"
+#include "macros.h"
+#include "fs_hash.h"
+#include "memstats.h"
+
+#ifndef CHECKPOINT_PARAM_LAST
+#define CHECKPOINT_PARAM_LAST 5000  // Last numbered parameter saved.
+#endif
+
+#define CHECKPOINT_MAX_FRAMES 6
+#define CHECKPOINT_MAX_BLOCKS 16
+#define CHECKPOINT_MAX_NAMED 16
+#define CHECKPOINT_LOCAL_PARAMS 30
+#define CHECKPOINT_LINELEN 80
+
+typedef enum {
+    Block_Sub = 1,
+    Block_While,
+    Block_Do,
+    Block_Repeat,
+    Block_If
+} checkpoint_keyword_t;
+
+// Flow control block open at the frame offset.
+typedef struct {
+    uint32_t o_hash;        // Hash of the O word, number or name.
+    uint8_t frame;
+    uint8_t keyword;        // checkpoint_keyword_t
+} checkpoint_block_t;
+
+typedef struct {
+    checkpoint_header_t hdr;
+    bool overflow;
+    uint_fast8_t n_blocks;
+    checkpoint_frame_t frame[CHECKPOINT_MAX_FRAMES];
+    checkpoint_block_t block[CHECKPOINT_MAX_BLOCKS];
+    checkpoint_named_t named[CHECKPOINT_MAX_NAMED];
+    char line[CHECKPOINT_LINELEN];
+} checkpoint_t;
+
+static const char *const keywords[] = { "sub", "while", "do", "repeat", "if" };
+static const char *const endwords[] = { "endsub", "endwhile", "", "endrepeat", "endif" };
+
+static void add_named (checkpoint_t *ckp, char *name, bool local)
+{
+    uint_fast8_t idx;
+
+    if(strlen(name) >= sizeof(ckp->named[0].name) || (*name != '_' && !local))
+        return;
+
+    for(idx = 0; idx < ckp->hdr.n_named; idx++) {
+        if(!strcmp(ckp->named[idx].name, name))
+            return;
+    }
+
+    if(ckp->hdr.n_named < CHECKPOINT_MAX_NAMED && ngc_named_param_get(name, &ckp->named[ckp->hdr.n_named].value))
+        strcpy(ckp->named[ckp->hdr.n_named++].name, name);
+}
+
+// Tracks flow control blocks opened and closed by a line and collects named parameters referenced.
+// Line is lowercase and stripped of whitespace.
+static void scan_line (checkpoint_t *ckp, uint8_t frame, char *line, uint_fast8_t base)
+{
+    char *s = line, *e;
+    uint32_t hash;
+    uint_fast8_t idx;
+    checkpoint_block_t *top = ckp->n_blocks > base ? &ckp->block[ckp->n_blocks - 1] : NULL;
+
+    while((s = strstr(s, "#<")) && (e = strchr(s + 2, '>'))) {
+        *e = '\0';
+        add_named(ckp, s + 2, frame == ckp->hdr.n_frames - 1);
+        *e = '>';
+        s = e + 1;
+    }
+
+    if(*line == 'n')
+        for(line++; *line >= '0' && *line <= '9'; line++);
+
+    if(*line++ != 'o')
+        return;
+
+    if(*line == '<') {
+        if((e = strchr(line, '>')) == NULL)
+            return;
+        e++;
+    } else
+        for(e = line; *e >= '0' && *e <= '9'; e++);
+
+    hash = fs_crc32(0, line, e - line);
+
+    for(idx = 0; idx < sizeof(keywords) / sizeof(char *); idx++) {
+
+        if(*endwords[idx] && !strncmp(e, endwords[idx], strlen(endwords[idx]))) {
+            if(top)
+                ckp->n_blocks--;
+            break;
+        }
+
+        if(!strncmp(e, keywords[idx], strlen(keywords[idx]))) {
+            if(idx + 1 == Block_While && top && top->keyword == Block_Do && top->o_hash == hash)
+                ckp->n_blocks--; // do - while
+            else if(ckp->n_blocks == CHECKPOINT_MAX_BLOCKS)
+                ckp->overflow = true;
+            else {
+                top = &ckp->block[ckp->n_blocks++];
+                top->o_hash = hash;
+                top->frame = frame;
+                top->keyword = idx + 1;
+            }
+            break;
+        }
+    }
+}
+
+// Scans frame source up to the frame offset, only done on request as it reads the file from the start.
+static bool scan_frame (checkpoint_t *ckp, uint8_t frame)
+{
+    char c, buf[64];
+    size_t count, idx;
+    uint_fast8_t len = 0, base = ckp->n_blocks;
+    uint32_t pos = 0;
+    vfs_file_t *file;
+
+    if((file = vfs_open(ckp->frame[frame].path, "r")) == NULL)
+        return false;
+
+    while(pos < ckp->frame[frame].offset && (count = vfs_read(buf, 1, sizeof(buf), file)) > 0) {
+        for(idx = 0; idx < count && pos < ckp->frame[frame].offset; idx++) {
+            c = buf[idx];
+            pos++;
+            if(c == '\n' || c == '\r') {
+                if(len) {
+                    ckp->line[len] = '\0';
+                    scan_line(ckp, frame, ckp->line, base);
+                }
+                len = 0;
+            } else if(c > ' ' && len < sizeof(ckp->line) - 1)
+                ckp->line[len++] = LCAPS(c);
+        }
+    }
+
+    vfs_close(file);
+
+    return true;
+}
+
+static status_code_t checkpoint_save (void)
+{
+    char *path, buf[100];
+    float value;
+    uint_fast16_t id;
+    uint_fast8_t idx, n_macros;
+    bool ok = true;
+    sdcard_job_t *job;
+    vfs_file_t *file;
+    checkpoint_t *ckp;
+    checkpoint_param_t param = {0};
+    status_code_t status = Status_FileOpenFailed;
+    fs_macro_frame_t frames[CHECKPOINT_MAX_FRAMES - 1];
+
+    if((path = sdcard_get_job_path()) == NULL || (job = sdcard_get_job_info()) == NULL)
+        return Status_IdleError;
+
+    if(plan_get_current_block() != NULL) // File positions are ahead of execution.
+        return Status_IdleError;
+
+    if((ckp = MEMSTATS_ALLOC(MemGroup_Jobs, sizeof(checkpoint_t))) == NULL)
+        return Status_FileOpenFailed;
+
+    memset(ckp, 0, sizeof(checkpoint_t));
+    memcpy(ckp->hdr.magic, CHECKPOINT_MAGIC, sizeof(ckp->hdr.magic));
+
+    strcpy(ckp->frame[0].path, path);
+    ckp->frame[0].offset = job->pos;
+    ckp->frame[0].line = job->line;
+
+    n_macros = fs_macros_get_stack(frames, CHECKPOINT_MAX_FRAMES - 1);
+
+    for(idx = 0; idx < n_macros; idx++) {
+        strncpy(ckp->frame[idx + 1].path, frames[idx].path, sizeof(ckp->frame[0].path) - 1);
+        ckp->frame[idx + 1].offset = vfs_tell(frames[idx].file);
+        ckp->frame[idx + 1].macro_id = frames[idx].id;
+    }
+
+    ckp->hdr.n_frames = n_macros + 1;
+
+    for(idx = 0; ok && idx < ckp->hdr.n_frames; idx++)
+        ok = scan_frame(ckp, idx);
+
+    // Execution cannot be continued inside a flow control block on resume.
+    if(ok && (ckp->n_blocks || ckp->overflow)) {
+        if(ckp->overflow)
+            strcpy(buf, "Job is inside flow control blocks, checkpoint not saved");
+        else {
+            checkpoint_block_t *block = &ckp->block[ckp->n_blocks - 1];
+            sprintf(buf, "Job is inside %s block in %s, checkpoint not saved", keywords[block->keyword - 1], ckp->frame[block->frame].path);
+        }
+        report_message(buf, Message_Warning);
+        status = Status_InvalidStatement;
+        ok = false;
+    } else if(ok && (file = vfs_open(CHECKPOINT_FILE, "w"))) {
+
+        vfs_write(&ckp->hdr, sizeof(checkpoint_header_t), 1, file);
+        vfs_write(ckp->frame, sizeof(checkpoint_frame_t), ckp->hdr.n_frames, file);
+
+        for(id = 1; id <= CHECKPOINT_PARAM_LAST; id++) {
+            if(ngc_param_get((ngc_param_id_t)id, &value) && value != 0.0f) {
+                param.id = (uint16_t)id;
+                param.value = value;
+                vfs_write(&param, sizeof(checkpoint_param_t), 1, file);
+                ckp->hdr.n_params++;
+            }
+        }
+
+        vfs_write(ckp->named, sizeof(checkpoint_named_t), ckp->hdr.n_named, file);
+
+        vfs_seek(file, 0);
+        ok = vfs_write(&ckp->hdr, sizeof(checkpoint_header_t), 1, file) == sizeof(checkpoint_header_t);
+        vfs_close(file);
+    } else
+        ok = false;
+
+    if(ok) {
+        sprintf(buf, "[CKP:%s|%lu|%d]" ASCII_EOL, ckp->frame[0].path, (unsigned long)ckp->frame[0].line, ckp->hdr.n_frames);
+        hal.stream.write(buf);
+        status = Status_OK;
+    }
+
+    MEMSTATS_FREE(MemGroup_Jobs, ckp);
+
+    return status;
+}
+
+static status_code_t checkpoint_resume (sys_state_t state)
+{
+    bool ok;
+    char buf[100];
+    uint_fast8_t idx;
+    uint_fast16_t n;
+    vfs_stat_t st;
+    vfs_file_t *file;
+    checkpoint_t *ckp;
+    checkpoint_param_t param;
+    status_code_t status = Status_FileOpenFailed;
+    float local[CHECKPOINT_LOCAL_PARAMS];
+    uint32_t local_set = 0;
+
+    if(state != STATE_IDLE)
+        return Status_IdleError;
+
+    if((file = vfs_open(CHECKPOINT_FILE, "r")) == NULL)
+        return Status_FileOpenFailed;
+
+    if((ckp = MEMSTATS_ALLOC(MemGroup_Jobs, sizeof(checkpoint_t))) == NULL) {
+        vfs_close(file);
+        return Status_FileOpenFailed;
+    }
+
+    ok = vfs_read(&ckp->hdr, sizeof(checkpoint_header_t), 1, file) == sizeof(checkpoint_header_t) &&
+          !memcmp(ckp->hdr.magic, CHECKPOINT_MAGIC, sizeof(ckp->hdr.magic)) &&
+           ckp->hdr.n_frames > 0 && ckp->hdr.n_frames <= CHECKPOINT_MAX_FRAMES &&
+            ckp->hdr.n_named <= CHECKPOINT_MAX_NAMED &&
+             vfs_read(ckp->frame, sizeof(checkpoint_frame_t), ckp->hdr.n_frames, file) == sizeof(checkpoint_frame_t) * ckp->hdr.n_frames;
+
+    for(idx = 0; ok && idx < ckp->hdr.n_frames; idx++)
+        ok = vfs_stat(ckp->frame[idx].path, &st) == 0 && ckp->frame[idx].offset <= st.st_size;
+
+    if(ok) {
+
+        // Restore global numbered parameters, local ones are set when the innermost frame is active.
+        for(n = 0; n < ckp->hdr.n_params && vfs_read(&param, sizeof(checkpoint_param_t), 1, file) == sizeof(checkpoint_param_t); n++) {
+            if(param.id >= 1 && param.id <= CHECKPOINT_LOCAL_PARAMS) {
+                local[param.id - 1] = param.value;
+                local_set |= 1UL << (param.id - 1);
+            } else
+                ngc_param_set((ngc_param_id_t)param.id, param.value);
+        }
+
+        ok = vfs_read(ckp->named, sizeof(checkpoint_named_t), ckp->hdr.n_named, file) == sizeof(checkpoint_named_t) * ckp->hdr.n_named;
+    }
+
+    vfs_close(file);
+
+    if(ok && (status = sdcard_resume_job(state, ckp->frame[0].path, ckp->frame[0].offset, ckp->frame[0].line)) == Status_OK) {
+
+        for(idx = 1; status == Status_OK && idx < ckp->hdr.n_frames; idx++) {
+            if((status = fs_macros_resume(ckp->frame[idx].path, ckp->frame[idx].macro_id, ckp->frame[idx].offset)) != Status_OK) {
+                sprintf(buf, "Failed to resume macro %s", ckp->frame[idx].path);
+                report_message(buf, Message_Warning);
+                // Running the job without the full call stack would continue past the macro call.
+                fs_macros_stop();
+                sdcard_abort_job(status);
+            }
+        }
+    }
+
+    if(status == Status_OK) {
+
+        for(idx = 0; idx < CHECKPOINT_LOCAL_PARAMS; idx++) {
+            if(local_set & (1UL << idx))
+                ngc_param_set((ngc_param_id_t)(idx + 1), local[idx]);
+        }
+
+        for(idx = 0; idx < ckp->hdr.n_named; idx++) {
+            ckp->named[idx].name[sizeof(ckp->named[0].name) - 1] = '\0';
+            ngc_named_param_set(ckp->named[idx].name, ckp->named[idx].value);
+        }
+    }
+
+    MEMSTATS_FREE(MemGroup_Jobs, ckp);
+
+    return status;
+}
+
+// $FK - save checkpoint of running job.
+static status_code_t sd_cmd_checkpoint (sys_state_t state, char *args)
+{
+    return checkpoint_save();
+}
+
+// $FKR - resume job from checkpoint.
+static status_code_t sd_cmd_resume (sys_state_t state, char *args)
+{
+    return checkpoint_resume(state);
+}
+
+void checkpoint_init (void)
+{
+    PROGMEM static const sys_command_t checkpoint_command_list[] = {
+        {"FK", sd_cmd_checkpoint, { .noargs = On }, { .str = "save checkpoint of running job" } },
+        {"FKR", sd_cmd_resume, { .noargs = On }, { .str = "resume job from checkpoint" } }
+    };
+
+    static sys_commands_t checkpoint_commands = {
+        .n_commands = sizeof(checkpoint_command_list) / sizeof(sys_command_t),
+        .commands = checkpoint_command_list
+    };
+
+    system_register_commands(&checkpoint_commands);
+}
+
+#endif // SDCARD_ENABLE && SDCARD_CHECKPOINT_ENABLE
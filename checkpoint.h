@@ -0,0 +1,64 @@
+/*
+  checkpoint.h - job checkpoint and resume
+
+  Part of SDCard plugin for grblHAL
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#define CHECKPOINT_MAGIC "GCK2"
+#define CHECKPOINT_FILE "/job.ckp"
+
+/*
+  Checkpoint file layout, all values little endian:
+
+  checkpoint_header_t header;
+  checkpoint_frame_t frame[header.n_frames];    // Frame 0 is the job, then macros outermost first.
+  checkpoint_param_t param[header.n_params];    // Numbered parameters, #1 - #30 are for the innermost frame.
+  checkpoint_named_t named[header.n_named];     // Named parameters referenced by the frames.
+*/
+
+typedef struct {
+    char magic[4];          // CHECKPOINT_MAGIC
+    uint8_t n_frames;
+    uint8_t reserved1;
+    uint16_t n_params;
+    uint8_t n_named;
+    uint8_t reserved[3];
+} checkpoint_header_t;
+
+typedef struct {
+    char path[64];
+    uint32_t offset;        // Offset of the next line to execute.
+    uint32_t line;          // Line number at offset, job frame only.
+    uint16_t macro_id;
+    uint16_t reserved;
+} checkpoint_frame_t;
+
+typedef struct {
+    uint16_t id;
+    uint16_t reserved;
+    float value;
+} checkpoint_param_t;
+
+typedef struct {
+    char name[24];
+    float value;
+} checkpoint_named_t;
+
+void checkpoint_init (void);
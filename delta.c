@@ -0,0 +1,390 @@
+/*
+  delta.c - delta updates of files using block signatures
+
+  Part of SDCard plugin for grblHAL
+
+  rsync style delta transfer, the host requests block signatures for the
+  current version of a file, uploads a delta file with copy instructions and
+  changed data and then requests it to be applied. The new version is
+  reconstructed into a temporary file in idle time slices, verified by CRC and
+  renamed to replace the current version.
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sdcard.h"
+
+#if SDCARD_ENABLE && SDCARD_DELTA_ENABLE && FF_FS_READONLY == 0
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef ARDUINO
+#include "../grbl/state_machine.h"
+#include "../grbl/vfs.h"
+#else
+#include "grbl/state_machine.h"
+#include "grbl/vfs.h"
+#endif
+
+#include "delta.h"
+#include "fs_hash.h"
+#include "memstats.h"
+
+#define DELTA_CHUNK 256
+#define DELTA_PATHLEN 64
+#define DELTA_MIN_BLOCK_SIZE 256
+#define DELTA_COMMIT_FILE "/delta.cmt" // Holds the name of the file being replaced.
+
+typedef enum {
+    Delta_Idle = 0,
+    Delta_Signatures,
+    Delta_Apply
+} delta_state_t;
+
+typedef struct {
+    delta_state_t state;
+    vfs_file_t *basis;
+    vfs_file_t *delta;
+    vfs_file_t *out;
+    char filename[DELTA_PATHLEN];
+    char deltafile[DELTA_PATHLEN];
+    delta_header_t hdr;
+    uint8_t op;
+    uint32_t remaining;
+    uint32_t block_pos;
+    uint32_t written;
+    uint32_t crc;
+    uint16_t a;
+    uint16_t b;
+    uint8_t buf[DELTA_CHUNK];
+} delta_job_t;
+
+static delta_job_t *job = NULL;
+static on_execute_realtime_ptr on_execute_realtime;
+static on_vfs_mount_ptr on_vfs_mount;
+
+static void tmp_filename (char *tmp, const char *filename, const char *ext)
+{
+    strcat(strcpy(tmp, filename), ext);
+}
+
+static void delta_end (const char *result)
+{
+    char buf[DELTA_PATHLEN + 20];
+
+    if(job->basis)
+        vfs_close(job->basis);
+    if(job->delta)
+        vfs_close(job->delta);
+    if(job->out)
+        vfs_close(job->out);
+
+    if(job->state == Delta_Apply) {
+
+        sprintf(buf, "[DELTA:%s|%s]" ASCII_EOL, job->filename, result);
+        hal.stream.write(buf);
+
+        tmp_filename((char *)job->buf, job->filename, ".tmp");
+        vfs_unlink((char *)job->buf);
+        vfs_unlink(job->deltafile);
+    } else
+        hal.stream.write("[DELTASIG:END]" ASCII_EOL);
+
+    MEMSTATS_FREE(MemGroup_Jobs, job);
+    job = NULL;
+}
+
+// Replaces the current version with the verified temporary file, keeps a backup until done.
+// May be run again to complete a replace that was interrupted at any step.
+static bool delta_replace (const char *filename)
+{
+    bool ok;
+    vfs_stat_t st;
+    char tmp[DELTA_PATHLEN + 5], bak[DELTA_PATHLEN + 5];
+
+    tmp_filename(tmp, filename, ".tmp");
+    tmp_filename(bak, filename, ".bak");
+
+    if((ok = vfs_stat(tmp, &st) == 0)) {
+        if(vfs_stat(filename, &st) == 0) {
+            vfs_unlink(bak);
+            ok = vfs_rename(filename, bak) == 0;
+        }
+        if(ok)
+            ok = vfs_rename(tmp, filename) == 0;
+    }
+
+    if(vfs_stat(filename, &st) != 0) // Replace failed halfway, restore backup.
+        vfs_rename(bak, filename);
+
+    vfs_unlink(bak);
+
+    return ok;
+}
+
+// The file name is recorded before the replace is started so that it can be completed on next mount.
+static bool delta_commit (void)
+{
+    bool ok;
+    vfs_file_t *file;
+
+    if((file = vfs_open(DELTA_COMMIT_FILE, "w"))) {
+        vfs_write(job->filename, 1, strlen(job->filename) + 1, file);
+        vfs_close(file);
+    }
+
+    ok = delta_replace(job->filename);
+
+    vfs_unlink(DELTA_COMMIT_FILE);
+
+    return ok;
+}
+
+// Completes a replace interrupted by a reset or power loss.
+static void delta_on_mount (const char *path, const vfs_t *fs)
+{
+    size_t len;
+    vfs_file_t *file;
+    char filename[DELTA_PATHLEN];
+
+    if(job == NULL && (file = vfs_open(DELTA_COMMIT_FILE, "r"))) {
+
+        len = vfs_read(filename, 1, sizeof(filename) - 1, file);
+        vfs_close(file);
+        filename[len] = '\0';
+
+        if(*filename)
+            delta_replace(filename);
+
+        vfs_unlink(DELTA_COMMIT_FILE);
+    }
+
+    if(on_vfs_mount)
+        on_vfs_mount(path, fs);
+}
+
+static void signatures_process (void)
+{
+    uint8_t *data = job->buf;
+    size_t idx, count = job->hdr.block_size - job->block_pos;
+
+    if((count = vfs_read(job->buf, 1, count > DELTA_CHUNK ? DELTA_CHUNK : count, job->basis)) > 0) {
+        job->crc = fs_crc32(job->crc, job->buf, count);
+        job->block_pos += count;
+        for(idx = 0; idx < count; idx++) {
+            job->a += *data++;
+            job->b += job->a;
+        }
+    }
+
+    if(job->block_pos && (count == 0 || job->block_pos == job->hdr.block_size)) {
+        char buf[30];
+        sprintf(buf, "[BLK:%08lX,%08lX]" ASCII_EOL, (unsigned long)(job->a | ((uint32_t)job->b << 16)), (unsigned long)job->crc);
+        hal.stream.write(buf);
+        job->a = job->b = 0;
+        job->crc = job->block_pos = 0;
+    }
+
+    if(count == 0)
+        delta_end(NULL);
+}
+
+static void apply_process (void)
+{
+    uint32_t arg[2];
+
+    if(job->remaining == 0) {
+
+        if(vfs_read(&job->op, 1, 1, job->delta) != 1) {
+            if(job->written != job->hdr.size || job->crc != job->hdr.crc)
+                delta_end("FAILED");
+            else {
+                vfs_close(job->out);
+                job->out = NULL;
+                if(job->basis) {
+                    vfs_close(job->basis);
+                    job->basis = NULL;
+                }
+                delta_end(delta_commit() ? "OK" : "FAILED");
+            }
+            return;
+        }
+
+        switch(job->op) {
+
+            case DeltaOp_Copy:
+                if(job->basis && vfs_read(arg, sizeof(uint32_t), 2, job->delta) == sizeof(arg) &&
+                    (uint64_t)arg[0] * job->hdr.block_size < job->basis->size) {
+                    arg[0] *= job->hdr.block_size;
+                    job->remaining = job->basis->size - arg[0];
+                    if((uint64_t)arg[1] * job->hdr.block_size < job->remaining)
+                        job->remaining = arg[1] * job->hdr.block_size;
+                    if(vfs_seek(job->basis, arg[0]) != 0)
+                        job->remaining = 0;
+                }
+                break;
+
+            case DeltaOp_Literal:
+                if(vfs_read(arg, sizeof(uint32_t), 1, job->delta) == sizeof(uint32_t))
+                    job->remaining = arg[0];
+                break;
+
+            default:
+                break;
+        }
+
+        if(job->remaining == 0)
+            delta_end("FAILED");
+
+    } else {
+
+        size_t count = job->remaining > DELTA_CHUNK ? DELTA_CHUNK : job->remaining;
+
+        if(vfs_read(job->buf, 1, count, job->op == DeltaOp_Copy ? job->basis : job->delta) != count ||
+            vfs_write(job->buf, 1, count, job->out) != count)
+            delta_end("FAILED");
+        else {
+            job->crc = fs_crc32(job->crc, job->buf, count);
+            job->written += count;
+            job->remaining -= count;
+        }
+    }
+}
+
+// Processes one chunk per call when idle.
+static void delta_process (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    if(job && state == STATE_IDLE && hal.stream.type != StreamType_File) {
+        if(job->state == Delta_Signatures)
+            signatures_process();
+        else
+            apply_process();
+    }
+}
+
+static delta_job_t *delta_job_create (char *filename)
+{
+    if(strlen(filename) >= DELTA_PATHLEN)
+        return NULL;
+
+    if((job = MEMSTATS_ALLOC(MemGroup_Jobs, sizeof(delta_job_t)))) {
+        memset(job, 0, sizeof(delta_job_t));
+        strcpy(job->filename, filename);
+    }
+
+    return job;
+}
+
+// $FB=<filename>[|<block size>]
+static status_code_t sd_cmd_signatures (sys_state_t state, char *args)
+{
+    char *bs, buf[DELTA_PATHLEN + 40];
+    uint32_t block_size = 0;
+
+    if(args == NULL)
+        return Status_Unhandled;
+
+    if(job)
+        return Status_IdleError;
+
+    if((bs = strchr(args, '|'))) {
+        *bs++ = '\0';
+        block_size = strtoul(bs, NULL, 10);
+    }
+
+    if(delta_job_create(args) == NULL)
+        return Status_FileOpenFailed;
+
+    if((job->basis = vfs_open(args, "r")) == NULL) {
+        MEMSTATS_FREE(MemGroup_Jobs, job);
+        job = NULL;
+        return Status_FileOpenFailed;
+    }
+
+    if(block_size < DELTA_MIN_BLOCK_SIZE) { // Default to approx. square root of file size
+        block_size = DELTA_MIN_BLOCK_SIZE;
+        while((uint64_t)block_size * block_size < job->basis->size)
+            block_size <<= 1;
+    }
+
+    job->hdr.block_size = block_size;
+    job->state = Delta_Signatures;
+
+    sprintf(buf, "[DELTASIG:%s|%lu|%lu]" ASCII_EOL, args, (unsigned long)job->basis->size, (unsigned long)block_size);
+    hal.stream.write(buf);
+
+    return Status_OK;
+}
+
+// $FA=<filename>|<delta filename>
+static status_code_t sd_cmd_apply (sys_state_t state, char *args)
+{
+    char *deltafile, tmp[DELTA_PATHLEN + 5];
+
+    if(args == NULL || (deltafile = strchr(args, '|')) == NULL)
+        return Status_InvalidStatement;
+
+    if(job)
+        return Status_IdleError;
+
+    *deltafile++ = '\0';
+
+    if(strlen(deltafile) >= DELTA_PATHLEN || delta_job_create(args) == NULL)
+        return Status_FileOpenFailed;
+
+    strcpy(job->deltafile, deltafile);
+    tmp_filename(tmp, args, ".tmp");
+
+    job->state = Delta_Apply;
+    job->basis = vfs_open(args, "r");
+
+    if((job->delta = vfs_open(deltafile, "r")) == NULL ||
+        vfs_read(&job->hdr, sizeof(delta_header_t), 1, job->delta) != sizeof(delta_header_t) ||
+         memcmp(job->hdr.magic, DELTA_MAGIC, sizeof(job->hdr.magic)) || job->hdr.block_size == 0 ||
+          (job->out = vfs_open(tmp, "w")) == NULL) {
+        delta_end("FAILED");
+        return Status_FileOpenFailed;
+    }
+
+    return Status_OK;
+}
+
+void delta_init (void)
+{
+    PROGMEM static const sys_command_t delta_command_list[] = {
+        {"FB", sd_cmd_signatures, {}, { .str = "$FB=<filename>[|<block size>] - report block signatures for delta upload" } },
+        {"FA", sd_cmd_apply, {}, { .str = "$FA=<filename>|<delta filename> - apply uploaded delta to file" } }
+    };
+
+    static sys_commands_t delta_commands = {
+        .n_commands = sizeof(delta_command_list) / sizeof(sys_command_t),
+        .commands = delta_command_list
+    };
+
+    system_register_commands(&delta_commands);
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = delta_process;
+
+    on_vfs_mount = vfs.on_mount;
+    vfs.on_mount = delta_on_mount;
+}
+
+#endif // SDCARD_ENABLE && SDCARD_DELTA_ENABLE && FF_FS_READONLY == 0
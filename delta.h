@@ -0,0 +1,52 @@
+/*
+  delta.h - delta updates of files using block signatures
+
+  Part of SDCard plugin for grblHAL
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#define DELTA_MAGIC "GDL1"
+
+/*
+  Delta file layout, all values little endian:
+
+  delta_header_t header;
+  followed by records, each starting with an op byte:
+
+  DeltaOp_Copy:    uint32_t block, uint32_t count - copy count blocks from the current file starting at block.
+  DeltaOp_Literal: uint32_t length, uint8_t data[length] - data to insert.
+
+  Block signatures reported by the controller are a weak rolling checksum as used by rsync:
+  a = sum of bytes, b = sum of (block length - i) * byte[i], both modulo 65536, weak = a | (b << 16),
+  and CRC32 (IEEE 802.3) of the block as the strong checksum.
+*/
+
+typedef enum {
+    DeltaOp_Copy = 'C',
+    DeltaOp_Literal = 'L'
+} delta_op_t;
+
+typedef struct {
+    char magic[4];          // DELTA_MAGIC
+    uint32_t block_size;
+    uint32_t size;          // Size of the new file.
+    uint32_t crc;           // CRC32 of the new file.
+} delta_header_t;
+
+void delta_init (void);
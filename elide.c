@@ -0,0 +1,540 @@
+/*
+  elide.c - redundant modal word elision for the job stream
+
+  Part of SDCard plugin for grblHAL
+
+  Reads job lines ahead one at a time and removes words that restate the
+  current modal value: a motion command equal to the active motion mode, a
+  feed rate equal to the active feed rate and, in absolute distance mode, axis
+  words equal to the last programmed position for a linear move. This reduces
+  the number of characters the parser has to process for typical CAM output.
+
+  The modal state is only tracked from what has been read from the job, a word
+  is never removed unless the value it restates is known. Lines that have side
+  effects (M, S and T words), comments, expressions or other words that are not
+  understood are passed through unchanged, the latter also clears the state.
+  Line numbers, file position and progress still refer to the original file.
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sdcard.h"
+
+#if SDCARD_ENABLE && SDCARD_ELIDE_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "elide.h"
+
+#ifndef ELIDE_LINE_LENGTH
+#define ELIDE_LINE_LENGTH 128   // Longer lines are passed through unchanged.
+#endif
+#define ELIDE_VALUE_LENGTH 16
+#define ELIDE_MAX_WORDS 16
+
+#define AXIS_LETTERS "XYZ"      // Axes tracked, other axis words are never removed.
+#define OTHER_AXIS_LETTERS "ABCUVW"
+
+typedef struct {
+    char letter;
+    uint8_t start;          // Offset of letter.
+    uint8_t value;          // Offset of value.
+    uint8_t end;            // Offset past value.
+    bool drop;
+} word_t;
+
+typedef struct {
+    int8_t motion;          // Motion mode, G0 - G3, -1 if not known.
+    bool absolute;          // G90 is known to be active.
+    bool per_minute;        // G94 is known to be active.
+    char feed[ELIDE_VALUE_LENGTH];              // Feed rate as programmed, empty if not known.
+    char axis[3][ELIDE_VALUE_LENGTH];           // Position as programmed, empty if not known.
+} modal_t;
+
+static struct {
+    uint_fast16_t len;
+    uint_fast16_t idx;
+    bool passthru;          // Line is too long, remaining characters are passed through.
+    char data[ELIDE_LINE_LENGTH];
+} line = {0};
+
+static modal_t modal;
+static elide_stats_t stats = {0};
+
+static inline bool is_digit (char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static inline char to_letter (char c)
+{
+    if(c >= 'a' && c <= 'z')
+        c -= 'a' - 'A';
+
+    return c >= 'A' && c <= 'Z' ? c : '\0';
+}
+
+// Returns offset past the number at offset i, i if not a number.
+static uint_fast16_t scan_number (const char *s, uint_fast16_t i, uint_fast16_t n)
+{
+    bool digits = false;
+    uint_fast16_t start = i;
+
+    if(i < n && (s[i] == '-' || s[i] == '+'))
+        i++;
+
+    while(i < n && is_digit(s[i])) {
+        i++;
+        digits = true;
+    }
+
+    if(i < n && s[i] == '.') {
+        i++;
+        while(i < n && is_digit(s[i])) {
+            i++;
+            digits = true;
+        }
+    }
+
+    return digits ? i : start;
+}
+
+// Returns G or M code multiplied by 10, e.g. 591 for G59.1, -1 if not a plain code.
+static int_fast16_t code_value (const char *s, uint_fast16_t n)
+{
+    int_fast16_t code = 0;
+    uint_fast16_t i = 0, digits = 0;
+
+    while(i < n && is_digit(s[i])) {
+        if(++digits > 3)
+            return -1;
+        code = code * 10 + s[i++] - '0';
+    }
+
+    code *= 10;
+
+    if(i < n && s[i++] == '.') {
+        if(i < n)
+            code += s[i++] - '0';
+        while(i < n) {
+            if(s[i++] != '0')
+                return -1;
+        }
+    }
+
+    return digits && i == n ? code : -1;
+}
+
+static inline void set_value (char *dest, const char *value, uint_fast16_t len)
+{
+    if(len < ELIDE_VALUE_LENGTH) {
+        memcpy(dest, value, len);
+        dest[len] = '\0';
+    } else
+        *dest = '\0';
+}
+
+static inline bool same_value (const char *modal, const char *value, uint_fast16_t len)
+{
+    return *modal && strlen(modal) == len && !strncmp(modal, value, len);
+}
+
+static inline void clear_axes (void)
+{
+    uint_fast8_t idx = 3;
+
+    do {
+        *modal.axis[--idx] = '\0';
+    } while(idx);
+}
+
+static void modal_reset (void)
+{
+    memset(&modal, 0, sizeof(modal_t));
+    modal.motion = -1;
+}
+
+// Returns true if the line only holds a comment or is empty.
+static bool is_comment (const char *s, uint_fast16_t n)
+{
+    while(n && (s[n - 1] == ' ' || s[n - 1] == '\t'))
+        n--;
+
+    while(n && (*s == ' ' || *s == '\t')) {
+        s++;
+        n--;
+    }
+
+    if(n == 0 || *s == ';')
+        return true;
+
+    return *s == '(' && s[n - 1] == ')' && memchr(s + 1, '(', n - 1) == NULL && memchr(s, ')', n - 1) == NULL;
+}
+
+// Parses the line and removes redundant words, updates the modal state from the words as programmed.
+// Lines not understood are passed through unchanged and clears the state.
+static void elide_line (void)
+{
+    char *s = line.data;
+    bool side_effect = false, arc_words = false, axis_words = false, other_axes = false, absolute;
+    int8_t motion = -1, distance = -1, feed_mode = -1, line_motion;
+    int_fast16_t code;
+    uint32_t seen = 0;
+    uint_fast16_t i = 0, j, n = line.len, n_words = 0, removed = 0;
+    word_t word[ELIDE_MAX_WORDS], *feed = NULL, *motion_word = NULL, *axis[3] = {0};
+
+    if(n && (s[n - 1] == '\r' || s[n - 1] == '\n'))
+        n--;
+
+    if(is_comment(s, n))
+        return;
+
+    // Split line into words.
+
+    while(i < n) {
+
+        if(s[i] == ' ' || s[i] == '\t') {
+            i++;
+            continue;
+        }
+
+        if(n_words == ELIDE_MAX_WORDS || (word[n_words].letter = to_letter(s[i])) == '\0') {
+            modal_reset();
+            return;
+        }
+
+        word[n_words].start = i++;
+        word[n_words].value = i;
+        if((i = scan_number(s, i, n)) == word[n_words].value) {
+            modal_reset();
+            return;
+        }
+        word[n_words].end = i;
+        word[n_words++].drop = false;
+    }
+
+    // Classify words, bail out on words that are not understood.
+
+    for(j = 0; j < n_words; j++) {
+
+        char letter = word[j].letter, *value = s + word[j].value;
+        uint_fast16_t len = word[j].end - word[j].value;
+
+        if(letter != 'G' && letter != 'M') {
+            if(seen & (1UL << (letter - 'A'))) {    // Repeated word, leave it to the parser to report it.
+                modal_reset();
+                return;
+            }
+            seen |= (1UL << (letter - 'A'));
+        }
+
+        switch(letter) {
+
+            case 'N':
+                break;
+
+            case 'G':
+                switch((code = code_value(value, len))) {
+
+                    case 0:
+                    case 10:
+                    case 20:
+                    case 30:
+                    case 800:
+                        if(motion_word) {
+                            modal_reset();
+                            return;
+                        }
+                        motion = code == 800 ? -2 : (int8_t)(code / 10);  // -2 for motion canceled.
+                        motion_word = &word[j];
+                        break;
+
+                    case 900:
+                    case 910:
+                        if(distance != -1) {
+                            modal_reset();
+                            return;
+                        }
+                        distance = code == 900;
+                        break;
+
+                    case 930:
+                    case 940:
+                        if(feed_mode != -1) {
+                            modal_reset();
+                            return;
+                        }
+                        feed_mode = code == 940;
+                        break;
+
+                    case 170:   // Plane selection, only used by arcs that are never changed.
+                    case 180:
+                    case 190:
+                    case 400:   // Cutter compensation off.
+                        break;
+
+                    case 200:   // Units, coordinate system and tool length offset
+                    case 210:   // change how programmed values are interpreted.
+                    case 490:
+                    case 540:
+                    case 550:
+                    case 560:
+                    case 570:
+                    case 580:
+                    case 590:
+                        *modal.feed = '\0';
+                        clear_axes();
+                        break;
+
+                    default:
+                        modal_reset();
+                        return;
+                }
+                break;
+
+            case 'M':
+                switch(code_value(value, len)) {
+
+                    case 30:    // Spindle
+                    case 40:
+                    case 50:
+                    case 70:    // and coolant control.
+                    case 80:
+                    case 90:
+                        side_effect = true;
+                        break;
+
+                    default:    // Program flow, tool change etc.
+                        modal_reset();
+                        return;
+                }
+                break;
+
+            case 'S':
+            case 'T':
+                side_effect = true;
+                break;
+
+            case 'F':
+                feed = &word[j];
+                break;
+
+            case 'I':
+            case 'J':
+            case 'K':
+            case 'R':
+                arc_words = true;
+                break;
+
+            default:
+                if(strchr(AXIS_LETTERS, letter))
+                    axis[strchr(AXIS_LETTERS, letter) - AXIS_LETTERS] = &word[j];
+                else if(strchr(OTHER_AXIS_LETTERS, letter))
+                    other_axes = true;
+                else {
+                    modal_reset();
+                    return;
+                }
+                axis_words = true;
+                break;
+        }
+    }
+
+    absolute = distance == -1 ? modal.absolute : distance == 1;
+    line_motion = motion == -1 ? modal.motion : motion;
+
+    // Mark redundant words.
+
+    if(!side_effect) {
+
+        if(motion >= 0 && motion == modal.motion)
+            motion_word->drop = true;
+
+        if(feed && feed_mode == -1 && modal.per_minute && same_value(modal.feed, s + feed->value, feed->end - feed->value))
+            feed->drop = true;
+
+        // A linear move keeps at least one axis word so that the motion is still commanded.
+        if(axis_words && absolute && (line_motion == 0 || line_motion == 1) && !arc_words) {
+
+            bool keep = !other_axes;
+            word_t *first = NULL;
+
+            for(j = 0; j < 3; j++) {
+                if(axis[j]) {
+                    if(same_value(modal.axis[j], s + axis[j]->value, axis[j]->end - axis[j]->value))
+                        axis[j]->drop = true;
+                    else
+                        keep = false;
+                    if(first == NULL || axis[j]->start < first->start)
+                        first = axis[j];
+                }
+            }
+
+            if(keep && first)
+                first->drop = false;
+        }
+    }
+
+    // Update modal state from the words as programmed.
+
+    if(distance != -1) {
+        if(!(modal.absolute = distance == 1))
+            clear_axes();
+    }
+
+    if(feed_mode != -1) {
+        modal.per_minute = feed_mode == 1;
+        *modal.feed = '\0';
+    }
+
+    if(motion != -1)
+        modal.motion = motion < 0 ? -1 : motion;
+
+    if(feed) {
+        if(modal.per_minute)
+            set_value(modal.feed, s + feed->value, feed->end - feed->value);
+        else
+            *modal.feed = '\0';
+    }
+
+    // The end point of a move is the programmed position, any other motion leaves the position unknown.
+    if(axis_words) {
+        if(absolute && line_motion >= 0) {
+            for(j = 0; j < 3; j++) {
+                if(axis[j])
+                    set_value(modal.axis[j], s + axis[j]->value, axis[j]->end - axis[j]->value);
+            }
+        } else
+            clear_axes();
+    }
+
+    // Remove marked words and the whitespace following them.
+
+    for(j = 0; j < n_words; j++) {
+        if(word[j].drop) {
+
+            uint_fast16_t start = word[j].start - removed, end = word[j].end - removed;
+
+            while(end < n - removed && (s[end] == ' ' || s[end] == '\t'))
+                end++;
+
+            memmove(s + start, s + end, line.len - removed - end);
+            removed += end - start;
+            stats.words++;
+        }
+    }
+
+    if(removed) {   // Remove whitespace left at end of line.
+
+        uint_fast16_t end = n - removed;
+
+        for(i = end; i && (s[i - 1] == ' ' || s[i - 1] == '\t'); i--);
+
+        memmove(s + i, s + end, line.len - n);
+        removed += end - i;
+    }
+
+    line.len -= removed;
+    stats.bytes += removed;
+}
+
+// Returns the next character of the job, the line is read ahead and redundant words removed
+// from it when the first character is requested.
+int16_t elide_read (elide_reader_ptr read)
+{
+    int16_t c = -1;
+
+    if(line.idx < line.len)
+        return (int16_t)line.data[line.idx++];
+
+    if(line.passthru) {
+        if((c = read()) == '\r' || c == '\n' || c == -1)
+            line.passthru = false;
+        return c;
+    }
+
+    line.idx = line.len = 0;
+
+    while(line.len < sizeof(line.data) && (c = read()) != -1) {
+        line.data[line.len++] = (char)c;
+        if(c == '\r' || c == '\n')
+            break;
+    }
+
+    if(c == -1 || c == '\r' || c == '\n')
+        elide_line();
+    else {
+        line.passthru = true;
+        modal_reset();
+    }
+
+    return line.len ? (int16_t)line.data[line.idx++] : c;
+}
+
+// Drops any line read ahead and forgets the modal state, to be called when the file position is changed.
+void elide_reset (void)
+{
+    line.idx = line.len = 0;
+    line.passthru = false;
+    modal_reset();
+}
+
+// To be called at job start, before anything is read.
+void elide_start (void)
+{
+    elide_reset();
+
+    modal.absolute = !gc_state.modal.distance_incremental;
+    modal.per_minute = gc_state.modal.feed_mode == FeedMode_UnitsPerMin;
+
+    stats.bytes = stats.words = 0;
+}
+
+// Returns bytes and words removed from the current or last job.
+elide_stats_t *elide_get_stats (void)
+{
+    return &stats;
+}
+
+// $FZ - report bytes and words removed from the current or last job.
+static status_code_t sd_cmd_elide (sys_state_t state, char *args)
+{
+    char buf[40];
+
+    sprintf(buf, "[ELIDE:%lu|%lu]" ASCII_EOL, (unsigned long)stats.bytes, (unsigned long)stats.words);
+    hal.stream.write(buf);
+
+    return Status_OK;
+}
+
+void elide_init (void)
+{
+    PROGMEM static const sys_command_t elide_command_list[] = {
+        {"FZ", sd_cmd_elide, { .noargs = On }, { .str = "report bytes and words elided from SD card job" } }
+    };
+
+    static sys_commands_t elide_commands = {
+        .n_commands = sizeof(elide_command_list) / sizeof(sys_command_t),
+        .commands = elide_command_list
+    };
+
+    system_register_commands(&elide_commands);
+
+    modal_reset();
+}
+
+#endif // SDCARD_ENABLE && SDCARD_ELIDE_ENABLE
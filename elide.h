@@ -0,0 +1,35 @@
+/*
+  elide.h - redundant modal word elision for the job stream
+
+  Part of SDCard plugin for grblHAL
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+typedef int16_t (*elide_reader_ptr)(void);
+
+typedef struct {
+    uint32_t bytes;         // Bytes removed from the job.
+    uint32_t words;         // Words removed from the job.
+} elide_stats_t;
+
+void elide_init (void);
+void elide_start (void);
+void elide_reset (void);
+int16_t elide_read (elide_reader_ptr read);
+elide_stats_t *elide_get_stats (void);
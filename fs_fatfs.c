@@ -23,10 +23,16 @@
 #include "../driver.h"
 #include "../grbl/platform.h"
 #include "../grbl/vfs.h"
+#include "../grbl/hal.h"
+#include "../grbl/protocol.h"
+#include "../grbl/state_machine.h"
 #else
 #include "driver.h"
 #include "grbl/platform.h"
 #include "grbl/vfs.h"
+#include "grbl/hal.h"
+#include "grbl/protocol.h"
+#include "grbl/state_machine.h"
 #endif
 
 #if SDCARD_ENABLE
@@ -47,11 +53,22 @@
 #include "fatfs/src/diskio.h"
 #endif
 
+#include <stdio.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include "fs_fatfs.h"
+#include "fs_notify.h"
+#include "memstats.h"
+#include "fs_handles.h"
+#include "fs_meta.h"
+
+#if SDCARD_VFS_PROFILE_ENABLE
+#include "vfs_profile.h"
+#endif
+
 #ifndef ESP_PLATFORM
 #define FF_DIR DIR
 #endif
@@ -61,6 +78,664 @@
 #define _MAX_LFN FF_MAX_LFN
 #endif
 
+// Number of entries in the stat cache, 0 (default) disables it.
+// The cache holds the directory information for recently looked up paths,
+// including paths not found, so that repeated vfs_stat() calls and opens of
+// missing files in large directories do not have to scan the directory.
+// Opening an existing file still scans as FatFs has no public API for opening
+// from a known directory entry. A file may be reached by more than one path,
+// e.g. by its short name, so the cache is flushed on any change.
+#ifndef FATFS_STAT_CACHE_SIZE
+#define FATFS_STAT_CACHE_SIZE 0
+#endif
+#ifndef FATFS_STAT_CACHE_PATHLEN
+#define FATFS_STAT_CACHE_PATHLEN 48
+#endif
+
+#define FATFS_DEFERRED_DELETE (SDCARD_DEFERRED_DELETE_ENABLE && FF_FS_READONLY == 0 && FF_FS_MINIMIZE == 0)
+#define FATFS_HANDLE_CACHE (SDCARD_ENABLE && SDCARD_HANDLE_CACHE_ENABLE)
+#define FATFS_META (SDCARD_ENABLE && SDCARD_META_ENABLE && FF_FS_READONLY == 0 && FF_FS_MINIMIZE == 0)
+#ifdef ESP_PLATFORM
+#define FATFS_FATTIME_GEN 0
+#define FATFS_SEQUENTIAL 0
+#else
+// The generation counter is always used by features that rely on the modification time for validation.
+#define FATFS_FATTIME_GEN ((SDCARD_FATTIME_GEN_ENABLE || SDCARD_JOBCACHE_ENABLE || SDCARD_SYNC_ENABLE || SDCARD_PREVIEW_ENABLE || \
+                            SDCARD_HANDLE_CACHE_ENABLE || SDCARD_META_ENABLE) && FF_FS_READONLY == 0)
+#define FATFS_SEQUENTIAL SDCARD_SEQUENTIAL_HINT_ENABLE
+#endif
+
+typedef struct {
+    FIL fil;
+    bool write;    // Opened for writing.
+#if FS_NOTIFY_ENABLE
+    char path[];   // Path if opened for writing.
+#endif
+} fatfs_file_t;
+
+#if FATFS_SEQUENTIAL
+
+// Only one file at a time can be read with a transfer kept running by the driver.
+static FIL *sequential = NULL;
+
+static void sequential_hint (FIL *fil, BYTE on)
+{
+    if(on)
+        sequential = fil;
+    else if(sequential == fil)
+        sequential = NULL;
+    else
+        return;
+
+    disk_ioctl(fil->obj.fs->pdrv, CTRL_SEQUENTIAL, &on);
+}
+
+#endif
+
+static char mount_path[32];
+
+#if FATFS_STAT_CACHE_SIZE
+
+typedef struct {
+    uint32_t hash;
+    FSIZE_t fsize;
+    WORD fdate;
+    WORD ftime;
+    BYTE fattrib;
+    bool exists;
+    char path[FATFS_STAT_CACHE_PATHLEN];
+} stat_cache_entry_t;
+
+static stat_cache_entry_t stat_cache[FATFS_STAT_CACHE_SIZE];
+
+static inline char fold (char c)
+{
+    return c >= 'A' && c <= 'Z' ? c | 0x20 : c;
+}
+
+// FNV-1a hash of path, case insensitive as FatFs paths are.
+static uint32_t stat_hash (const char *path)
+{
+    uint32_t hash = 2166136261UL;
+
+    while(*path)
+        hash = (hash ^ (uint8_t)fold(*path++)) * 16777619UL;
+
+    return hash ? hash : 1;
+}
+
+static stat_cache_entry_t *stat_cache_get (const char *path, uint32_t hash)
+{
+    stat_cache_entry_t *entry = &stat_cache[hash % FATFS_STAT_CACHE_SIZE];
+
+    if(entry->hash == hash) {
+        const char *s = entry->path;
+        while(*s && fold(*s) == fold(*path)) {
+            s++;
+            path++;
+        }
+        if(*s == *path)
+            return entry;
+    }
+
+    return NULL;
+}
+
+static void stat_cache_add (const char *path, uint32_t hash, FRESULT res, FILINFO *f)
+{
+    stat_cache_entry_t *entry = &stat_cache[hash % FATFS_STAT_CACHE_SIZE];
+
+    if(strlen(path) < FATFS_STAT_CACHE_PATHLEN && (res == FR_OK || res == FR_NO_FILE)) {
+        entry->hash = hash;
+        strcpy(entry->path, path);
+        if((entry->exists = res == FR_OK)) {
+            entry->fsize = f->fsize;
+            entry->fdate = f->fdate;
+            entry->ftime = f->ftime;
+            entry->fattrib = f->fattrib;
+        }
+    }
+}
+
+static inline void stat_cache_flush (void)
+{
+    memset(stat_cache, 0, sizeof(stat_cache));
+}
+
+#else
+
+static inline void stat_cache_flush (void)
+{
+}
+
+#endif // FATFS_STAT_CACHE_SIZE
+
+static FRESULT cached_stat (const char *filename, FILINFO *f)
+{
+#if FATFS_STAT_CACHE_SIZE
+    FRESULT res;
+    uint32_t hash = stat_hash(filename);
+    stat_cache_entry_t *entry;
+
+    if((entry = stat_cache_get(filename, hash))) {
+        if(!entry->exists)
+            return FR_NO_FILE;
+        f->fsize = entry->fsize;
+        f->fdate = entry->fdate;
+        f->ftime = entry->ftime;
+        f->fattrib = entry->fattrib;
+        return FR_OK;
+    }
+
+    stat_cache_add(filename, hash, res = f_stat(filename, f), f);
+
+    return res;
+#else
+    return f_stat(filename, f);
+#endif
+}
+
+#if FATFS_DEFERRED_DELETE
+
+// Deferred deletion, files are moved to a hidden directory on unlink and truncated
+// from the end a few clusters at a time in idle time slices before finally being deleted.
+// Freed clusters are discarded (CTRL_TRIM) by FatFs itself if FF_USE_TRIM is enabled in
+// ffconf.h, if not they are discarded here if the disk driver supports CTRL_TRIM.
+
+#define TRASH_DIR "/.deleted"
+#define TRASH_STEP_CLUSTERS 32 // Max. number of clusters to free per time slice.
+
+#if FF_MAX_SS == FF_MIN_SS
+#define SECTOR_SIZE(fs) FF_MAX_SS
+#else
+#define SECTOR_SIZE(fs) ((fs)->ssize)
+#endif
+
+#if FF_LBA64
+typedef QWORD trim_lba_t;
+#else
+typedef DWORD trim_lba_t;
+#endif
+
+static struct {
+    bool pending;   // Trash directory may contain files.
+    bool active;    // A file is open for truncation.
+    bool trim;      // Disk driver supports CTRL_TRIM.
+    uint32_t seq;
+    FIL fil;
+    char name[sizeof(TRASH_DIR) + 13];
+} trash = {0};
+
+static on_execute_realtime_ptr on_execute_realtime;
+static on_vfs_unmount_ptr on_vfs_unmount;
+
+// Moves file to the trash directory, returns false if it is a directory or cannot be moved.
+// Read only files are refused as f_unlink() does, res is then set to FR_DENIED.
+static bool trash_file (const char *filename, FRESULT *res)
+{
+    FILINFO fi;
+    uint_fast8_t retries = 4;
+
+    if(f_stat(filename, &fi) != FR_OK || (fi.fattrib & AM_DIR) || !strncmp(filename, TRASH_DIR, sizeof(TRASH_DIR) - 1))
+        return false;
+
+    if(fi.fattrib & AM_RDO) {
+        *res = FR_DENIED;
+        return true;
+    }
+
+    if((*res = f_mkdir(TRASH_DIR)) == FR_OK) {
+#if FF_USE_CHMOD
+        f_chmod(TRASH_DIR, AM_HID, AM_HID);
+#endif
+    } else if(*res != FR_EXIST)
+        return false;
+
+    do {
+        sprintf(trash.name, TRASH_DIR "/%08lX.DEL", (unsigned long)++trash.seq);
+    } while((*res = f_rename(filename, trash.name)) == FR_EXIST && --retries);
+
+    if(*res == FR_OK)
+        trash.pending = true;
+
+    return *res == FR_OK;
+}
+
+// Opens the next file in the trash directory, if any.
+static bool trash_next (void)
+{
+    FF_DIR dir;
+    FILINFO fi;
+    bool found = false;
+
+    if(f_opendir(&dir, TRASH_DIR) == FR_OK) {
+        found = f_readdir(&dir, &fi) == FR_OK && *fi.fname != '\0' && strlen(fi.fname) < sizeof(trash.name) - sizeof(TRASH_DIR);
+        f_closedir(&dir);
+    }
+
+    if(found) {
+        sprintf(trash.name, TRASH_DIR "/%s", fi.fname);
+        if(!(trash.active = f_open(&trash.fil, trash.name, FA_READ|FA_WRITE) == FR_OK))
+            found = f_unlink(trash.name) == FR_OK;
+    }
+
+    return (trash.pending = found) && trash.active;
+}
+
+#if defined(CTRL_TRIM) && !FF_USE_TRIM && !defined(ESP_PLATFORM)
+
+static void trash_discard (FATFS *fs, trim_lba_t *range)
+{
+    trash.trim = disk_ioctl(fs->pdrv, CTRL_TRIM, range) == RES_OK;
+}
+
+// Discards the clusters holding the file data from offset to the end of the file.
+// Seeking forward to a cluster boundary leaves the current cluster at the one holding the
+// preceding byte, the chain is thus walked only once.
+static void trash_trim (FSIZE_t offset, FSIZE_t size, DWORD bcs)
+{
+    bool pending = false;
+    trim_lba_t sect, range[2];
+    FATFS *fs = trash.fil.obj.fs;
+
+    while(trash.trim && offset < size) {
+
+        offset = size - offset > bcs ? offset + bcs : size;
+
+        if(f_lseek(&trash.fil, offset) != FR_OK)
+            break;
+
+        sect = fs->database + (trim_lba_t)fs->csize * (trash.fil.clust - 2);
+
+        if(pending && sect == range[1] + 1)
+            range[1] += fs->csize;
+        else {
+            if(pending)
+                trash_discard(fs, range);
+            range[0] = sect;
+            range[1] = sect + fs->csize - 1;
+            pending = true;
+        }
+    }
+
+    if(pending && trash.trim)
+        trash_discard(fs, range);
+}
+
+#endif
+
+// Frees up to TRASH_STEP_CLUSTERS clusters from the end of the current file per call when idle.
+static void trash_process (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    if(trash.pending && state == STATE_IDLE && hal.stream.type != StreamType_File && (trash.active || trash_next())) {
+
+        FSIZE_t size = f_size(&trash.fil), offset = 0;
+        DWORD bcs = (DWORD)trash.fil.obj.fs->csize * SECTOR_SIZE(trash.fil.obj.fs),
+              n_clusters = (size + bcs - 1) / bcs;
+
+        if(n_clusters > TRASH_STEP_CLUSTERS)
+            offset = (FSIZE_t)(n_clusters - TRASH_STEP_CLUSTERS) * bcs;
+
+#if defined(CTRL_TRIM) && !FF_USE_TRIM && !defined(ESP_PLATFORM)
+        trash_trim(offset, size, bcs);
+#endif
+
+        if(offset == 0 || f_lseek(&trash.fil, offset) != FR_OK || f_truncate(&trash.fil) != FR_OK || f_sync(&trash.fil) != FR_OK) {
+            trash.active = false;
+            f_close(&trash.fil);
+            trash.pending = f_unlink(trash.name) == FR_OK; // Give up on failure, retried on next mount.
+        }
+    }
+}
+
+static void trash_on_unmount (const char *path)
+{
+    if(!strcmp(path, mount_path))
+        trash.active = trash.pending = false;
+
+    if(on_vfs_unmount)
+        on_vfs_unmount(path);
+}
+
+static void trash_init (void)
+{
+    static bool hooked = false;
+
+    if(!hooked) {
+
+        hooked = true;
+
+        on_execute_realtime = grbl.on_execute_realtime;
+        grbl.on_execute_realtime = trash_process;
+
+        on_vfs_unmount = vfs.on_unmount;
+        vfs.on_unmount = trash_on_unmount;
+    }
+
+    trash.seq = hal.get_elapsed_ticks();
+    trash.active = false;
+    trash.pending = trash.trim = true; // Process any files left over from a previous session.
+}
+
+#endif // FATFS_DEFERRED_DELETE
+
+#if FATFS_FATTIME_GEN
+
+// When no RTC is available timestamps are derived from a generation counter kept in a hidden file.
+// The generation is bumped on each mount and for every 24 hours of uptime, it sets the date as days
+// since 1980-01-01 and the uptime within the generation sets the time of day. Timestamps are thus
+// monotonic across boots and can be used for validating caches and sidecar files.
+
+#define FATTIME_GEN_FILE "/.fatgen"
+#define FATTIME_EPOCH 315532800UL   // 1980-01-01 00:00:00 as Unix time.
+#define FATTIME_GEN_MAX 46000UL     // Keeps the date within the FAT limit of 2107.
+
+static struct {
+    bool valid;
+    uint32_t gen;
+    uint32_t base;  // Tick count at start of generation.
+} fattime = {0};
+
+static void fattime_store (void *data)
+{
+    FIL fil;
+    UINT bw;
+
+    stat_cache_flush();
+
+    if(f_open(&fil, FATTIME_GEN_FILE, FA_WRITE|FA_OPEN_ALWAYS) == FR_OK) {
+        f_write(&fil, &fattime.gen, sizeof(uint32_t), &bw);
+        f_close(&fil);
+#if FF_USE_CHMOD
+        f_chmod(FATTIME_GEN_FILE, AM_HID|AM_SYS, AM_HID|AM_SYS);
+#endif
+    }
+}
+
+static void fattime_init (void)
+{
+    FIL fil;
+    UINT br;
+    struct tm dt;
+    uint32_t gen = 0;
+
+    if((fattime.valid = !(hal.rtc.get_datetime && hal.rtc.get_datetime(&dt)))) {
+
+        if(f_open(&fil, FATTIME_GEN_FILE, FA_READ) == FR_OK) {
+            if(f_read(&fil, &gen, sizeof(uint32_t), &br) != FR_OK || br != sizeof(uint32_t))
+                gen = 0;
+            f_close(&fil);
+        }
+
+        fattime.gen = gen < FATTIME_GEN_MAX ? gen + 1 : FATTIME_GEN_MAX;
+        fattime.base = hal.get_elapsed_ticks();
+        fattime_store(NULL);
+    }
+}
+
+#endif // FATFS_FATTIME_GEN
+
+// Returns the current time in FAT format, to be called from get_fattime() in the driver.
+// The RTC is used when running, if not a timestamp derived from the generation counter is
+// returned when enabled. A fixed timestamp is returned as a last resort.
+uint32_t fs_fatfs_get_fattime (void)
+{
+    struct tm dt, *t = NULL;
+
+    if(hal.rtc.get_datetime && hal.rtc.get_datetime(&dt) && dt.tm_year >= 80)
+        t = &dt;
+#if FATFS_FATTIME_GEN
+    else if(fattime.valid) {
+
+        time_t now;
+        uint32_t secs = (hal.get_elapsed_ticks() - fattime.base) / 1000;
+
+        if(secs >= 86400UL && fattime.gen < FATTIME_GEN_MAX) {
+            while(secs >= 86400UL && fattime.gen < FATTIME_GEN_MAX) {
+                fattime.gen++;
+                fattime.base += 86400000UL;
+                secs -= 86400UL;
+            }
+            protocol_enqueue_foreground_task(fattime_store, NULL); // Not safe to write from within a FatFs call.
+        }
+
+        now = (time_t)(FATTIME_EPOCH + fattime.gen * 86400UL + (secs < 86400UL ? secs : 86399UL));
+        t = gmtime(&now);
+    }
+#endif
+
+    return t ? ((uint32_t)(t->tm_year - 80) << 25) | ((uint32_t)(t->tm_mon + 1) << 21) | ((uint32_t)t->tm_mday << 16) |
+                ((uint32_t)t->tm_hour << 11) | ((uint32_t)t->tm_min << 5) | ((uint32_t)t->tm_sec >> 1)
+             : ((2025UL - 1980) << 25) | (1UL << 21) | (1UL << 16); // 2025-01-01 00:00:00
+}
+
+#if FATFS_META
+
+// Metadata blobs for the files in a directory are kept in a hidden file in the directory. The file
+// holds a sequence of records, each a meta_record_t followed by the file name and the blob. Records
+// are overwritten in place when the blob size is unchanged, else marked as deleted and appended.
+// Deleted records are removed when the file grows above META_MAX_FILE_SIZE.
+
+#define META_FILE ".meta"
+#define META_NAMELEN 64
+#define META_PATHLEN 96
+#define META_MAX_FILE_SIZE 4096
+#define META_ANY_TAG 0
+
+typedef struct {
+    uint8_t tag;        // fs_meta_tag_t, 0 if deleted.
+    uint8_t size;       // Size of blob.
+    uint8_t name_len;   // Length of file name.
+    uint8_t reserved;
+} meta_record_t;
+
+// Sets meta to the path of the metadata file for the directory of path, returns the file name or NULL if too long.
+static const char *meta_path (char *meta, const char *path)
+{
+    const char *leaf = strrchr(path, '/');
+    size_t dirlen = leaf ? (size_t)(leaf - path) + 1 : 0;
+
+    leaf = leaf ? leaf + 1 : path;
+
+    if(*leaf == '\0' || strlen(leaf) > META_NAMELEN || dirlen + sizeof(META_FILE) > META_PATHLEN)
+        return NULL;
+
+    memcpy(meta, path, dirlen);
+    strcpy(meta + dirlen, META_FILE);
+
+    return leaf;
+}
+
+// Scans from the current position for a live record for name, returns offset of record or -1 if not found.
+// The file pointer is left at the start of the blob when found.
+static FSIZE_t meta_find (FIL *fil, const char *name, uint8_t tag, meta_record_t *rec)
+{
+    UINT br;
+    size_t idx, len = strlen(name);
+    char buf[META_NAMELEN];
+    FSIZE_t pos = f_tell(fil);
+
+    while(f_read(fil, rec, sizeof(meta_record_t), &br) == FR_OK && br == sizeof(meta_record_t)) {
+
+        if(rec->tag && (tag == META_ANY_TAG || rec->tag == tag) && rec->name_len == len) {
+            if(f_read(fil, buf, len, &br) != FR_OK || br != len)
+                break;
+            for(idx = 0; idx < len && LCAPS(buf[idx]) == LCAPS(name[idx]); idx++);
+            if(idx == len)
+                return pos;
+        } else if(f_lseek(fil, f_tell(fil) + rec->name_len) != FR_OK)
+            break;
+
+        if(f_lseek(fil, f_tell(fil) + rec->size) != FR_OK)
+            break;
+
+        pos = f_tell(fil);
+    }
+
+    return (FSIZE_t)-1;
+}
+
+// Removes deleted records by moving live records down and truncating the file.
+static void meta_compact (FIL *fil)
+{
+    UINT br;
+    size_t len;
+    FSIZE_t rd = 0, wr = 0;
+    uint8_t buf[sizeof(meta_record_t) + META_NAMELEN + FS_META_MAX_SIZE];
+    meta_record_t *rec = (meta_record_t *)buf;
+
+    while(f_lseek(fil, rd) == FR_OK && f_read(fil, rec, sizeof(meta_record_t), &br) == FR_OK && br == sizeof(meta_record_t)) {
+        len = sizeof(meta_record_t) + rec->name_len + rec->size;
+        if(rec->name_len > META_NAMELEN || rec->size > FS_META_MAX_SIZE)
+            break; // Corrupt, drop the rest.
+        if(rec->tag) {
+            if(f_read(fil, buf + sizeof(meta_record_t), len - sizeof(meta_record_t), &br) != FR_OK || br != len - sizeof(meta_record_t))
+                break;
+            if(wr != rd && (f_lseek(fil, wr) != FR_OK || f_write(fil, buf, len, &br) != FR_OK || br != len))
+                break;
+            wr += len;
+        }
+        rd += len;
+    }
+
+    if(f_lseek(fil, wr) == FR_OK)
+        f_truncate(fil);
+}
+
+static int meta_get (void *context, const char *path, fs_meta_tag_t tag, void *data, size_t size)
+{
+    FIL fil;
+    UINT br;
+    int res = -1;
+    meta_record_t rec;
+    const char *name;
+    char meta[META_PATHLEN];
+
+    if((name = meta_path(meta, path)) && f_open(&fil, meta, FA_READ) == FR_OK) {
+        if(meta_find(&fil, name, tag, &rec) != (FSIZE_t)-1 && rec.size <= size &&
+            f_read(&fil, data, rec.size, &br) == FR_OK && br == rec.size)
+            res = rec.size;
+        f_close(&fil);
+    }
+
+    return res;
+}
+
+static int meta_set (void *context, const char *path, fs_meta_tag_t tag, const void *data, size_t size)
+{
+    FIL fil;
+    UINT bw;
+    FSIZE_t pos;
+    int res = -1;
+    bool created;
+    meta_record_t rec;
+    const char *name;
+    char meta[META_PATHLEN];
+
+    if(size > FS_META_MAX_SIZE || (name = meta_path(meta, path)) == NULL)
+        return -1;
+
+    stat_cache_flush();
+
+    if(f_open(&fil, meta, FA_READ|FA_WRITE|FA_OPEN_ALWAYS) == FR_OK) {
+
+        created = f_size(&fil) == 0;
+
+        if((pos = meta_find(&fil, name, tag, &rec)) != (FSIZE_t)-1) {
+            if(rec.size == size) // Same size, overwrite blob in place.
+                res = f_write(&fil, data, size, &bw) == FR_OK && bw == size ? (int)size : -1;
+            else if(f_lseek(&fil, pos) == FR_OK) {
+                rec.tag = 0;
+                f_write(&fil, &rec, sizeof(meta_record_t), &bw);
+            }
+        }
+
+        if(res == -1) {
+
+            if(f_size(&fil) > META_MAX_FILE_SIZE)
+                meta_compact(&fil);
+
+            rec.tag = (uint8_t)tag;
+            rec.size = (uint8_t)size;
+            rec.name_len = (uint8_t)strlen(name);
+            rec.reserved = 0;
+
+            if(f_lseek(&fil, f_size(&fil)) == FR_OK &&
+                f_write(&fil, &rec, sizeof(meta_record_t), &bw) == FR_OK && bw == sizeof(meta_record_t) &&
+                 f_write(&fil, name, rec.name_len, &bw) == FR_OK && bw == rec.name_len &&
+                  f_write(&fil, data, size, &bw) == FR_OK && bw == size)
+                res = (int)size;
+        }
+
+        f_close(&fil);
+
+#if FF_USE_CHMOD
+        if(created)
+            f_chmod(meta, AM_HID, AM_HID);
+#endif
+    }
+
+    return res;
+}
+
+// Marks records for path as deleted, all records if tag is META_ANY_TAG.
+static int meta_remove (void *context, const char *path, fs_meta_tag_t tag)
+{
+    FIL fil;
+    UINT bw;
+    FSIZE_t pos;
+    int res = -1;
+    meta_record_t rec;
+    const char *name;
+    char meta[META_PATHLEN];
+
+    if((name = meta_path(meta, path)) && f_open(&fil, meta, FA_READ|FA_WRITE) == FR_OK) {
+
+        while((pos = meta_find(&fil, name, tag, &rec)) != (FSIZE_t)-1) {
+            rec.tag = 0;
+            if(f_lseek(&fil, pos) != FR_OK || f_write(&fil, &rec, sizeof(meta_record_t), &bw) != FR_OK ||
+                f_lseek(&fil, pos + sizeof(meta_record_t) + rec.name_len + rec.size) != FR_OK)
+                break;
+            res = 0;
+        }
+
+        f_close(&fil);
+    }
+
+    return res;
+}
+
+static const fs_meta_api_t meta_api = {
+    .get = meta_get,
+    .set = meta_set,
+    .remove = meta_remove
+};
+
+#endif // FATFS_META
+
+static inline bool is_hidden_entry (FF_DIR *dir, const char *name)
+{
+#if FATFS_DEFERRED_DELETE || FATFS_FATTIME_GEN
+    bool root = dir->obj.sclust == 0; // The root directory has no start cluster.
+#endif
+#if FATFS_DEFERRED_DELETE
+    if(root && !strcmp(name, TRASH_DIR + 1))
+        return true;
+#endif
+#if FATFS_FATTIME_GEN
+    if(root && !strcmp(name, FATTIME_GEN_FILE + 1))
+        return true;
+#endif
+#if FATFS_META
+    if(!strcmp(name, META_FILE))
+        return true;
+#endif
+
+    return !strcmp(name, "System Volume Information");
+}
+
 static inline char *get_name (FILINFO *file)
 {
 #if _USE_LFN
@@ -70,35 +745,131 @@ static inline char *get_name (FILINFO *file)
 #endif
 }
 
+static void file_close (vfs_file_t *file);
+
 static vfs_file_t *fs_open (const char *filename, const char *mode)
 {
     BYTE flags = 0;
-    vfs_file_t *file = malloc(sizeof(vfs_file_t) + sizeof(FIL));
+    vfs_file_t *file;
+#if FATFS_SEQUENTIAL
+    bool seq = false;
+#endif
+
+#if FATFS_HANDLE_CACHE
+    FILINFO fi;
+    uint32_t mtime = 0;
+    bool cacheable;
+
+    if((cacheable = fs_handle_cacheable(filename, mode)) && cached_stat(filename, &fi) == FR_OK) {
+        mtime = ((uint32_t)fi.fdate << 16) | fi.ftime;
+        if((file = fs_handle_get(mount_path, filename, mtime)))
+            return file;
+    }
+#endif
+
+    while (*mode != '\0') {
+        if (*mode == 'r')
+            flags |= FA_READ;
+        else if (*mode == 'w')
+            flags |= FA_WRITE | FA_CREATE_ALWAYS;
+        else if (*mode == 'a')
+#ifdef FA_OPEN_APPEND
+            flags |= FA_WRITE | FA_OPEN_APPEND;
+#else
+            flags |= FA_WRITE | FA_OPEN_ALWAYS;
+#endif
+#if FATFS_SEQUENTIAL
+        else if (*mode == 'S')
+            seq = true;
+#endif
+        mode++;
+    }
+
+#if FATFS_STAT_CACHE_SIZE
+    stat_cache_entry_t *entry;
+
+    if(!(flags & FA_WRITE) && (entry = stat_cache_get(filename, stat_hash(filename))) && !entry->exists) {
+        vfs_errno = FR_NO_FILE;
+        return NULL;
+    }
+#endif
+
+#if FS_NOTIFY_ENABLE
+    file = MEMSTATS_ALLOC(MemGroup_FatFs, sizeof(vfs_file_t) + sizeof(fatfs_file_t) + ((flags & FA_WRITE) ? strlen(filename) + 1 : 0));
+#else
+    file = MEMSTATS_ALLOC(MemGroup_FatFs, sizeof(vfs_file_t) + sizeof(fatfs_file_t));
+#endif
 
     if(file) {
 
-        while (*mode != '\0') {
-            if (*mode == 'r')
-                flags |= FA_READ;
-            else if (*mode == 'w')
-                flags |= FA_WRITE | FA_CREATE_ALWAYS;
-            mode++;
+        fatfs_file_t *f = (fatfs_file_t *)&file->handle;
+
+        if((f->write = !!(flags & FA_WRITE))) {
+            stat_cache_flush();
+#if FATFS_HANDLE_CACHE
+            fs_handle_invalidate(mount_path, filename);
+#endif
+#if FS_NOTIFY_ENABLE
+            strcpy(f->path, filename);
+#endif
         }
 
-        if((vfs_errno = f_open((FIL *)&file->handle, filename, flags)) != FR_OK) {
-            free(file);
+        if((vfs_errno = f_open(&f->fil, filename, flags)) != FR_OK) {
+            MEMSTATS_FREE(MemGroup_FatFs, file);
             file = NULL;
-        } else
-            file->size = f_size((FIL *)&file->handle);
+        } else {
+            file->size = f_size(&f->fil);
+#ifndef FA_OPEN_APPEND
+            if(flags & FA_OPEN_ALWAYS)
+                f_lseek(&f->fil, file->size);
+#endif
+#if FATFS_SEQUENTIAL
+            if(seq && !(flags & FA_WRITE))
+                sequential_hint(&f->fil, 1);
+#endif
+#if FATFS_HANDLE_CACHE
+            if(cacheable)
+                fs_handle_track(mount_path, filename, file, mtime, file_close);
+#endif
+        }
     }
 
     return file;
 }
 
+static void file_close (vfs_file_t *file)
+{
+    fatfs_file_t *f = (fatfs_file_t *)&file->handle;
+#if FS_NOTIFY_ENABLE
+    FSIZE_t size = f_size(&f->fil);
+#endif
+
+#if FATFS_SEQUENTIAL
+    sequential_hint(&f->fil, 0);
+#endif
+
+    f_close(&f->fil);
+
+    if(f->write) {
+        stat_cache_flush();
+#if FS_NOTIFY_ENABLE
+        fs_notify(Journal_Changed, mount_path, f->path, NULL, size);
+#endif
+    }
+
+    MEMSTATS_FREE(MemGroup_FatFs, file);
+}
+
 static void fs_close (vfs_file_t *file)
 {
-    f_close((FIL *)&file->handle);
-    free(file);
+#if FATFS_HANDLE_CACHE
+    if(fs_handle_release(file)) {   // Parked in handle cache?
+        f_lseek(&((fatfs_file_t *)&file->handle)->fil, 0); // Yes, rewind for next use.
+        return;
+    }
+#endif
+
+    file_close(file);
 }
 
 static size_t fs_read (void *buffer, size_t size, size_t count, vfs_file_t *file)
@@ -109,6 +880,25 @@ static size_t fs_read (void *buffer, size_t size, size_t count, vfs_file_t *file
     return (size_t)bytesread;
 }
 
+#if SDCARD_DIRECT_READ_ENABLE
+
+static int16_t fs_getc (vfs_file_t *file)
+{
+    BYTE c;
+    UINT bytesread;
+
+    return f_read((FIL *)&file->handle, &c, 1, &bytesread) == FR_OK && bytesread == 1 ? (int16_t)c : -1;
+}
+
+// Returns a read function bound directly to FatFs if file is on the FatFs mount, NULL if not.
+// Files opened via a wrapper such as the profiler are not bound so that they keep going through it.
+fs_fatfs_getc_ptr fs_fatfs_get_reader (vfs_file_t *file)
+{
+    return file && ((const vfs_t *)file->fs)->fread == fs_read ? fs_getc : NULL;
+}
+
+#endif
+
 static size_t fs_write (const void *buffer, size_t size, size_t count, vfs_file_t *file)
 {
     UINT byteswritten = 0;
@@ -128,6 +918,11 @@ static size_t fs_tell (vfs_file_t *file)
 
 static int fs_seek (vfs_file_t *file, size_t offset)
 {
+#if FATFS_SEQUENTIAL
+    if(sequential == (FIL *)&file->handle && offset != f_tell(sequential))
+        sequential_hint(sequential, 1); // Restart transfer at new position.
+#endif
+
     return f_lseek((FIL *)&file->handle, offset);
 }
 
@@ -141,7 +936,27 @@ static int fs_rename (const char *from, const char *to)
 #if FF_FS_READONLY
     return -1;
 #else
-    return f_rename(from, to);
+    FRESULT res;
+
+    stat_cache_flush(); // Directories may be renamed, flush all.
+#if FATFS_HANDLE_CACHE
+    fs_handle_invalidate(mount_path, NULL);
+#endif
+
+#if FS_NOTIFY_ENABLE
+    if((res = f_rename(from, to)) == FR_OK)
+        fs_notify(Journal_Renamed, mount_path, from, to, 0);
+#else
+    res = f_rename(from, to);
+#endif
+#if FATFS_META
+    if(res == FR_OK) { // Records are keyed on the name, drop them for both.
+        meta_remove(NULL, from, META_ANY_TAG);
+        meta_remove(NULL, to, META_ANY_TAG);
+    }
+#endif
+
+    return res;
 #endif
 }
 
@@ -150,7 +965,30 @@ static int fs_unlink (const char *filename)
 #if FF_FS_READONLY
     return -1;
 #else
-    return f_unlink(filename);
+    FRESULT res;
+
+    stat_cache_flush();
+#if FATFS_HANDLE_CACHE
+    fs_handle_invalidate(mount_path, filename);
+#endif
+
+#if FATFS_DEFERRED_DELETE
+    if(!trash_file(filename, &res))
+        res = f_unlink(filename);
+#else
+    res = f_unlink(filename);
+#endif
+
+#if FS_NOTIFY_ENABLE
+    if(res == FR_OK)
+        fs_notify(Journal_Deleted, mount_path, filename, NULL, 0);
+#endif
+#if FATFS_META
+    if(res == FR_OK)
+        meta_remove(NULL, filename, META_ANY_TAG);
+#endif
+
+    return res;
 #endif
 }
 
@@ -159,13 +997,29 @@ static int fs_mkdir (const char *path)
 #if FF_FS_READONLY
     return -1;
 #else
-    return f_mkdir(path);
+    FRESULT res;
+
+    stat_cache_flush();
+
+#if FS_NOTIFY_ENABLE
+    if((res = f_mkdir(path)) == FR_OK)
+        fs_notify(Journal_DirCreated, mount_path, path, NULL, 0);
+#else
+    res = f_mkdir(path);
+#endif
+
+    return res;
 #endif
 }
 
 static int fs_chdir (const char *path)
 {
 #if FF_FS_RPATH
+    stat_cache_flush(); // Relative paths changes meaning.
+#if FATFS_HANDLE_CACHE
+    fs_handle_invalidate(mount_path, NULL);
+#endif
+
     return f_chdir(path);
 #else
     return -1;
@@ -196,11 +1050,11 @@ static char *fs_getcwd (char *buf, size_t size)
 
 static vfs_dir_t *fs_opendir (const char *path)
 {
-    vfs_dir_t *dir = malloc(sizeof(vfs_dir_t) + sizeof(FF_DIR));
+    vfs_dir_t *dir = MEMSTATS_ALLOC(MemGroup_FatFs, sizeof(vfs_dir_t) + sizeof(FF_DIR));
 
     if (dir && (vfs_errno = f_opendir((FF_DIR *)&dir->handle, path)) != FR_OK)
     {
-        free(dir);
+        MEMSTATS_FREE(MemGroup_FatFs, dir);
         dir = NULL;
     }
 
@@ -225,8 +1079,10 @@ static char *fs_readdir (vfs_dir_t *dir, vfs_dirent_t *dirent)
     if ((vfs_errno = f_readdir((FF_DIR *)&dir->handle, &fi)) != FR_OK || *fi.fname == '\0')
         return NULL;
 
-    if(!strcmp(fi.fname, "System Volume Information") && ((vfs_errno = f_readdir((FF_DIR *)&dir->handle, &fi)) != FR_OK || *fi.fname == '\0'))
-        return NULL;
+    while(is_hidden_entry((FF_DIR *)&dir->handle, fi.fname)) {
+        if((vfs_errno = f_readdir((FF_DIR *)&dir->handle, &fi)) != FR_OK || *fi.fname == '\0')
+            return NULL;
+    }
 
     if(*fi.fname != '\0')
         strcpy(dirent->name, fi.fname);
@@ -245,7 +1101,7 @@ static void fs_closedir (vfs_dir_t *dir)
 //    f_closedir(&dir);
 //#endif
 
-        free(dir);
+        MEMSTATS_FREE(MemGroup_FatFs, dir);
     }
 }
 
@@ -256,7 +1112,7 @@ static int fs_stat (const char *filename, vfs_stat_t *st)
     f.lfname = NULL;
 #endif
 
-    if ((vfs_errno = f_stat(filename, &f)) == FR_OK) {
+    if ((vfs_errno = cached_stat(filename, &f)) == FR_OK) {
         st->st_size = f.fsize;
         st->st_mode.mode = f.fattrib;
         struct tm tm  = {
@@ -287,6 +1143,11 @@ static int fs_utime (const char *filename, struct tm *modified)
     fno.fdate = (WORD)(((modified->tm_year - 80) * 512U) | (modified->tm_mon + 1) * 32U | modified->tm_mday);
     fno.ftime = (WORD)(modified->tm_hour * 2048U | modified->tm_min * 32U | modified->tm_sec / 2U);
 
+    stat_cache_flush();
+#if FATFS_HANDLE_CACHE
+    fs_handle_invalidate(mount_path, filename);
+#endif
+
     return f_utime(filename, &fno);
 #else
     return -1;
@@ -315,12 +1176,17 @@ static bool fs_getfree (vfs_free_t *free)
 #if FF_FS_READONLY == 0 && FF_USE_MKFS == 1
 static int fs_format (void)
 {
-    void *work = malloc(FF_MAX_SS);
+    void *work = MEMSTATS_ALLOC(MemGroup_FatFs, FF_MAX_SS);
 
     FRESULT res = f_mkfs("/", FM_ANY, 0, work, work ? FF_MAX_SS : 0);
 
+    stat_cache_flush();
+#if FATFS_HANDLE_CACHE
+    fs_handle_invalidate(mount_path, NULL);
+#endif
+
     if(work)
-        free(work);
+        MEMSTATS_FREE(MemGroup_FatFs, work);
 
     return res;
 }
@@ -363,7 +1229,30 @@ void fs_fatfs_mount (const char *path)
 #endif
     };
 
+    stat_cache_flush(); // Card may have been swapped.
+#if FATFS_HANDLE_CACHE
+    fs_handle_invalidate(mount_path, NULL);
+#endif
+
+    strncpy(mount_path, path, sizeof(mount_path) - 1);
+#if SDCARD_JOURNAL_ENABLE
+    fs_journal_reset();
+#endif
+#if FATFS_DEFERRED_DELETE
+    trash_init();
+#endif
+#if FATFS_FATTIME_GEN
+    fattime_init();
+#endif
+#if FATFS_META
+    fs_meta_register(path, &meta_api, NULL);
+#endif
+
+#if SDCARD_VFS_PROFILE_ENABLE
+    vfs_mount(path, vfs_profile_wrap(path, &fs), mode);
+#else
     vfs_mount(path, &fs, mode);
+#endif
 }
 
 #endif
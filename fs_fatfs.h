@@ -21,4 +21,18 @@
 
 #pragma once
 
+// disk_ioctl() command issued for files opened with 'S' in the mode string, e.g. "rS".
+// buff points to a BYTE, 1 when reading starts or continues after a seek and 0 when the file is closed.
+// A driver may then keep a multiple block read running across calls to disk_read() as long as the
+// requests continue where the previous one ended, it should be stopped on any other access.
+// Drivers not supporting the hint should return RES_PARERR.
+#ifndef CTRL_SEQUENTIAL
+#define CTRL_SEQUENTIAL 64
+#endif
+
+// Reads a single character, returns -1 on end of file or error.
+typedef int16_t (*fs_fatfs_getc_ptr)(vfs_file_t *file);
+
 void fs_fatfs_mount (const char *path);
+uint32_t fs_fatfs_get_fattime (void);
+fs_fatfs_getc_ptr fs_fatfs_get_reader (vfs_file_t *file);
@@ -0,0 +1,152 @@
+/*
+  fs_handles.c - cache of open handles for frequently opened files
+
+  Part of SDCard plugin for grblHAL
+
+  Macros called in loops are opened and closed by the core on every call.
+  File system adapters park read only handles to macro files here on close,
+  rewound, and hand them out again on the next open of the same path.
+  Entries are validated against the modification time supplied by the adapter
+  and invalidated by the adapter when the file is changed, renamed or deleted.
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sdcard.h"
+
+#if SDCARD_ENABLE && SDCARD_HANDLE_CACHE_ENABLE
+
+#include <string.h>
+
+#ifdef ARDUINO
+#include "../grbl/vfs.h"
+#else
+#include "grbl/vfs.h"
+#endif
+
+#include "fs_handles.h"
+
+#ifndef HANDLE_CACHE_SIZE
+#define HANDLE_CACHE_SIZE 4
+#endif
+#define HANDLE_CACHE_PATHLEN 40
+
+typedef struct {
+    const void *owner;          // File system instance, NULL if entry is free.
+    vfs_file_t *file;
+    fs_handle_close_ptr close;
+    uint32_t mtime;
+    uint32_t last_used;
+    bool in_use;
+    char path[HANDLE_CACHE_PATHLEN];
+} handle_entry_t;
+
+static uint32_t tick = 0;
+static handle_entry_t cache[HANDLE_CACHE_SIZE] = {0};
+
+static void entry_free (handle_entry_t *entry)
+{
+    if(!entry->in_use)
+        entry->close(entry->file);
+
+    entry->owner = NULL; // In use handles are closed normally when released.
+}
+
+// Only macro files opened for reading are cached.
+bool fs_handle_cacheable (const char *path, const char *mode)
+{
+    size_t len = strlen(path);
+
+    return *mode == 'r' && mode[1] == '\0' && len < HANDLE_CACHE_PATHLEN && len > 6 && !strcmp(path + len - 6, ".macro");
+}
+
+// Returns a parked handle for path if available and the file is not changed, rewound by the adapter on release.
+vfs_file_t *fs_handle_get (const void *owner, const char *path, uint32_t mtime)
+{
+    uint_fast8_t idx;
+    handle_entry_t *entry;
+
+    for(idx = 0; idx < HANDLE_CACHE_SIZE; idx++) {
+        entry = &cache[idx];
+        if(entry->owner == owner && !entry->in_use && !strcmp(entry->path, path)) {
+            if(entry->mtime != mtime) {
+                entry_free(entry);
+                break;
+            }
+            entry->in_use = true;
+            entry->last_used = ++tick;
+            return entry->file;
+        }
+    }
+
+    return NULL;
+}
+
+// Adds a newly opened handle to the cache, the least recently used parked handle is closed if the cache is full.
+void fs_handle_track (const void *owner, const char *path, vfs_file_t *file, uint32_t mtime, fs_handle_close_ptr close)
+{
+    uint_fast8_t idx;
+    handle_entry_t *entry = NULL;
+
+    for(idx = 0; idx < HANDLE_CACHE_SIZE; idx++) {
+        if(cache[idx].owner == NULL) {
+            entry = &cache[idx];
+            break;
+        }
+        if(!cache[idx].in_use && (entry == NULL || cache[idx].last_used < entry->last_used))
+            entry = &cache[idx];
+    }
+
+    if(entry) {
+        if(entry->owner)
+            entry_free(entry);
+        entry->owner = owner;
+        entry->file = file;
+        entry->close = close;
+        entry->mtime = mtime;
+        entry->last_used = ++tick;
+        entry->in_use = true;
+        strcpy(entry->path, path);
+    }
+}
+
+// Returns true if the handle is parked in the cache, the adapter should then rewind it instead of closing it.
+bool fs_handle_release (vfs_file_t *file)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < HANDLE_CACHE_SIZE; idx++) {
+        if(cache[idx].owner && cache[idx].file == file) {
+            cache[idx].in_use = false;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Closes parked handles for path, or all handles for the file system if path is NULL.
+void fs_handle_invalidate (const void *owner, const char *path)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < HANDLE_CACHE_SIZE; idx++) {
+        if(cache[idx].owner == owner && (path == NULL || !strcmp(cache[idx].path, path)))
+            entry_free(&cache[idx]);
+    }
+}
+
+#endif // SDCARD_ENABLE && SDCARD_HANDLE_CACHE_ENABLE
@@ -0,0 +1,30 @@
+/*
+  fs_handles.h - cache of open handles for frequently opened files
+
+  Part of SDCard plugin for grblHAL
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+typedef void (*fs_handle_close_ptr)(vfs_file_t *file);
+
+bool fs_handle_cacheable (const char *path, const char *mode);
+vfs_file_t *fs_handle_get (const void *owner, const char *path, uint32_t mtime);
+void fs_handle_track (const void *owner, const char *path, vfs_file_t *file, uint32_t mtime, fs_handle_close_ptr close);
+bool fs_handle_release (vfs_file_t *file);
+void fs_handle_invalidate (const void *owner, const char *path);
@@ -0,0 +1,172 @@
+/*
+  fs_hash.c - file hashing with cache
+
+  Part of SDCard plugin for grblHAL
+
+  CRC32 (IEEE 802.3, same as zlib) of file contents. When folder sync is
+  enabled results are cached and reused as long as the size and modification
+  time of the file is unchanged, cache entries are dropped when the file is
+  written, renamed or deleted via the file system adapters.
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sdcard.h"
+
+#if SDCARD_ENABLE
+
+#include <string.h>
+
+#ifdef ARDUINO
+#include "../grbl/vfs.h"
+#else
+#include "grbl/vfs.h"
+#endif
+
+#include "fs_hash.h"
+#include "fs_meta.h"
+
+uint32_t fs_crc32 (uint32_t crc, const void *data, size_t len)
+{
+    static const uint32_t crc_nibble[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+    };
+
+    const uint8_t *p = (const uint8_t *)data;
+
+    crc = ~crc;
+
+    while(len--) {
+        crc ^= *p++;
+        crc = (crc >> 4) ^ crc_nibble[crc & 0x0F];
+        crc = (crc >> 4) ^ crc_nibble[crc & 0x0F];
+    }
+
+    return ~crc;
+}
+
+#if SDCARD_SYNC_ENABLE
+
+#ifndef FS_HASH_CACHE_SIZE
+#define FS_HASH_CACHE_SIZE 16
+#endif
+
+typedef struct {
+    char path[64];
+    uint32_t size;
+    uint32_t mtime;
+    uint32_t crc;
+} hash_cache_entry_t;
+
+static hash_cache_entry_t cache[FS_HASH_CACHE_SIZE] = {0};
+
+// Paths are keyed without the leading /, the VFS accepts both forms for files in the root.
+static inline const char *cache_key (const char *filename)
+{
+    return *filename == '/' ? filename + 1 : filename;
+}
+
+static hash_cache_entry_t *cache_entry (const char *key)
+{
+    uint32_t idx = fs_crc32(0, key, strlen(key)) % FS_HASH_CACHE_SIZE;
+
+    return &cache[idx];
+}
+
+static bool file_crc32 (const char *filename, uint32_t *crc)
+{
+    size_t count;
+    vfs_file_t *file;
+    uint8_t buf[128];
+
+    if((file = vfs_open(filename, "r")) == NULL)
+        return false;
+
+    *crc = 0;
+    while((count = vfs_read(buf, 1, sizeof(buf), file)) > 0)
+        *crc = fs_crc32(*crc, buf, count);
+
+    vfs_close(file);
+
+    return true;
+}
+
+// Returns CRC32 of file contents, from cache or file metadata if still valid.
+bool fs_file_crc32 (const char *filename, uint32_t *crc)
+{
+    vfs_stat_t st;
+    hash_cache_entry_t *entry;
+    const char *key = cache_key(filename);
+#if SDCARD_META_ENABLE
+    fs_meta_crc32_t meta;
+#endif
+
+    if(vfs_stat(filename, &st) != 0)
+        return false;
+
+#ifdef ESP_PLATFORM
+    uint32_t mtime = (uint32_t)st.st_mtim;
+#else
+    uint32_t mtime = (uint32_t)st.st_mtime;
+#endif
+
+    if(strlen(key) < sizeof(entry->path) && !strcmp((entry = cache_entry(key))->path, key) &&
+         entry->size == st.st_size && entry->mtime == mtime) {
+        *crc = entry->crc;
+        return true;
+    }
+
+#if SDCARD_META_ENABLE
+    if(fs_meta_get(filename, FsMeta_Crc32, &meta, sizeof(fs_meta_crc32_t)) == sizeof(fs_meta_crc32_t) &&
+        meta.size == st.st_size && meta.mtime == mtime)
+        *crc = meta.crc;
+    else if(file_crc32(filename, crc)) {
+        meta.size = st.st_size;
+        meta.mtime = mtime;
+        meta.crc = *crc;
+        fs_meta_set(filename, FsMeta_Crc32, &meta, sizeof(fs_meta_crc32_t));
+    } else
+        return false;
+#else
+    if(!file_crc32(filename, crc))
+        return false;
+#endif
+
+    if(strlen(key) < sizeof(entry->path)) {
+        entry = cache_entry(key);
+        strcpy(entry->path, key);
+        entry->size = st.st_size;
+        entry->mtime = mtime;
+        entry->crc = *crc;
+    }
+
+    return true;
+}
+
+// Drops the cached CRC for the file, called when the file is written, renamed or deleted.
+void fs_hash_invalidate (const char *filename)
+{
+    hash_cache_entry_t *entry;
+    const char *key = cache_key(filename);
+
+    if(strlen(key) < sizeof(entry->path) && !strcmp((entry = cache_entry(key))->path, key))
+        *entry->path = '\0';
+}
+
+#endif // SDCARD_SYNC_ENABLE
+
+#endif // SDCARD_ENABLE
@@ -0,0 +1,150 @@
+/*
+  fs_journal.c - in RAM change journal for incremental file listings
+
+  Part of SDCard plugin for grblHAL
+
+  Records create, delete, rename and size change events made via the file
+  system adapters in a bounded ring buffer. Clients keep the token returned
+  by the last listing and ask for changes since then. The token includes an
+  epoch that is changed when the journal is reset, e.g. on a card change.
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sdcard.h"
+
+#if SDCARD_ENABLE && SDCARD_JOURNAL_ENABLE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fs_journal.h"
+
+#ifndef JOURNAL_SIZE
+#define JOURNAL_SIZE 32
+#endif
+
+typedef struct {
+    uint32_t seq;
+    uint32_t size;
+    journal_event_t event;
+    char path[64]; // For renames: <from>|<to>
+} journal_entry_t;
+
+static uint32_t epoch = 0, seq = 0;
+static uint_fast8_t head = 0;
+static journal_entry_t journal[JOURNAL_SIZE];
+
+static bool join_path (char *dest, size_t size, const char *mount, const char *path)
+{
+    if(mount && !(mount[0] == '/' && mount[1] == '\0'))
+        return (size_t)snprintf(dest, size, "%s%s%s", mount, *path == '/' ? "" : "/", path) < size;
+
+    return (size_t)snprintf(dest, size, "%s%s", *path == '/' ? "" : "/", path) < size;
+}
+
+static journal_entry_t *new_entry (journal_event_t event, uint32_t size)
+{
+    journal_entry_t *entry = &journal[head];
+
+    head = (head + 1) % JOURNAL_SIZE;
+
+    entry->seq = ++seq;
+    entry->event = event;
+    entry->size = size;
+
+    return entry;
+}
+
+// Adds an event, path is relative to mount.
+void fs_journal_add (journal_event_t event, const char *mount, const char *path, const char *path2, uint32_t size)
+{
+    char from[sizeof(journal[0].path)], to[sizeof(journal[0].path)];
+
+    if(!join_path(from, sizeof(from), mount, path)) {
+        seq += JOURNAL_SIZE;    // Path too long, force full listing.
+        return;
+    }
+
+    journal_entry_t *last = &journal[(head + JOURNAL_SIZE - 1) % JOURNAL_SIZE];
+
+    if(event == Journal_Changed && last->seq && last->event == Journal_Changed && !strcmp(last->path, from)) {
+        last->seq = ++seq;  // Repeated writes to the same file, e.g. during upload,
+        last->size = size;  // update the last entry instead of adding a new.
+    } else if(event == Journal_Renamed) {
+        if(join_path(to, sizeof(to), mount, path2) && strlen(from) + strlen(to) + 1 < sizeof(journal[0].path))
+            sprintf(new_entry(event, size)->path, "%s|%s", from, to);
+        else
+            seq += JOURNAL_SIZE;
+    } else
+        strcpy(new_entry(event, size)->path, from);
+}
+
+// Invalidates all tokens handed out, to be called when the card is mounted.
+void fs_journal_reset (void)
+{
+    epoch = epoch + 1 + (hal.get_elapsed_ticks() & 0xFFFF);
+    seq = head = 0;
+    memset(journal, 0, sizeof(journal));
+}
+
+// Reports changes since token followed by the token for the next call.
+// Returns false, without reporting anything, if a full listing is required.
+bool fs_journal_report (char *token)
+{
+    char *s, buf[sizeof(journal[0].path) + 40]; // Path, two 32-bit numbers and literals.
+    uint32_t token_epoch, token_seq, oldest;
+    uint_fast8_t idx;
+
+    static const char *const event_name[] = { "NEW", "DEL", "REN", "DIR" };
+
+    if(token == NULL || (s = strchr(token, ':')) == NULL)
+        return false;
+
+    token_epoch = strtoul(token, NULL, 10);
+    token_seq = strtoul(s + 1, NULL, 10);
+    oldest = seq > JOURNAL_SIZE ? seq - JOURNAL_SIZE : 0;
+
+    if(token_epoch != epoch || token_seq > seq || token_seq < oldest)
+        return false;
+
+    idx = head;
+    do {
+        if(journal[idx].seq > token_seq) {
+            if(journal[idx].event == Journal_Changed)
+                sprintf(buf, "[JOURNAL:%lu|NEW|%s|%lu]" ASCII_EOL, (unsigned long)journal[idx].seq, journal[idx].path, (unsigned long)journal[idx].size);
+            else
+                sprintf(buf, "[JOURNAL:%lu|%s|%s]" ASCII_EOL, (unsigned long)journal[idx].seq, event_name[journal[idx].event], journal[idx].path);
+            hal.stream.write(buf);
+        }
+        idx = (idx + 1) % JOURNAL_SIZE;
+    } while(idx != head);
+
+    fs_journal_report_token();
+
+    return true;
+}
+
+void fs_journal_report_token (void)
+{
+    char buf[40];
+
+    sprintf(buf, "[JOURNALTOKEN:%lu:%lu]" ASCII_EOL, (unsigned long)epoch, (unsigned long)seq);
+    hal.stream.write(buf);
+}
+
+#endif // SDCARD_ENABLE && SDCARD_JOURNAL_ENABLE
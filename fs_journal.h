@@ -0,0 +1,34 @@
+/*
+  fs_journal.h - in RAM change journal for incremental file listings
+
+  Part of SDCard plugin for grblHAL
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+typedef enum {
+    Journal_Changed = 0,    // File created or size changed.
+    Journal_Deleted,
+    Journal_Renamed,
+    Journal_DirCreated
+} journal_event_t;
+
+void fs_journal_add (journal_event_t event, const char *mount, const char *path, const char *path2, uint32_t size);
+void fs_journal_reset (void);
+bool fs_journal_report (char *token);
+void fs_journal_report_token (void);
@@ -3,7 +3,7 @@
 
   Part of grblHAL
 
-  Copyright (c) 2022-2024 Terje Io
+  Copyright (c) 2022-2025 Terje Io
  
   Grbl is free software: you can redistribute it and/or modify
   it under the terms of the GNU General Public License as published by
@@ -37,6 +37,7 @@
 #include "../grbl/vfs.h"
 #endif
 
+#include <stdio.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
@@ -46,29 +47,97 @@
 #include "../littlefs/lfs.h"
 #include "../littlefs/lfs_util.h"
 
+#include "fs_notify.h"
+#include "memstats.h"
+
+#if SDCARD_ENABLE && SDCARD_VFS_PROFILE_ENABLE
+#include "vfs_profile.h"
+#endif
+
+#define LITTLEFS_HANDLE_CACHE (SDCARD_ENABLE && SDCARD_HANDLE_CACHE_ENABLE)
+
+#if LITTLEFS_HANDLE_CACHE
+#include "fs_handles.h"
+#endif
+
+#define LITTLEFS_META (SDCARD_ENABLE && SDCARD_META_ENABLE)
+
+#if LITTLEFS_META
+#include "fs_meta.h"
+#endif
+
 #define ATTR_TIMESTAMP 0x74 // 't'
+#define ATTR_META_BASE 0x80 // Metadata blobs are stored as attributes ATTR_META_BASE + tag.
+
+// Max. number of littlefs file systems that can be mounted, e.g. one in internal flash and one in external QSPI flash.
+#ifndef LITTLEFS_MAX_INSTANCES
+#define LITTLEFS_MAX_INSTANCES 2
+#elif LITTLEFS_MAX_INSTANCES < 1 || LITTLEFS_MAX_INSTANCES > 3
+#error "LITTLEFS_MAX_INSTANCES must be in the range 1 - 3!"
+#endif
+
+#define LFS_BENCH_FILE "/.bench"
+#define LFS_BENCH_SIZE 16384
+
+typedef struct {
+    uint32_t opens;
+    uint32_t errors;
+    uint32_t bytes_read;    // Wraps at 4 GB.
+    uint32_t bytes_written; // ...
+} lfs_stats_t;
+
+typedef struct {
+    lfs_t lfs;
+    const struct lfs_config *config;
+    bool is_rootfs;
+    char mount_path[32];
+    lfs_stats_t stats;
+} lfs_instance_t;
 
 typedef struct time_file {
+    lfs_instance_t *fs;
     lfs_file_t file;
     bool modified;
     time_t timestamp;
     struct lfs_attr attrs[1];
     struct lfs_file_config cfg;
+#if FS_NOTIFY_ENABLE
+    char path[];        // Path if opened for writing.
+#endif
 } time_file_t;
 
-static lfs_t lfs = {0};
-static bool is_rootfs;
-static const struct lfs_config *lfs_config;
+typedef struct {
+    lfs_instance_t *fs;
+    lfs_dir_t dir;
+} lfs_dir_handle_t;
 
-static vfs_file_t *fs_open (const char *filename, const char *mode)
+static lfs_instance_t instance[LITTLEFS_MAX_INSTANCES] = {0};
+
+static void file_close (vfs_file_t *file);
+
+static vfs_file_t *fs_open (lfs_instance_t *fs, const char *filename, const char *mode)
 {
     int flags = 0;
-    vfs_file_t *file = malloc(sizeof(vfs_file_t) + sizeof(time_file_t));
+#if LITTLEFS_HANDLE_CACHE
+    vfs_file_t *cached;
+    bool cacheable = fs_handle_cacheable(filename, mode);
+
+    // No modification time is kept for littlefs files opened read only, cached handles are invalidated on changes instead.
+    if(cacheable && (cached = fs_handle_get(fs, filename, 0)))
+        return cached;
+#endif
+#if FS_NOTIFY_ENABLE
+    vfs_file_t *file = MEMSTATS_ALLOC(MemGroup_LittleFs, sizeof(vfs_file_t) + sizeof(time_file_t) + strlen(filename) + 1);
+#else
+    vfs_file_t *file = MEMSTATS_ALLOC(MemGroup_LittleFs, sizeof(vfs_file_t) + sizeof(time_file_t));
+#endif
 
     if(file) {
 
         time_file_t *f = (time_file_t *)&file->handle;
 
+        f->fs = fs;
+
         // set up description of timestamp attribute
         f->modified = false;
         f->timestamp = 0;
@@ -92,21 +161,39 @@ static vfs_file_t *fs_open (const char *filename, const char *mode)
                         f->timestamp = mktime(&dt);
                 }
             } else if (*mode == 'a')
-                flags |= LFS_O_APPEND;
+                flags |= LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND;
             mode++;
         }
 
-        if((vfs_errno = lfs_file_opencfg(&lfs, &f->file, filename, flags, &f->cfg)) != LFS_ERR_OK) {
-            free(file);
+#if FS_NOTIFY_ENABLE
+        if(flags & LFS_O_WRONLY)
+            strcpy(f->path, filename);
+        else
+            *f->path = '\0';
+#endif
+#if LITTLEFS_HANDLE_CACHE
+        if(flags & LFS_O_WRONLY)
+            fs_handle_invalidate(fs, filename);
+#endif
+
+        if((vfs_errno = lfs_file_opencfg(&fs->lfs, &f->file, filename, flags, &f->cfg)) != LFS_ERR_OK) {
+            MEMSTATS_FREE(MemGroup_LittleFs, file);
             file = NULL;
-        } else
-            file->size = lfs_file_size(&lfs, &f->file);
+            fs->stats.errors++;
+        } else {
+            fs->stats.opens++;
+            file->size = lfs_file_size(&fs->lfs, &f->file);
+#if LITTLEFS_HANDLE_CACHE
+            if(cacheable)
+                fs_handle_track(fs, filename, file, 0, file_close);
+#endif
+        }
     }
 
     return file;
 }
 
-static void fs_close (vfs_file_t *file)
+static void file_close (vfs_file_t *file)
 {
     time_file_t *f = (time_file_t *)&file->handle;
 
@@ -116,70 +203,142 @@ static void fs_close (vfs_file_t *file)
             f->timestamp = mktime(&dt);
     }
 
-    lfs_file_close(&lfs, &f->file);
-    free(file);
+#if FS_NOTIFY_ENABLE
+    lfs_soff_t size = lfs_file_size(&f->fs->lfs, &f->file);
+#endif
+
+    lfs_file_close(&f->fs->lfs, &f->file);
+
+#if FS_NOTIFY_ENABLE
+    if(*f->path)
+        fs_notify(Journal_Changed, f->fs->mount_path, f->path, NULL, size);
+#endif
+
+    MEMSTATS_FREE(MemGroup_LittleFs, file);
+}
+
+static void fs_close (vfs_file_t *file)
+{
+#if LITTLEFS_HANDLE_CACHE
+    if(fs_handle_release(file)) {   // Parked in handle cache?
+        time_file_t *f = (time_file_t *)&file->handle;
+        lfs_file_seek(&f->fs->lfs, &f->file, 0, LFS_SEEK_SET); // Yes, rewind for next use.
+        return;
+    }
+#endif
+
+    file_close(file);
 }
 
 static size_t fs_read (void *buffer, size_t size, size_t count, vfs_file_t *file)
 {
-    return lfs_file_read(&lfs, &((time_file_t *)&file->handle)->file, buffer, size * count);
+    time_file_t *f = (time_file_t *)&file->handle;
+    lfs_ssize_t res = lfs_file_read(&f->fs->lfs, &f->file, buffer, size * count);
+
+    if(res > 0)
+        f->fs->stats.bytes_read += res;
+    else if(res < 0)
+        f->fs->stats.errors++;
+
+    return res;
 }
 
 static size_t fs_write (const void *buffer, size_t size, size_t count, vfs_file_t *file)
 {
     time_file_t *f = (time_file_t *)&file->handle;
+    lfs_ssize_t res = lfs_file_write(&f->fs->lfs, &f->file, buffer, size * count);
 
     f->modified = true;
 
-    return lfs_file_write(&lfs, &f->file, buffer, size * count);
+    if(res > 0)
+        f->fs->stats.bytes_written += res;
+    else if(res < 0)
+        f->fs->stats.errors++;
+
+    return res;
 }
 
 static size_t fs_tell (vfs_file_t *file)
 {
-    return lfs_file_tell(&lfs, &((time_file_t *)&file->handle)->file);
+    time_file_t *f = (time_file_t *)&file->handle;
+
+    return lfs_file_tell(&f->fs->lfs, &f->file);
 }
 
 static int fs_seek (vfs_file_t *file, size_t offset)
 {
-    return lfs_file_seek(&lfs, &((time_file_t *)&file->handle)->file, offset, LFS_SEEK_SET);
+    time_file_t *f = (time_file_t *)&file->handle;
+
+    return lfs_file_seek(&f->fs->lfs, &f->file, offset, LFS_SEEK_SET);
 }
 
 static bool fs_eof (vfs_file_t *file)
 {
-    return lfs_file_tell(&lfs, &((time_file_t *)&file->handle)->file) == file->size;
+    time_file_t *f = (time_file_t *)&file->handle;
+
+    return lfs_file_tell(&f->fs->lfs, &f->file) == file->size;
 }
 
-static int fs_rename (const char *from, const char *to)
+static int fs_rename (lfs_instance_t *fs, const char *from, const char *to)
 {
-    return lfs_rename(&lfs, from, to);
+    int res;
+
+#if LITTLEFS_HANDLE_CACHE
+    fs_handle_invalidate(fs, NULL);
+#endif
+
+#if FS_NOTIFY_ENABLE
+    if((res = lfs_rename(&fs->lfs, from, to)) == LFS_ERR_OK)
+        fs_notify(Journal_Renamed, fs->mount_path, from, to, 0);
+#else
+    res = lfs_rename(&fs->lfs, from, to);
+#endif
+
+    return res;
 }
 
-static int fs_unlink (const char *filename)
+static int fs_unlink (lfs_instance_t *fs, const char *filename)
 {
-    return lfs_remove(&lfs, filename);
+    int res;
+
+#if LITTLEFS_HANDLE_CACHE
+    fs_handle_invalidate(fs, filename);
+#endif
+
+#if FS_NOTIFY_ENABLE
+    if((res = lfs_remove(&fs->lfs, filename)) == LFS_ERR_OK)
+        fs_notify(Journal_Deleted, fs->mount_path, filename, NULL, 0);
+#else
+    res = lfs_remove(&fs->lfs, filename);
+#endif
+
+    return res;
 }
 
-static int fs_mkdir (const char *path)
+static int fs_mkdir (lfs_instance_t *fs, const char *path)
 {
     int res;
 
-    if((res = lfs_mkdir(&lfs, path)) == LFS_ERR_OK) {
+    if((res = lfs_mkdir(&fs->lfs, path)) == LFS_ERR_OK) {
+#if FS_NOTIFY_ENABLE
+        fs_notify(Journal_DirCreated, fs->mount_path, path, NULL, 0);
+#endif
         struct tm dt;
         if(hal.rtc.get_datetime && hal.rtc.get_datetime(&dt)) {
             time_t t = mktime(&dt);
-            lfs_setattr(&lfs, path, ATTR_TIMESTAMP, &t, sizeof(time_t));
+            lfs_setattr(&fs->lfs, path, ATTR_TIMESTAMP, &t, sizeof(time_t));
         }
     }
 
     return res;
 }
 
-static int fs_chdir (const char *path)
+static int fs_chdir (lfs_instance_t *fs, const char *path)
 {
 #if FF_FS_RPATH
     return f_chdir(path);
 #else
-    return is_rootfs && !strcmp(path, "/") ? 0 : -1;
+    return fs->is_rootfs && !strcmp(path, "/") ? 0 : -1;
 #endif
 }
 /*
@@ -205,14 +364,16 @@ static char *fs_getcwd (char *buf, size_t size)
     return cwd;
 }
 */
-static vfs_dir_t *fs_opendir (const char *path)
+static vfs_dir_t *fs_opendir (lfs_instance_t *fs, const char *path)
 {
-    vfs_dir_t *dir = malloc(sizeof(vfs_dir_t) + sizeof(lfs_dir_t));
+    vfs_dir_t *dir = MEMSTATS_ALLOC(MemGroup_LittleFs, sizeof(vfs_dir_t) + sizeof(lfs_dir_handle_t));
 
-    if (dir && (vfs_errno = lfs_dir_open(&lfs, (lfs_dir_t *)&dir->handle, path)) != LFS_ERR_OK)
-    {
-        free(dir);
-        dir = NULL;
+    if(dir) {
+        ((lfs_dir_handle_t *)&dir->handle)->fs = fs;
+        if((vfs_errno = lfs_dir_open(&fs->lfs, &((lfs_dir_handle_t *)&dir->handle)->dir, path)) != LFS_ERR_OK) {
+            MEMSTATS_FREE(MemGroup_LittleFs, dir);
+            dir = NULL;
+        }
     }
 
     return dir;
@@ -222,15 +383,17 @@ static char *fs_readdir (vfs_dir_t *dir, vfs_dirent_t *dirent)
 {
     static struct lfs_info f;
 
+    lfs_dir_handle_t *d = (lfs_dir_handle_t *)&dir->handle;
+
     *dirent->name = '\0';
 
-    if ((vfs_errno = lfs_dir_read(&lfs, (lfs_dir_t *)&dir->handle, &f)) <= 0)
+    if ((vfs_errno = lfs_dir_read(&d->fs->lfs, &d->dir, &f)) <= 0)
         return NULL;
 
-    if(!strcmp(f.name, ".") && (vfs_errno = lfs_dir_read(&lfs, (lfs_dir_t *)&dir->handle, &f)) <= 0)
+    if(!strcmp(f.name, ".") && (vfs_errno = lfs_dir_read(&d->fs->lfs, &d->dir, &f)) <= 0)
         return NULL;
 
-    if(!strcmp(f.name, "..") && (vfs_errno = lfs_dir_read(&lfs, (lfs_dir_t *)&dir->handle, &f)) <= 0)
+    if(!strcmp(f.name, "..") && (vfs_errno = lfs_dir_read(&d->fs->lfs, &d->dir, &f)) <= 0)
         return NULL;
 
     if(f.name && *f.name != '\0')
@@ -247,24 +410,25 @@ static char *fs_readdir (vfs_dir_t *dir, vfs_dirent_t *dirent)
 static void fs_closedir (vfs_dir_t *dir)
 {
     if (dir) {
-        vfs_errno = lfs_dir_close(&lfs, (lfs_dir_t *)&dir->handle);
-        free(dir);
+        lfs_dir_handle_t *d = (lfs_dir_handle_t *)&dir->handle;
+        vfs_errno = lfs_dir_close(&d->fs->lfs, &d->dir);
+        MEMSTATS_FREE(MemGroup_LittleFs, dir);
     }
 }
 
-static int fs_stat (const char *filename, vfs_stat_t *st)
+static int fs_stat (lfs_instance_t *fs, const char *filename, vfs_stat_t *st)
 {
     struct lfs_info f;
 
-    if ((vfs_errno = lfs_stat(&lfs, filename, &f)) == LFS_ERR_OK) {
+    if ((vfs_errno = lfs_stat(&fs->lfs, filename, &f)) == LFS_ERR_OK) {
         st->st_size = f.size;
         st->st_mode.mode = 0;
         st->st_mode.directory = f.type == LFS_TYPE_DIR;
 #if ESP_PLATFORM
-        if(lfs_getattr(&lfs, filename, ATTR_TIMESTAMP, &st->st_mtim, sizeof(time_t)) != sizeof(time_t))
+        if(lfs_getattr(&fs->lfs, filename, ATTR_TIMESTAMP, &st->st_mtim, sizeof(time_t)) != sizeof(time_t))
             st->st_mtim = (time_t)0;
 #else
-        if(lfs_getattr(&lfs, filename, ATTR_TIMESTAMP, &st->st_mtime, sizeof(time_t)) != sizeof(time_t))
+        if(lfs_getattr(&fs->lfs, filename, ATTR_TIMESTAMP, &st->st_mtime, sizeof(time_t)) != sizeof(time_t))
             st->st_mtime = (time_t)0;
 #endif
     } else
@@ -273,69 +437,291 @@ static int fs_stat (const char *filename, vfs_stat_t *st)
     return 0;
 }
 
-static int fs_utime (const char *filename, struct tm *modified)
+static int fs_utime (lfs_instance_t *fs, const char *filename, struct tm *modified)
 {
     time_t t = mktime(modified);
 
-    return lfs_setattr(&lfs, filename, ATTR_TIMESTAMP, &t, sizeof(time_t));
+#if LITTLEFS_HANDLE_CACHE
+    fs_handle_invalidate(fs, filename);
+#endif
+
+    return lfs_setattr(&fs->lfs, filename, ATTR_TIMESTAMP, &t, sizeof(time_t));
 }
 
-static bool fs_getfree (vfs_free_t *free)
+static bool fs_getfree (lfs_instance_t *fs, vfs_free_t *free)
 {
-    free->size = lfs_config->block_count * lfs_config->block_size;
-    free->used = lfs_fs_size(&lfs) * lfs_config->block_size;
+    free->size = fs->config->block_count * fs->config->block_size;
+    free->used = lfs_fs_size(&fs->lfs) * fs->config->block_size;
 
     return true;
 }
 
-static int fs_format (void)
+static int fs_format (lfs_instance_t *fs)
 {
-    int ret = lfs_format(&lfs, lfs_config);
-    lfs_mount(&lfs, lfs_config);
+    int ret;
+
+#if LITTLEFS_HANDLE_CACHE
+    fs_handle_invalidate(fs, NULL);
+#endif
+
+    ret = lfs_format(&fs->lfs, fs->config);
+    lfs_mount(&fs->lfs, fs->config);
 
     return ret;
 }
 
-void fs_littlefs_mount (const char *path, const struct lfs_config *config)
+#if LITTLEFS_META
+
+static int meta_get (void *context, const char *path, fs_meta_tag_t tag, void *data, size_t size)
+{
+    lfs_ssize_t res = lfs_getattr(&((lfs_instance_t *)context)->lfs, path, ATTR_META_BASE + tag, data, size);
+
+    return res < 0 || (size_t)res > size ? -1 : (int)res;
+}
+
+static int meta_set (void *context, const char *path, fs_meta_tag_t tag, const void *data, size_t size)
 {
-    static const vfs_t littlefs = {
-        .fs_name = "littlefs",
-        .fopen = fs_open,
-        .fclose = fs_close,
-        .fread = fs_read,
-        .fwrite = fs_write,
-        .ftell = fs_tell,
-        .fseek = fs_seek,
-        .feof = fs_eof,
-        .frename = fs_rename,
-        .funlink = fs_unlink,
-        .fmkdir = fs_mkdir,
-        .fchdir = fs_chdir,
-        .frmdir = fs_unlink,
-        .fopendir = fs_opendir,
-        .readdir = fs_readdir,
-        .fclosedir = fs_closedir,
-        .fstat = fs_stat,
-        .futime = fs_utime,
-//        .fgetcwd = fs_getcwd,
-        .fgetfree = fs_getfree,
-        .format = fs_format
+    return lfs_setattr(&((lfs_instance_t *)context)->lfs, path, ATTR_META_BASE + tag, data, size) == LFS_ERR_OK ? (int)size : -1;
+}
+
+static int meta_remove (void *context, const char *path, fs_meta_tag_t tag)
+{
+    return lfs_removeattr(&((lfs_instance_t *)context)->lfs, path, ATTR_META_BASE + tag) == LFS_ERR_OK ? 0 : -1;
+}
+
+static const fs_meta_api_t meta_api = {
+    .get = meta_get,
+    .set = meta_set,
+    .remove = meta_remove
+};
+
+#endif // LITTLEFS_META
+
+// The VFS API does not pass the file system to path based functions,
+// a set of functions bound to the instance is thus needed per instance.
+
+#define LFS_INSTANCE_VFS(n) \
+static vfs_file_t *fs_open_##n (const char *filename, const char *mode) { return fs_open(&instance[n], filename, mode); } \
+static int fs_rename_##n (const char *from, const char *to) { return fs_rename(&instance[n], from, to); } \
+static int fs_unlink_##n (const char *filename) { return fs_unlink(&instance[n], filename); } \
+static int fs_mkdir_##n (const char *path) { return fs_mkdir(&instance[n], path); } \
+static int fs_chdir_##n (const char *path) { return fs_chdir(&instance[n], path); } \
+static vfs_dir_t *fs_opendir_##n (const char *path) { return fs_opendir(&instance[n], path); } \
+static int fs_stat_##n (const char *filename, vfs_stat_t *st) { return fs_stat(&instance[n], filename, st); } \
+static int fs_utime_##n (const char *filename, struct tm *modified) { return fs_utime(&instance[n], filename, modified); } \
+static bool fs_getfree_##n (vfs_free_t *free) { return fs_getfree(&instance[n], free); } \
+static int fs_format_##n (void) { return fs_format(&instance[n]); } \
+static const vfs_t littlefs_##n = { \
+    .fs_name = "littlefs", \
+    .fopen = fs_open_##n, \
+    .fclose = fs_close, \
+    .fread = fs_read, \
+    .fwrite = fs_write, \
+    .ftell = fs_tell, \
+    .fseek = fs_seek, \
+    .feof = fs_eof, \
+    .frename = fs_rename_##n, \
+    .funlink = fs_unlink_##n, \
+    .fmkdir = fs_mkdir_##n, \
+    .fchdir = fs_chdir_##n, \
+    .frmdir = fs_unlink_##n, \
+    .fopendir = fs_opendir_##n, \
+    .readdir = fs_readdir, \
+    .fclosedir = fs_closedir, \
+    .fstat = fs_stat_##n, \
+    .futime = fs_utime_##n, \
+    .fgetfree = fs_getfree_##n, \
+    .format = fs_format_##n \
+};
+
+LFS_INSTANCE_VFS(0)
+#if LITTLEFS_MAX_INSTANCES > 1
+LFS_INSTANCE_VFS(1)
+#endif
+#if LITTLEFS_MAX_INSTANCES > 2
+LFS_INSTANCE_VFS(2)
+#endif
+
+static const vfs_t *const littlefs[LITTLEFS_MAX_INSTANCES] = {
+    &littlefs_0,
+#if LITTLEFS_MAX_INSTANCES > 1
+    &littlefs_1,
+#endif
+#if LITTLEFS_MAX_INSTANCES > 2
+    &littlefs_2
+#endif
+};
+
+// $FL - report statistics for mounted instances.
+static status_code_t lfs_cmd_stats (sys_state_t state, char *args)
+{
+    uint_fast8_t idx;
+    char buf[100];
+    lfs_instance_t *fs;
+
+    for(idx = 0; idx < LITTLEFS_MAX_INSTANCES; idx++) {
+        if((fs = &instance[idx])->config) {
+            sprintf(buf, "[LFS:%s|%lu|%ld/%lu|%lu|%lu|%lu|%lu]" ASCII_EOL, fs->mount_path,
+                     (unsigned long)fs->config->block_size, (long)lfs_fs_size(&fs->lfs), (unsigned long)fs->config->block_count,
+                      (unsigned long)fs->stats.opens, (unsigned long)fs->stats.bytes_read,
+                       (unsigned long)fs->stats.bytes_written, (unsigned long)fs->stats.errors);
+            hal.stream.write(buf);
+        }
+    }
+
+    return Status_OK;
+}
+
+// Writes and reads back a test file, returns false on failure.
+static bool lfs_benchmark (lfs_instance_t *fs, uint32_t *write_ms, uint32_t *read_ms)
+{
+    bool ok;
+    uint8_t buf[256];
+    uint32_t ms, count = LFS_BENCH_SIZE / sizeof(buf);
+    lfs_file_t file;
+
+    memset(buf, 0x55, sizeof(buf));
+
+    ms = hal.get_elapsed_ticks();
+
+    if((ok = lfs_file_open(&fs->lfs, &file, LFS_BENCH_FILE, LFS_O_WRONLY|LFS_O_CREAT|LFS_O_TRUNC) == LFS_ERR_OK)) {
+        while(ok && count--)
+            ok = lfs_file_write(&fs->lfs, &file, buf, sizeof(buf)) == sizeof(buf);
+        ok = lfs_file_close(&fs->lfs, &file) == LFS_ERR_OK && ok;
+    }
+
+    *write_ms = hal.get_elapsed_ticks() - ms;
+
+    if(ok && (ok = lfs_file_open(&fs->lfs, &file, LFS_BENCH_FILE, LFS_O_RDONLY) == LFS_ERR_OK)) {
+        ms = hal.get_elapsed_ticks();
+        count = LFS_BENCH_SIZE / sizeof(buf);
+        while(ok && count--)
+            ok = lfs_file_read(&fs->lfs, &file, buf, sizeof(buf)) == sizeof(buf);
+        *read_ms = hal.get_elapsed_ticks() - ms;
+        lfs_file_close(&fs->lfs, &file);
+    }
+
+    lfs_remove(&fs->lfs, LFS_BENCH_FILE);
+
+    return ok;
+}
+
+// $FLB - benchmark mounted instances side by side.
+static status_code_t lfs_cmd_benchmark (sys_state_t state, char *args)
+{
+    uint_fast8_t idx;
+    char buf[80];
+    uint32_t write_ms, read_ms;
+    lfs_instance_t *fs;
+
+    for(idx = 0; idx < LITTLEFS_MAX_INSTANCES; idx++) {
+        if((fs = &instance[idx])->config) {
+            if(lfs_benchmark(fs, &write_ms, &read_ms))
+                sprintf(buf, "[LFSBENCH:%s|%u|%lu|%lu]" ASCII_EOL, fs->mount_path, LFS_BENCH_SIZE, (unsigned long)write_ms, (unsigned long)read_ms);
+            else
+                sprintf(buf, "[LFSBENCH:%s|FAILED]" ASCII_EOL, fs->mount_path);
+            hal.stream.write(buf);
+        }
+    }
+
+    return Status_OK;
+}
+
+static void lfs_register_commands (void)
+{
+    PROGMEM static const sys_command_t lfs_command_list[] = {
+        {"FL", lfs_cmd_stats, { .noargs = On }, { .str = "report littlefs statistics" } },
+        {"FLB", lfs_cmd_benchmark, { .noargs = On }, { .str = "benchmark littlefs file systems" } }
     };
 
-    if((lfs_config = config) == NULL)
-        return;
+    static sys_commands_t lfs_commands = {
+        .n_commands = sizeof(lfs_command_list) / sizeof(sys_command_t),
+        .commands = lfs_command_list
+    };
+
+    static bool registered = false;
+
+    if(!registered) {
+        registered = true;
+        system_register_commands(&lfs_commands);
+    }
+}
+
+// Mounts littlefs, may be called once per file system up to LITTLEFS_MAX_INSTANCES.
+// Calling it again with the same path remounts the instance with the new configuration.
+// Returns true if mounted.
+bool fs_littlefs_mount (const char *path, const struct lfs_config *config)
+{
+    bool ok = false;
+    uint_fast8_t idx;
+    lfs_instance_t *fs = NULL;
+
+    if(config == NULL)
+        return false;
+
+    for(idx = 0; idx < LITTLEFS_MAX_INSTANCES; idx++) {
+        if(instance[idx].config && !strcmp(instance[idx].mount_path, path)) {
+            fs = &instance[idx];
+            vfs_unmount(path); // Mounted again below, not left pointing to the instance if that fails.
+#if LITTLEFS_HANDLE_CACHE
+            fs_handle_invalidate(fs, NULL);
+#endif
+            lfs_unmount(&fs->lfs);
+            break;
+        }
+        if(fs == NULL && instance[idx].config == NULL)
+            fs = &instance[idx];
+    }
+
+    if(fs == NULL) {
+        protocol_enqueue_foreground_task(report_warning, "LittleFS mount failed, too many instances!");
+        return false;
+    }
+
+    memset(fs, 0, sizeof(lfs_instance_t));
 
-    if (lfs_mount(&lfs, config) != LFS_ERR_OK)
-        lfs_format(&lfs, config);
+    if (lfs_mount(&fs->lfs, config) != LFS_ERR_OK)
+        lfs_format(&fs->lfs, config);
 
-    if (lfs_mount(&lfs, config) == LFS_ERR_OK) {
+    if (lfs_mount(&fs->lfs, config) == LFS_ERR_OK) {
         vfs_st_mode_t mode = {0};
         mode.hidden = settings.fs_options.lfs_hidden;
-        is_rootfs = !strcmp(path, "/");
-        hal.driver_cap.littlefs = vfs_mount(path, &littlefs, mode);
+        fs->config = config;
+        fs->is_rootfs = !strcmp(path, "/");
+        strncpy(fs->mount_path, path, sizeof(fs->mount_path) - 1);
+#if SDCARD_ENABLE && SDCARD_VFS_PROFILE_ENABLE
+        if(vfs_mount(path, vfs_profile_wrap(path, littlefs[fs - instance]), mode)) {
+#else
+        if(vfs_mount(path, littlefs[fs - instance], mode)) {
+#endif
+            ok = true;
+            hal.driver_cap.littlefs = On;
+            lfs_register_commands();
+#if LITTLEFS_META
+            fs_meta_register(path, &meta_api, fs);
+#endif
+        }
     } else
         protocol_enqueue_foreground_task(report_warning, "LittleFS mount failed!");
+
+    return ok;
 }
 
-#endif // LITTLEFS_ENABLE
+void fs_littlefs_unmount (const char *path)
+{
+    uint_fast8_t idx;
 
+    for(idx = 0; idx < LITTLEFS_MAX_INSTANCES; idx++) {
+        if(instance[idx].config && !strcmp(instance[idx].mount_path, path)) {
+            vfs_unmount(path);
+#if LITTLEFS_HANDLE_CACHE
+            fs_handle_invalidate(&instance[idx], NULL);
+#endif
+            lfs_unmount(&instance[idx].lfs);
+            instance[idx].config = NULL;
+            break;
+        }
+    }
+}
+
+#endif // LITTLEFS_ENABLE
@@ -21,4 +21,5 @@
 
 #pragma once
 
-void fs_littlefs_mount (const char *path, const struct lfs_config *config);
+bool fs_littlefs_mount (const char *path, const struct lfs_config *config);
+void fs_littlefs_unmount (const char *path);
@@ -0,0 +1,152 @@
+/*
+  fs_meta.c - metadata stored with files
+
+  Part of SDCard plugin for grblHAL
+
+  Small blobs derived from file contents, such as hashes and analyzer results,
+  are stored by the file system adapters instead of in sidecar files. littlefs
+  keeps them as file attributes and FatFs packs them into a hidden metadata file
+  per directory, a lookup thus costs a single read instead of a sidecar open.
+  Adapters register their implementation per mount point.
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sdcard.h"
+
+#if SDCARD_ENABLE && SDCARD_META_ENABLE
+
+#include <string.h>
+
+#ifdef ARDUINO
+#include "../grbl/vfs.h"
+#else
+#include "grbl/vfs.h"
+#endif
+
+#include "fs_meta.h"
+
+#define FS_META_MAX_MOUNTS 4
+
+typedef struct {
+    const fs_meta_api_t *api;
+    void *context;
+    char path[32];
+} fs_meta_mount_t;
+
+static fs_meta_mount_t mounts[FS_META_MAX_MOUNTS] = {0};
+static on_vfs_unmount_ptr on_vfs_unmount;
+
+// Returns the mount with the longest path matching the start of path, path is set to the remainder.
+static fs_meta_mount_t *get_mount (const char **path)
+{
+    size_t len, best = 0;
+    uint_fast8_t idx;
+    fs_meta_mount_t *mount = NULL;
+
+    for(idx = 0; idx < FS_META_MAX_MOUNTS; idx++) {
+        if(mounts[idx].api) {
+            len = strlen(mounts[idx].path);
+            if(!strcmp(mounts[idx].path, "/")) {
+                if(mount == NULL)
+                    mount = &mounts[idx];
+            } else if(len > best && !strncmp(*path, mounts[idx].path, len) && ((*path)[len] == '/' || (*path)[len] == '\0')) {
+                best = len;
+                mount = &mounts[idx];
+            }
+        }
+    }
+
+    if(best)
+        *path += best;
+
+    return mount;
+}
+
+static void fs_meta_on_unmount (const char *path)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < FS_META_MAX_MOUNTS; idx++) {
+        if(mounts[idx].api && !strcmp(mounts[idx].path, path))
+            mounts[idx].api = NULL;
+    }
+
+    if(on_vfs_unmount)
+        on_vfs_unmount(path);
+}
+
+// Registers metadata implementation for file system mounted at mount_path, replaces any previous registration for the path.
+void fs_meta_register (const char *mount_path, const fs_meta_api_t *api, void *context)
+{
+    static bool hooked = false;
+
+    uint_fast8_t idx;
+    fs_meta_mount_t *mount = NULL;
+
+    if(!hooked) {
+        hooked = true;
+        on_vfs_unmount = vfs.on_unmount;
+        vfs.on_unmount = fs_meta_on_unmount;
+    }
+
+    if(strlen(mount_path) >= sizeof(mount->path))
+        return;
+
+    for(idx = 0; idx < FS_META_MAX_MOUNTS; idx++) {
+        if(mounts[idx].api && !strcmp(mounts[idx].path, mount_path)) {
+            mount = &mounts[idx];
+            break;
+        }
+        if(mount == NULL && mounts[idx].api == NULL)
+            mount = &mounts[idx];
+    }
+
+    if(mount) {
+        strcpy(mount->path, mount_path);
+        mount->context = context;
+        mount->api = api;
+    }
+}
+
+// Reads blob for file, returns its size or a negative value if not found.
+int fs_meta_get (const char *path, fs_meta_tag_t tag, void *data, size_t size)
+{
+    fs_meta_mount_t *mount = get_mount(&path);
+
+    return mount && *path ? mount->api->get(mount->context, path, tag, data, size) : -1;
+}
+
+int fs_meta_set (const char *path, fs_meta_tag_t tag, const void *data, size_t size)
+{
+    fs_meta_mount_t *mount;
+
+    if(size > FS_META_MAX_SIZE)
+        return -1;
+
+    mount = get_mount(&path);
+
+    return mount && *path ? mount->api->set(mount->context, path, tag, data, size) : -1;
+}
+
+int fs_meta_remove (const char *path, fs_meta_tag_t tag)
+{
+    fs_meta_mount_t *mount = get_mount(&path);
+
+    return mount && *path ? mount->api->remove(mount->context, path, tag) : -1;
+}
+
+#endif // SDCARD_ENABLE && SDCARD_META_ENABLE
@@ -0,0 +1,53 @@
+/*
+  fs_meta.h - metadata stored with files
+
+  Part of SDCard plugin for grblHAL
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#define FS_META_MAX_SIZE 64 // Max. size of a metadata blob.
+
+// Metadata tags, blobs should carry the size and modification time of the file they are derived from for validation.
+typedef enum {
+    FsMeta_Crc32 = 1,   // fs_meta_crc32_t
+    FsMeta_ONumber,     // Program number, reserved.
+    FsMeta_Analysis     // Job analyzer results, reserved.
+} fs_meta_tag_t;
+
+typedef struct {
+    uint32_t size;
+    uint32_t mtime;
+    uint32_t crc;
+} fs_meta_crc32_t;
+
+// Path is relative to the mount point of the file system, functions return the size of the blob or a negative value on error.
+typedef int (*fs_meta_get_ptr)(void *context, const char *path, fs_meta_tag_t tag, void *data, size_t size);
+typedef int (*fs_meta_set_ptr)(void *context, const char *path, fs_meta_tag_t tag, const void *data, size_t size);
+typedef int (*fs_meta_remove_ptr)(void *context, const char *path, fs_meta_tag_t tag);
+
+typedef struct {
+    fs_meta_get_ptr get;
+    fs_meta_set_ptr set;
+    fs_meta_remove_ptr remove;
+} fs_meta_api_t;
+
+void fs_meta_register (const char *mount_path, const fs_meta_api_t *api, void *context);
+int fs_meta_get (const char *path, fs_meta_tag_t tag, void *data, size_t size);
+int fs_meta_set (const char *path, fs_meta_tag_t tag, const void *data, size_t size);
+int fs_meta_remove (const char *path, fs_meta_tag_t tag);
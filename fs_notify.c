@@ -0,0 +1,98 @@
+/*
+  fs_notify.c - file change notifications from the file system adapters
+
+  Part of SDCard plugin for grblHAL
+
+  The FatFs and littlefs adapters call fs_notify() when a file opened for
+  writing is closed, a file is deleted or renamed and when a directory is
+  created. The event is recorded in the change journal and the full path of
+  the file is passed on to the caches that keep data derived from it, so
+  that writes made via YModem, WebUI, delta uploads or any other client of
+  the VFS invalidates them.
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sdcard.h"
+
+#if SDCARD_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+
+#include "fs_notify.h"
+#include "jobcache.h"
+#include "fs_hash.h"
+#include "preview.h"
+#include "onumber.h"
+#include "bundle.h"
+
+#define NOTIFY_PATHLEN 128
+
+static bool busy = false;
+
+static bool join_path (char *dest, const char *mount, const char *path)
+{
+    if(mount && !(mount[0] == '/' && mount[1] == '\0'))
+        return (size_t)snprintf(dest, NOTIFY_PATHLEN, "%s%s%s", mount, *path == '/' ? "" : "/", path) < NOTIFY_PATHLEN;
+
+    return (size_t)snprintf(dest, NOTIFY_PATHLEN, "%s%s", *path == '/' ? "" : "/", path) < NOTIFY_PATHLEN;
+}
+
+static void file_changed (const char *path)
+{
+#if SDCARD_JOBCACHE_ENABLE
+    jobcache_invalidate(path);
+#endif
+#if SDCARD_SYNC_ENABLE
+    fs_hash_invalidate(path);
+#endif
+#if SDCARD_PREVIEW_ENABLE
+    preview_invalidate(path);
+#endif
+#if SDCARD_ONUMBER_ENABLE
+    onumber_file_changed(path);
+#endif
+#if SDCARD_BUNDLE_ENABLE
+    bundle_file_changed(path);
+#endif
+}
+
+// Called by the adapters after the change is made, path and path2 are relative to mount.
+// Files written by the subscribers while handling the notification are not passed on to them.
+void fs_notify (journal_event_t event, const char *mount, const char *path, const char *path2, uint32_t size)
+{
+    char full[NOTIFY_PATHLEN];
+
+#if SDCARD_JOURNAL_ENABLE
+    fs_journal_add(event, mount, path, path2, size);
+#endif
+
+    if(busy || event == Journal_DirCreated)
+        return;
+
+    busy = true;
+
+    if(join_path(full, mount, path))
+        file_changed(full);
+
+    if(event == Journal_Renamed && join_path(full, mount, path2))
+        file_changed(full);
+
+    busy = false;
+}
+
+#endif // SDCARD_ENABLE
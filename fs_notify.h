@@ -0,0 +1,29 @@
+/*
+  fs_notify.h - file change notifications from the file system adapters
+
+  Part of SDCard plugin for grblHAL
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include "fs_journal.h"
+
+// Set when any subscriber is enabled, the adapters then keep the path of files opened for writing.
+#define FS_NOTIFY_ENABLE (SDCARD_ENABLE && (SDCARD_JOURNAL_ENABLE || SDCARD_JOBCACHE_ENABLE || SDCARD_SYNC_ENABLE || SDCARD_PREVIEW_ENABLE || SDCARD_ONUMBER_ENABLE || SDCARD_BUNDLE_ENABLE))
+
+void fs_notify (journal_event_t event, const char *mount, const char *path, const char *path2, uint32_t size);
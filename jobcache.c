@@ -0,0 +1,407 @@
+/*
+  jobcache.c - job history and littlefs cache for frequently run jobs
+
+  Part of SDCard plugin for grblHAL
+
+  Keeps a run count per file in a persistent job history. Small files that are
+  run often are copied to littlefs in idle time slices and verified by CRC,
+  stream_file() then runs the cached copy as long as the size and modification
+  time of the source file are unchanged. Sources without a timestamp are
+  checked against the CRC of the copy instead. The least recently used copies
+  are evicted when the cache size budget is exceeded.
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sdcard.h"
+
+#if SDCARD_ENABLE && SDCARD_JOBCACHE_ENABLE && LITTLEFS_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef ARDUINO
+#include "../grbl/state_machine.h"
+#include "../grbl/vfs.h"
+#else
+#include "grbl/state_machine.h"
+#include "grbl/vfs.h"
+#endif
+
+#include "jobcache.h"
+#include "fs_hash.h"
+
+#ifndef JOBCACHE_PATH
+#define JOBCACHE_PATH "/littlefs/.jobcache"
+#endif
+#ifndef JOBCACHE_ENTRIES
+#define JOBCACHE_ENTRIES 16
+#endif
+#ifndef JOBCACHE_PROMOTE_RUNS
+#define JOBCACHE_PROMOTE_RUNS 3
+#endif
+#ifndef JOBCACHE_MAX_FILE_SIZE
+#define JOBCACHE_MAX_FILE_SIZE (16 * 1024)
+#endif
+#ifndef JOBCACHE_BUDGET
+#define JOBCACHE_BUDGET (64 * 1024)
+#endif
+
+#define JOBCACHE_CHUNK 128
+#define JOBCACHE_VERSION 1
+
+typedef struct {
+    char path[64];
+    uint32_t size;
+    uint32_t mtime;
+    uint32_t crc;
+    uint32_t last_used;
+    uint16_t runs;
+    bool cached;
+} jobcache_entry_t;
+
+typedef struct {
+    uint32_t version;
+    uint32_t sequence;
+    jobcache_entry_t entry[JOBCACHE_ENTRIES];
+} jobcache_history_t;
+
+typedef enum {
+    Promote_Idle = 0,
+    Promote_Copy,
+    Promote_Verify
+} promote_state_t;
+
+typedef struct {
+    promote_state_t state;
+    jobcache_entry_t *entry;
+    vfs_file_t *src;
+    vfs_file_t *dst;
+    uint32_t crc;
+    uint8_t buf[JOBCACHE_CHUNK];
+} promote_t;
+
+static int_fast16_t current = -1;
+static jobcache_history_t history = {0};
+static promote_t promote = {0};
+static on_execute_realtime_ptr on_execute_realtime;
+
+static uint32_t get_mtime (vfs_stat_t *st)
+{
+#ifdef ESP_PLATFORM
+    return (uint32_t)st->st_mtim;
+#else
+    return (uint32_t)st->st_mtime;
+#endif
+}
+
+static char *cache_filename (jobcache_entry_t *entry)
+{
+    static char filename[sizeof(JOBCACHE_PATH) + 8];
+
+    sprintf(filename, JOBCACHE_PATH "/J%02d.nc", (int)(entry - history.entry));
+
+    return filename;
+}
+
+static void history_save (void)
+{
+    vfs_file_t *file;
+
+    if((file = vfs_open(JOBCACHE_PATH "/history", "w"))) {
+        vfs_write(&history, sizeof(jobcache_history_t), 1, file);
+        vfs_close(file);
+    }
+}
+
+static void history_load (void)
+{
+    vfs_file_t *file;
+
+    if((file = vfs_open(JOBCACHE_PATH "/history", "r"))) {
+        if(vfs_read(&history, sizeof(jobcache_history_t), 1, file) != sizeof(jobcache_history_t) || history.version != JOBCACHE_VERSION)
+            memset(&history, 0, sizeof(jobcache_history_t));
+        vfs_close(file);
+    } else
+        vfs_mkdir(JOBCACHE_PATH);
+
+    history.version = JOBCACHE_VERSION;
+}
+
+static void entry_uncache (jobcache_entry_t *entry)
+{
+    if(entry->cached) {
+        entry->cached = false;
+        vfs_unlink(cache_filename(entry));
+    }
+}
+
+static void promote_abort (void)
+{
+    if(promote.src)
+        vfs_close(promote.src);
+    if(promote.dst) {
+        vfs_close(promote.dst);
+        vfs_unlink(cache_filename(promote.entry));
+    }
+
+    promote.src = promote.dst = NULL;
+    promote.state = Promote_Idle;
+}
+
+// Evict least recently used copies until size fits in budget.
+static bool cache_make_room (jobcache_entry_t *keep, uint32_t size)
+{
+    uint_fast8_t idx;
+    uint32_t used;
+    jobcache_entry_t *lru;
+
+    do {
+        used = size;
+        lru = NULL;
+        for(idx = 0; idx < JOBCACHE_ENTRIES; idx++) {
+            if(history.entry[idx].cached) {
+                used += history.entry[idx].size;
+                if(&history.entry[idx] != keep && (lru == NULL || history.entry[idx].last_used < lru->last_used))
+                    lru = &history.entry[idx];
+            }
+        }
+        if(used > JOBCACHE_BUDGET && lru)
+            entry_uncache(lru);
+    } while(used > JOBCACHE_BUDGET && lru);
+
+    return used <= JOBCACHE_BUDGET;
+}
+
+// Copies and then verifies one chunk per call when idle.
+static void promote_process (sys_state_t state)
+{
+    size_t count;
+
+    on_execute_realtime(state);
+
+    if(promote.state == Promote_Idle || state != STATE_IDLE || hal.stream.type == StreamType_File)
+        return;
+
+    if(promote.state == Promote_Copy) {
+        if((count = vfs_read(promote.buf, 1, JOBCACHE_CHUNK, promote.src)) > 0) {
+            promote.crc = fs_crc32(promote.crc, promote.buf, count);
+            if(vfs_write(promote.buf, 1, count, promote.dst) != count)
+                promote_abort();
+        } else {
+            vfs_close(promote.src);
+            vfs_close(promote.dst);
+            promote.src = NULL;
+            promote.entry->crc = promote.crc;
+            promote.crc = 0;
+            if((promote.dst = vfs_open(cache_filename(promote.entry), "r")))
+                promote.state = Promote_Verify;
+            else
+                promote_abort();
+        }
+    } else if((count = vfs_read(promote.buf, 1, JOBCACHE_CHUNK, promote.dst)) > 0)
+        promote.crc = fs_crc32(promote.crc, promote.buf, count);
+    else {
+        vfs_close(promote.dst);
+        promote.dst = NULL;
+        if(promote.crc == promote.entry->crc) {
+            promote.entry->cached = true;
+            history_save();
+        } else
+            vfs_unlink(cache_filename(promote.entry));
+        promote.state = Promote_Idle;
+    }
+}
+
+static void promote_start (jobcache_entry_t *entry)
+{
+    if(promote.state != Promote_Idle || !cache_make_room(entry, entry->size))
+        return;
+
+    if((promote.src = vfs_open(entry->path, "r")) == NULL)
+        return;
+
+    promote.entry = entry;
+
+    if((promote.dst = vfs_open(cache_filename(entry), "w")) == NULL) {
+        promote_abort();
+        return;
+    }
+
+    promote.crc = 0;
+    promote.state = Promote_Copy;
+}
+
+// History keys are without the leading /, the VFS accepts both forms for files in the root.
+static inline const char *history_key (const char *filename)
+{
+    return *filename == '/' ? filename + 1 : filename;
+}
+
+// Returns true if the CRC of the file contents matches crc.
+// Only used for files without a timestamp, the CRC is from the hash cache or
+// file metadata when available, else the file is read.
+static bool source_matches (const char *filename, uint32_t crc)
+{
+#if SDCARD_SYNC_ENABLE
+    uint32_t src_crc;
+
+    return fs_file_crc32(filename, &src_crc) && src_crc == crc;
+#else
+    size_t count;
+    uint32_t src_crc = 0;
+    vfs_file_t *file;
+    uint8_t buf[JOBCACHE_CHUNK];
+
+    if((file = vfs_open(filename, "r")) == NULL)
+        return false;
+
+    while((count = vfs_read(buf, 1, sizeof(buf), file)) > 0)
+        src_crc = fs_crc32(src_crc, buf, count);
+
+    vfs_close(file);
+
+    return src_crc == crc;
+#endif
+}
+
+// Returns path to a valid cached copy of the file if available, NULL if not.
+// Also registers the file as the current job in the history.
+// FatFs timestamps are kept unique by the generation counter when there is no RTC,
+// so size and modification time are trusted when the source has a timestamp.
+char *jobcache_lookup (const char *filename)
+{
+    uint_fast8_t idx;
+    vfs_stat_t st;
+    const char *key = history_key(filename);
+    jobcache_entry_t *entry = NULL, *lru = NULL;
+
+    current = -1;
+
+    if(strlen(key) >= sizeof(history.entry[0].path) || vfs_stat(filename, &st) != 0)
+        return NULL;
+
+    for(idx = 0; idx < JOBCACHE_ENTRIES; idx++) {
+        if(!strcmp(history.entry[idx].path, key)) {
+            entry = &history.entry[idx];
+            break;
+        }
+        if(lru == NULL || history.entry[idx].last_used < lru->last_used)
+            lru = &history.entry[idx];
+    }
+
+    if(entry == NULL) { // Not in history, replace least recently used entry.
+        if(promote.state != Promote_Idle && promote.entry == lru)
+            promote_abort();
+        entry = lru;
+        entry_uncache(entry);
+        memset(entry, 0, sizeof(jobcache_entry_t));
+        strcpy(entry->path, key);
+    }
+
+    if(entry->size != st.st_size || entry->mtime != get_mtime(&st) ||  // Source changed,
+        (entry->cached && entry->mtime == 0 && !source_matches(filename, entry->crc))) {
+        if(promote.state != Promote_Idle && promote.entry == entry) // invalidate cached copy
+            promote_abort();                                         // and restart run count.
+        entry_uncache(entry);
+        entry->size = st.st_size;
+        entry->mtime = get_mtime(&st);
+        entry->runs = 0;
+    }
+
+    entry->last_used = ++history.sequence;
+    current = entry - history.entry;
+
+    return entry->cached ? cache_filename(entry) : NULL;
+}
+
+// Called on job completion, updates the run count and starts promotion if file qualifies.
+void jobcache_job_completed (bool check_mode)
+{
+    if(current >= 0 && !check_mode) {
+
+        jobcache_entry_t *entry = &history.entry[current];
+
+        if(entry->runs < UINT16_MAX)
+            entry->runs++;
+
+        history_save();
+
+        if(!entry->cached && entry->runs >= JOBCACHE_PROMOTE_RUNS && entry->size <= JOBCACHE_MAX_FILE_SIZE)
+            promote_start(entry);
+    }
+
+    current = -1;
+}
+
+// Removes the file from the history, called when the source file is written, renamed or deleted.
+void jobcache_invalidate (const char *filename)
+{
+    uint_fast8_t idx = JOBCACHE_ENTRIES;
+    const char *key = history_key(filename);
+
+    do {
+        if(!strcmp(history.entry[--idx].path, key)) {
+            if(promote.state != Promote_Idle && promote.entry == &history.entry[idx])
+                promote_abort();
+            entry_uncache(&history.entry[idx]);
+            memset(&history.entry[idx], 0, sizeof(jobcache_entry_t));
+            history_save();
+            break;
+        }
+    } while(idx);
+}
+
+static status_code_t sd_cmd_history (sys_state_t state, char *args)
+{
+    uint_fast8_t idx;
+    char buf[100];
+
+    for(idx = 0; idx < JOBCACHE_ENTRIES; idx++) {
+        if(*history.entry[idx].path) {
+            sprintf(buf, "[JOB:%s|RUNS:%d|CACHED:%d]" ASCII_EOL, history.entry[idx].path, history.entry[idx].runs, history.entry[idx].cached);
+            hal.stream.write(buf);
+        }
+    }
+
+    return Status_OK;
+}
+
+static void jobcache_load (void *data)
+{
+    history_load();
+}
+
+void jobcache_init (void)
+{
+    PROGMEM static const sys_command_t jobcache_command_list[] = {
+        {"FH", sd_cmd_history, { .noargs = On }, { .str = "list SD card job history" } }
+    };
+
+    static sys_commands_t jobcache_commands = {
+        .n_commands = sizeof(jobcache_command_list) / sizeof(sys_command_t),
+        .commands = jobcache_command_list
+    };
+
+    system_register_commands(&jobcache_commands);
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = promote_process;
+
+    protocol_enqueue_foreground_task(jobcache_load, NULL);
+}
+
+#endif // SDCARD_ENABLE && SDCARD_JOBCACHE_ENABLE && LITTLEFS_ENABLE
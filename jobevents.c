@@ -0,0 +1,226 @@
+/*
+  jobevents.c - push based job progress and lifecycle events
+
+  Part of SDCard plugin for grblHAL
+
+  Outputs [JOB:...] messages at job start, at configurable progress steps,
+  on feed hold, resume and tool change and at job end, so that hosts do not
+  have to poll the real time report for progress.
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sdcard.h"
+
+#if SDCARD_ENABLE && SDCARD_JOBEVENTS_ENABLE
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef ARDUINO
+#include "../grbl/state_machine.h"
+#else
+#include "grbl/state_machine.h"
+#endif
+
+#include "jobevents.h"
+#include "elide.h"
+
+#define JOBEVENTS_POLL_INTERVAL 100 // ms
+
+static struct {
+    bool active;
+    bool held;
+    uint8_t step;           // Progress step in percent, 0 to disable events.
+    uint8_t next_pct;
+    uint32_t started;
+    uint32_t last_poll;
+    uint32_t holds;
+    uint32_t tool_changes;
+} job = { .step = SDCARD_JOBEVENTS_STEP };
+
+static on_execute_realtime_ptr on_execute_realtime;
+static on_state_change_ptr on_state_change;
+
+static inline uint_fast8_t percent_done (sdcard_job_t *info)
+{
+    return info->size ? (uint_fast8_t)((uint64_t)info->pos * 100 / info->size) : 0;
+}
+
+static void job_event (const char *event)
+{
+    char buf[40];
+    sdcard_job_t *info = sdcard_get_job_info();
+
+    sprintf(buf, "[JOB:%s|" UINT32FMT "]" ASCII_EOL, event, info ? info->line : 0);
+    hal.stream.write(buf);
+}
+
+void jobevents_start (void)
+{
+    sdcard_job_t *info;
+
+    if(job.step && (info = sdcard_get_job_info())) {
+
+        char buf[sizeof(info->name) + 30];
+
+        job.active = true;
+        job.held = false;
+        job.next_pct = job.step;
+        job.holds = job.tool_changes = 0;
+        job.started = job.last_poll = hal.get_elapsed_ticks();
+
+        sprintf(buf, "[JOB:START|%s|%lu]" ASCII_EOL, info->name, (unsigned long)info->size);
+        hal.stream.write(buf);
+    }
+}
+
+// To be called while the job is still streaming.
+void jobevents_end (job_end_t reason, status_code_t status)
+{
+    sdcard_job_t *info;
+
+    if(job.active && (info = sdcard_get_job_info())) {
+
+        char buf[sizeof(info->name) + 100];
+
+        switch(reason) {
+
+            case JobEnd_Completed:
+#if SDCARD_ELIDE_ENABLE
+                sprintf(buf, "[JOB:COMPLETE|%s|" UINT32FMT "|%lu|%lu|%lu|%lu|%lu|%lu]" ASCII_EOL, info->name, info->line, (unsigned long)info->pos,
+                         (unsigned long)((hal.get_elapsed_ticks() - job.started) / 1000), (unsigned long)job.holds, (unsigned long)job.tool_changes,
+                          (unsigned long)elide_get_stats()->bytes, (unsigned long)elide_get_stats()->words);
+#else
+                sprintf(buf, "[JOB:COMPLETE|%s|" UINT32FMT "|%lu|%lu|%lu|%lu]" ASCII_EOL, info->name, info->line, (unsigned long)info->pos,
+                         (unsigned long)((hal.get_elapsed_ticks() - job.started) / 1000), (unsigned long)job.holds, (unsigned long)job.tool_changes);
+#endif
+                break;
+
+            case JobEnd_Error:
+                sprintf(buf, "[JOB:ERROR|%d|" UINT32FMT "]" ASCII_EOL, (uint8_t)status, info->line);
+                break;
+
+            default:
+                sprintf(buf, "[JOB:ABORTED|" UINT32FMT "]" ASCII_EOL, info->line);
+                break;
+        }
+
+        hal.stream.write(buf);
+    }
+
+    job.active = false;
+}
+
+static void jobevents_state_change (sys_state_t state)
+{
+    if(job.active) switch(state) {
+
+        case STATE_HOLD:
+            if(!job.held) {
+                job.held = true;
+                job.holds++;
+                job_event("HOLD");
+            }
+            break;
+
+        case STATE_TOOL_CHANGE:
+            job.tool_changes++;
+            job_event("TOOLCHANGE");
+            break;
+
+        case STATE_CYCLE:
+            if(job.held) {
+                job.held = false;
+                job_event("RESUME");
+            }
+            break;
+    }
+
+    if(on_state_change)
+        on_state_change(state);
+}
+
+// Checks progress at regular intervals while a job is running.
+static void jobevents_poll (sys_state_t state)
+{
+    uint32_t ms;
+
+    on_execute_realtime(state);
+
+    if(job.active && (ms = hal.get_elapsed_ticks()) - job.last_poll >= JOBEVENTS_POLL_INTERVAL) {
+
+        uint_fast8_t pct;
+        sdcard_job_t *info;
+
+        job.last_poll = ms;
+
+        if((info = sdcard_get_job_info()) && (pct = percent_done(info)) >= job.next_pct && pct < 100) {
+
+            char buf[40];
+
+            sprintf(buf, "[JOB:PROGRESS|%d|" UINT32FMT "]" ASCII_EOL, (uint8_t)pct, info->line);
+            hal.stream.write(buf);
+
+            job.next_pct = (pct / job.step + 1) * job.step;
+        }
+    }
+}
+
+// $FE[=<step>] - report or set progress step in percent, 0 disables events.
+static status_code_t sd_cmd_jobevents (sys_state_t state, char *args)
+{
+    char buf[24];
+
+    if(args) {
+
+        char *end;
+        uint32_t step = strtoul(args, &end, 10);
+
+        if(*end != '\0' || step > 100)
+            return Status_InvalidStatement;
+
+        if((job.step = (uint8_t)step) == 0)
+            job.active = false;
+    } else {
+        sprintf(buf, "[JOBEVENTS:%d]" ASCII_EOL, job.step);
+        hal.stream.write(buf);
+    }
+
+    return Status_OK;
+}
+
+void jobevents_init (void)
+{
+    PROGMEM static const sys_command_t jobevents_command_list[] = {
+        {"FE", sd_cmd_jobevents, {}, { .str = "$FE[=<step>] - report or set job progress event step in percent, 0 to disable" } }
+    };
+
+    static sys_commands_t jobevents_commands = {
+        .n_commands = sizeof(jobevents_command_list) / sizeof(sys_command_t),
+        .commands = jobevents_command_list
+    };
+
+    system_register_commands(&jobevents_commands);
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = jobevents_poll;
+
+    on_state_change = grbl.on_state_change;
+    grbl.on_state_change = jobevents_state_change;
+}
+
+#endif // SDCARD_ENABLE && SDCARD_JOBEVENTS_ENABLE
@@ -0,0 +1,32 @@
+/*
+  jobevents.h - push based job progress and lifecycle events
+
+  Part of SDCard plugin for grblHAL
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+typedef enum {
+    JobEnd_Completed = 0,
+    JobEnd_Error,
+    JobEnd_Aborted
+} job_end_t;
+
+void jobevents_init (void);
+void jobevents_start (void);
+void jobevents_end (job_end_t reason, status_code_t status);
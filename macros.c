@@ -28,6 +28,7 @@
 #if SDCARD_ENABLE || LITTLEFS_ENABLE
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "grbl/hal.h"
@@ -36,14 +37,38 @@
 #include "grbl/ngc_flowctrl.h"
 #include "grbl/stream_file.h"
 
+#include "memstats.h"
+#include "macros.h"
+#include "spans.h"
+
+#if SDCARD_ENABLE && SDCARD_ONUMBER_ENABLE
+#include "onumber.h"
+#endif
+
+#if SDCARD_ENABLE && SDCARD_BUNDLE_ENABLE
+#include "bundle.h"
+#endif
+
 #ifndef MACRO_STACK_DEPTH
 #define MACRO_STACK_DEPTH 5
 #endif
 
+// Sharded layout, P<n>.macro is looked up in <root>/macros/P<n / 100>/ before <root>/.
+#ifndef MACRO_SHARDS_ENABLE
+#define MACRO_SHARDS_ENABLE 0
+#endif
+
+#define MACRO_SHARD_DIR "/macros"
+
+#define MACRO_CHECKPOINT (SDCARD_ENABLE && SDCARD_CHECKPOINT_ENABLE)
+
 typedef struct {
     macro_id_t id;
     vfs_file_t *file;
 //    uint32_t line;
+#if MACRO_CHECKPOINT
+    char path[64];
+#endif
 } macro_stack_entry_t;
 
 static volatile int_fast16_t stack_idx = -1;
@@ -53,6 +78,18 @@ static on_macro_execute_ptr on_macro_execute;
 static on_macro_return_ptr on_macro_return = NULL;
 static driver_reset_ptr driver_reset;
 
+#if MACRO_SHARDS_ENABLE
+static on_execute_realtime_ptr on_execute_realtime;
+static struct {
+    bool active;
+    vfs_dir_t *dir;         // Kept open across steps, entries are read once.
+    int32_t shard;          // Last shard directory created.
+    uint32_t moved;
+    uint32_t failed;
+    char root[16];
+} migrate = {0};
+#endif
+
 #if NGC_EXPRESSIONS_ENABLE
 static on_vfs_mount_ptr on_vfs_mount;
 static on_vfs_unmount_ptr on_vfs_unmount;
@@ -79,6 +116,7 @@ static void end_macro (void)
     if(stack_idx == -1) {
         grbl.on_macro_return = on_macro_return;
         on_macro_return = NULL;
+        SPAN_END(Span_Macro);
     }
 }
 
@@ -136,22 +174,75 @@ static status_code_t macro_start (char *filename, macro_id_t macro_id)
 
     } else {
 
-        if((file = stream_redirect_read(filename, onG65MacroError, onG65MacroEOF)) == NULL)
+        SPAN_BEGIN(Span_MacroOpen);
+        file = stream_redirect_read(filename, onG65MacroError, onG65MacroEOF);
+        SPAN_END(Span_MacroOpen);
+
+        if(file == NULL)
             return Status_FileOpenFailed;
 
         if(stack_idx == -1) {
             on_macro_return = grbl.on_macro_return;
             grbl.on_macro_return = end_macro;
+            SPAN_BEGIN(Span_Macro);
         }
 
         stack_idx++;
         macro[stack_idx].file = file;
         macro[stack_idx].id = macro_id;
+#if MACRO_CHECKPOINT
+        strncpy(macro[stack_idx].path, filename, sizeof(macro[stack_idx].path) - 1);
+        macro[stack_idx].path[sizeof(macro[stack_idx].path) - 1] = '\0';
+#endif
     }
 
     return Status_Handled;
 }
 
+#if MACRO_CHECKPOINT
+
+// Returns the number of active macros, outermost first.
+uint_fast8_t fs_macros_get_stack (fs_macro_frame_t *frames, uint_fast8_t max_frames)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx <= stack_idx && idx < max_frames; idx++) {
+        frames[idx].id = macro[idx].id;
+        frames[idx].file = macro[idx].file;
+        frames[idx].path = macro[idx].path;
+    }
+
+    return idx;
+}
+
+// Restarts a macro from a checkpoint, execution continues from offset.
+status_code_t fs_macros_resume (char *path, macro_id_t macro_id, size_t offset)
+{
+    status_code_t status;
+
+    if(!ngc_call_push(NULL))
+        return Status_FlowControlStackOverflow;
+
+    if((status = macro_start(path, macro_id)) != Status_Handled)
+        ngc_call_pop();
+    else if(vfs_seek(macro[stack_idx].file, offset) != 0) {
+        end_macro();
+        status = Status_FileOpenFailed;
+    } else
+        status = Status_OK;
+
+    return status;
+}
+
+// Ends all running macros, used when a resumed job is aborted.
+void fs_macros_stop (void)
+{
+    while(stack_idx >= 0)
+        end_macro();
+}
+
+#endif // MACRO_CHECKPOINT
+
 #if NGC_PARAMETERS_ENABLE
 
 static status_code_t macro_get_setting (void)
@@ -242,6 +333,25 @@ static status_code_t macro_get_tool_offset (void)
 
 #endif // NGC_PARAMETERS_ENABLE
 
+// Starts macro from the file system mounted at root, root is "" for the root mount.
+static status_code_t macro_start_from (const char *root, macro_id_t macro_id)
+{
+    char filename[40];
+
+#if MACRO_SHARDS_ENABLE
+    status_code_t status;
+
+    sprintf(filename, "%s" MACRO_SHARD_DIR "/P%d/P%d.macro", root, macro_id / 100, macro_id);
+
+    if((status = macro_start(filename, macro_id)) != Status_FileOpenFailed)
+        return status;
+#endif
+
+    sprintf(filename, "%s/P%d.macro", root, macro_id);
+
+    return macro_start(filename, macro_id);
+}
+
 static status_code_t macro_execute (macro_id_t macro_id)
 {
     status_code_t status = Status_Unhandled;
@@ -274,18 +384,28 @@ static status_code_t macro_execute (macro_id_t macro_id)
 
     else {
 
+#if SDCARD_ENABLE && SDCARD_BUNDLE_ENABLE
         char filename[32];
 
-#if LITTLEFS_ENABLE == 1
-        sprintf(filename, "/littlefs/P%d.macro", macro_id);
+        if(bundle_is_mounted()) { // Members of the mounted job bundle take precedence
+            sprintf(filename, BUNDLE_PATH "/P%d.macro", macro_id);
+            status = macro_start(filename, macro_id);
+        }
 
-        if((status = macro_start(filename, macro_id)) != Status_Handled)
+        if(status != Status_Handled)
 #endif
         {
-            sprintf(filename, "/P%d.macro", macro_id);
-
-            status = macro_start(filename, macro_id);
+#if LITTLEFS_ENABLE == 1
+            if((status = macro_start_from("/littlefs", macro_id)) != Status_Handled)
+#endif
+            status = macro_start_from("", macro_id);
         }
+
+#if SDCARD_ENABLE && SDCARD_ONUMBER_ENABLE
+        char *path;
+        if(status == Status_FileOpenFailed && (path = onumber_lookup(macro_id))) // Try file with program number in header
+            status = macro_start(path, macro_id);
+#endif
     }
 
     return status == Status_Unhandled && on_macro_execute ? on_macro_execute(macro_id) : status;
@@ -435,6 +555,104 @@ static void atc_macros_detach (const char *path)
 
 #endif // NGC_EXPRESSIONS_ENABLE
 
+#if MACRO_SHARDS_ENABLE
+
+// Returns macro number if name is P<n>.macro with n >= 100, 0 if not.
+static macro_id_t macro_number (const char *name)
+{
+    char *end;
+    unsigned long n;
+
+    if(*name != 'P' || name[1] < '0' || name[1] > '9')
+        return 0;
+
+    n = strtoul(name + 1, &end, 10);
+
+    return !strcmp(end, ".macro") && n >= 100 && n <= 0xFFFF ? (macro_id_t)n : 0;
+}
+
+// Moves the next macro from the flat to the sharded layout, macros that failed to move are left in place.
+// Reports the result when no more macros are found.
+static void macro_migrate_step (void)
+{
+    char from[40], to[40];
+    macro_id_t id = 0;
+    vfs_dirent_t *dirent;
+
+    while((dirent = vfs_readdir(migrate.dir)) && *dirent->name) {
+        if(!dirent->st_mode.directory && (id = macro_number(dirent->name)))
+            break;
+    }
+
+    if(id == 0) {
+
+        vfs_closedir(migrate.dir);
+        migrate.dir = NULL;
+        migrate.active = false;
+
+        sprintf(to, "[MACROSHARD:%lu|%lu]" ASCII_EOL, (unsigned long)migrate.moved, (unsigned long)migrate.failed);
+        hal.stream.write(to);
+
+        return;
+    }
+
+    sprintf(to, "%s" MACRO_SHARD_DIR "/P%d", migrate.root, id / 100);
+
+    if(migrate.shard != id / 100) {
+        migrate.shard = id / 100;
+        sprintf(from, "%s" MACRO_SHARD_DIR, migrate.root);
+        vfs_mkdir(from);    // Fails if present, ignored.
+        vfs_mkdir(to);      // ...
+    }
+
+    sprintf(from, "%s/P%d.macro", migrate.root, id);
+    sprintf(strchr(to, '\0'), "/P%d.macro", id);
+
+    if(vfs_rename(from, to) == 0)
+        migrate.moved++;
+    else
+        migrate.failed++;
+}
+
+static void macro_migrate_poll (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    if(migrate.active && state == STATE_IDLE && hal.stream.type != StreamType_File)
+        macro_migrate_step();
+}
+
+// $FMS[=<mount path>] - move macros to the sharded layout, the littlefs mount if available is used by default.
+static status_code_t macro_cmd_migrate (sys_state_t state, char *args)
+{
+    if(migrate.active)
+        return Status_IdleError;
+
+    if(args == NULL)
+#if LITTLEFS_ENABLE == 1
+        args = "/littlefs";
+#else
+        args = "";
+#endif
+    else if(!strcmp(args, "/"))
+        args = "";
+
+    if(strlen(args) >= sizeof(migrate.root))
+        return Status_InvalidStatement;
+
+    if((migrate.dir = vfs_opendir(*args ? args : "/")) == NULL)
+        return Status_FileOpenFailed;
+
+    strcpy(migrate.root, args);
+    migrate.shard = -1;
+    migrate.moved = migrate.failed = 0;
+    migrate.active = true;
+
+    return Status_OK;
+}
+
+#endif // MACRO_SHARDS_ENABLE
+
 // Add info about our plugin to the $I report.
 static void report_options (bool newopt)
 {
@@ -446,6 +664,8 @@ static void report_options (bool newopt)
 
 void fs_macros_init (void)
 {
+    MEMSTATS_STATIC(MemGroup_Macros, sizeof(macro) + sizeof(tc_path));
+
     on_report_options = grbl.on_report_options;
     grbl.on_report_options = report_options;
 
@@ -455,6 +675,24 @@ void fs_macros_init (void)
     driver_reset = hal.driver_reset;
     hal.driver_reset = plugin_reset;
 
+#if MACRO_SHARDS_ENABLE
+
+    PROGMEM static const sys_command_t macro_command_list[] = {
+        {"FMS", macro_cmd_migrate, {}, { .str = "$FMS[=<mount path>] - move numbered macros to sharded directory layout" } }
+    };
+
+    static sys_commands_t macro_commands = {
+        .n_commands = sizeof(macro_command_list) / sizeof(sys_command_t),
+        .commands = macro_command_list
+    };
+
+    system_register_commands(&macro_commands);
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = macro_migrate_poll;
+
+#endif
+
 #if NGC_EXPRESSIONS_ENABLE
 
     on_vfs_mount = vfs.on_mount;
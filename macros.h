@@ -25,4 +25,18 @@
 
 void fs_macros_init (void);
 
+#if SDCARD_ENABLE && SDCARD_CHECKPOINT_ENABLE
+
+typedef struct {
+    macro_id_t id;
+    vfs_file_t *file;
+    const char *path;
+} fs_macro_frame_t;
+
+uint_fast8_t fs_macros_get_stack (fs_macro_frame_t *frames, uint_fast8_t max_frames);
+status_code_t fs_macros_resume (char *path, macro_id_t macro_id, size_t offset);
+void fs_macros_stop (void);
+
+#endif
+
 #endif // _FS_MACROS_H_
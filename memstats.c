@@ -0,0 +1,96 @@
+/*
+  memstats.c - memory accounting per subsystem
+
+  Part of SDCard plugin for grblHAL
+
+  Keeps track of current and peak heap use, number of allocations and failed
+  allocations per subsystem. Large static buffers may be registered as well.
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sdcard.h"
+
+#if SDCARD_ENABLE && SDCARD_MEMSTATS_ENABLE
+
+#include <stdio.h>
+
+#include "memstats.h"
+
+// Prepended to each allocation to keep track of its size, sized to keep the alignment of malloc.
+typedef union {
+    size_t size;
+    uint64_t align;
+} memstats_header_t;
+
+typedef struct {
+    uint32_t static_bytes;
+    uint32_t current;
+    uint32_t peak;
+    uint32_t allocs;
+    uint32_t failures;
+} memstats_t;
+
+static const char *const group_name[MemGroup_N] = { "FatFs", "littlefs", "YModem", "Macros", "Jobs" };
+
+static memstats_t stats[MemGroup_N] = {0};
+
+void *memstats_alloc (memstats_group_t group, size_t size)
+{
+    memstats_header_t *hdr = malloc(sizeof(memstats_header_t) + size);
+
+    if(hdr == NULL) {
+        stats[group].failures++;
+        return NULL;
+    }
+
+    hdr->size = size;
+    stats[group].allocs++;
+    if((stats[group].current += size) > stats[group].peak)
+        stats[group].peak = stats[group].current;
+
+    return hdr + 1;
+}
+
+void memstats_free (memstats_group_t group, void *ptr)
+{
+    if(ptr) {
+        memstats_header_t *hdr = (memstats_header_t *)ptr - 1;
+        stats[group].current -= hdr->size;
+        free(hdr);
+    }
+}
+
+void memstats_static (memstats_group_t group, size_t size)
+{
+    stats[group].static_bytes += size;
+}
+
+// Outputs [MEM:<group>|<static>|<current>|<peak>|<allocations>|<failures>] per subsystem.
+void memstats_report (void)
+{
+    uint_fast8_t group;
+    char buf[80];
+
+    for(group = 0; group < MemGroup_N; group++) {
+        sprintf(buf, "[MEM:%s|%lu|%lu|%lu|%lu|%lu]" ASCII_EOL, group_name[group],
+                 (unsigned long)stats[group].static_bytes, (unsigned long)stats[group].current, (unsigned long)stats[group].peak,
+                  (unsigned long)stats[group].allocs, (unsigned long)stats[group].failures);
+        hal.stream.write(buf);
+    }
+}
+
+#endif // SDCARD_ENABLE && SDCARD_MEMSTATS_ENABLE
@@ -0,0 +1,52 @@
+/*
+  memstats.h - memory accounting per subsystem
+
+  Part of SDCard plugin for grblHAL
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdlib.h>
+
+typedef enum {
+    MemGroup_FatFs = 0,
+    MemGroup_LittleFs,
+    MemGroup_YModem,
+    MemGroup_Macros,
+    MemGroup_Jobs,      // Background jobs: preview, delta etc.
+    MemGroup_N
+} memstats_group_t;
+
+#if SDCARD_ENABLE && SDCARD_MEMSTATS_ENABLE
+
+void *memstats_alloc (memstats_group_t group, size_t size);
+void memstats_free (memstats_group_t group, void *ptr);
+void memstats_static (memstats_group_t group, size_t size);
+void memstats_report (void);
+
+#define MEMSTATS_ALLOC(group, size) memstats_alloc(group, size)
+#define MEMSTATS_FREE(group, ptr) memstats_free(group, ptr)
+#define MEMSTATS_STATIC(group, size) memstats_static(group, size)
+
+#else
+
+#define MEMSTATS_ALLOC(group, size) malloc(size)
+#define MEMSTATS_FREE(group, ptr) free(ptr)
+#define MEMSTATS_STATIC(group, size)
+
+#endif
@@ -0,0 +1,325 @@
+/*
+  onumber.c - program number (O-number) index
+
+  Part of SDCard plugin for grblHAL
+
+  Maps the Fanuc style program number in the header of each file, e.g. O1234,
+  to the file path. The index is built in idle time slices when a file system
+  is mounted and rebuilt when files are changed by the plugin.
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sdcard.h"
+
+#if SDCARD_ENABLE && SDCARD_ONUMBER_ENABLE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef ARDUINO
+#include "../grbl/state_machine.h"
+#include "../grbl/vfs.h"
+#else
+#include "grbl/state_machine.h"
+#include "grbl/vfs.h"
+#endif
+
+#include "onumber.h"
+#include "memstats.h"
+
+#ifndef ONUMBER_INDEX_SIZE
+#define ONUMBER_INDEX_SIZE 64
+#endif
+#ifndef ONUMBER_PATHLEN
+#define ONUMBER_PATHLEN 64
+#endif
+
+#define ONUMBER_SCAN_DEPTH 4
+#define ONUMBER_HEADER_LEN 64
+
+typedef struct {
+    uint32_t onum; // 0 if free
+    char path[ONUMBER_PATHLEN];
+} onumber_entry_t;
+
+static struct {
+    bool dirty;     // Rebuild pending.
+    bool building;
+    uint32_t dropped; // Files not indexed as the index is full.
+    uint_fast8_t depth;
+    vfs_dir_t *dir[ONUMBER_SCAN_DEPTH];
+    char path[ONUMBER_PATHLEN];
+} scan = {0};
+
+static onumber_entry_t onumber_index[ONUMBER_INDEX_SIZE];
+static on_execute_realtime_ptr on_execute_realtime;
+static on_vfs_mount_ptr on_vfs_mount;
+
+extern char const *const filetypes[];
+
+static bool is_gcode_file (const char *name)
+{
+    uint_fast8_t idx = 0;
+    char ext[8], *s = strrchr(name, '.');
+
+    if(s == NULL || strlen(++s) >= sizeof(ext))
+        return false;
+
+    strcpy(ext, s);
+    for(s = ext; *s; s++)
+        *s = LCAPS(*s);
+
+    while(filetypes[idx][0] && strcmp(ext, filetypes[idx]))
+        idx++;
+
+    return filetypes[idx][0] != '\0';
+}
+
+// Returns the program number from the header of the file, 0 if none.
+// Leading whitespace and % lines are skipped, both the O1234 and :1234 forms are accepted.
+static uint32_t read_onumber (const char *filename)
+{
+    char buf[ONUMBER_HEADER_LEN], *s = buf;
+    size_t len;
+    vfs_file_t *file;
+
+    if((file = vfs_open(filename, "r")) == NULL)
+        return 0;
+
+    len = vfs_read(buf, 1, sizeof(buf) - 1, file);
+    vfs_close(file);
+    buf[len] = '\0';
+
+    while(*s) {
+        if(*s == '%') {
+            while(*s && *s != '\n')
+                s++;
+        } else if(*s <= ' ')
+            s++;
+        else
+            break;
+    }
+
+    return (CAPS(*s) == 'O' || *s == ':') && s[1] >= '0' && s[1] <= '9' ? strtoul(s + 1, NULL, 10) : 0;
+}
+
+static onumber_entry_t *index_find (uint32_t onum)
+{
+    uint_fast16_t idx = onum % ONUMBER_INDEX_SIZE, probes = ONUMBER_INDEX_SIZE;
+
+    do {
+        if(onumber_index[idx].onum == onum)
+            return &onumber_index[idx];
+        if(onumber_index[idx].onum == 0)
+            break;
+        idx = (idx + 1) % ONUMBER_INDEX_SIZE;
+    } while(--probes);
+
+    return NULL;
+}
+
+// Adds entry, the first file found is kept if the program number is a duplicate.
+// Returns false if the index is full.
+static bool index_add (uint32_t onum, const char *path)
+{
+    uint_fast16_t idx = onum % ONUMBER_INDEX_SIZE, probes = ONUMBER_INDEX_SIZE;
+
+    do {
+        if(onumber_index[idx].onum == onum)
+            return true;
+        if(onumber_index[idx].onum == 0) {
+            onumber_index[idx].onum = onum;
+            strcpy(onumber_index[idx].path, path);
+            return true;
+        }
+        idx = (idx + 1) % ONUMBER_INDEX_SIZE;
+    } while(--probes);
+
+    return false;
+}
+
+static void scan_end (void)
+{
+    while(scan.building) {
+        vfs_closedir(scan.dir[scan.depth]);
+        if(scan.depth == 0)
+            scan.building = false;
+        else
+            scan.depth--;
+    }
+}
+
+// Processes one directory entry per call when idle.
+static void onumber_scan (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    if(!(scan.dirty || scan.building) || state != STATE_IDLE || hal.stream.type == StreamType_File)
+        return;
+
+    if(scan.dirty) {
+        scan_end();
+        memset(onumber_index, 0, sizeof(onumber_index));
+        *scan.path = '\0';
+        scan.depth = 0;
+        scan.dropped = 0;
+        scan.dirty = false;
+        scan.building = (scan.dir[0] = vfs_opendir("/")) != NULL;
+        return;
+    }
+
+    vfs_dirent_t *dirent;
+    size_t len = strlen(scan.path);
+
+    if((dirent = vfs_readdir(scan.dir[scan.depth])) == NULL || *dirent->name == '\0') {
+        vfs_closedir(scan.dir[scan.depth]);
+        if(scan.depth == 0) {
+            scan.building = false;
+            if(scan.dropped)
+                report_message("Program number index full, increase ONUMBER_INDEX_SIZE", Message_Warning);
+        } else {
+            scan.depth--;
+            *strrchr(scan.path, '/') = '\0';
+        }
+        return;
+    }
+
+    if(*dirent->name == '.' || len + strlen(dirent->name) + 2 > sizeof(scan.path))
+        return;
+
+    scan.path[len] = '/';
+    strcpy(&scan.path[len + 1], dirent->name);
+
+    if(dirent->st_mode.directory) {
+        if(scan.depth < ONUMBER_SCAN_DEPTH - 1 && (scan.dir[scan.depth + 1] = vfs_opendir(scan.path))) {
+            scan.depth++;
+            return;
+        }
+    } else if(is_gcode_file(dirent->name)) {
+        uint32_t onum;
+        if((onum = read_onumber(scan.path)) && !index_add(onum, scan.path))
+            scan.dropped++;
+    }
+
+    scan.path[len] = '\0';
+}
+
+// Returns path of file with program number, NULL if not found.
+// The file header is checked so that a stale entry is never returned.
+char *onumber_lookup (uint32_t onum)
+{
+    onumber_entry_t *entry;
+
+    if(onum && (entry = index_find(onum))) {
+        if(read_onumber(entry->path) == onum)
+            return entry->path;
+        if(!scan.building)
+            onumber_invalidate(); // File changed behind our back, e.g. on another computer, rebuild.
+    }
+
+    return NULL;
+}
+
+// Returns path of file with program number if name is on the form O<n> and a file by that name does not exist.
+char *onumber_resolve (char *name)
+{
+    char *end;
+    vfs_stat_t st;
+    uint32_t onum;
+
+    if(CAPS(*name) == 'O' && name[1] >= '0' && name[1] <= '9') {
+        onum = strtoul(name + 1, &end, 10);
+        if(*end == '\0' && vfs_stat(name, &st) != 0)
+            return onumber_lookup(onum);
+    }
+
+    return NULL;
+}
+
+// Rebuilds the index.
+void onumber_invalidate (void)
+{
+    scan.dirty = true;
+}
+
+// Called when a file or directory is added, changed, renamed or deleted.
+// Rebuilds the index if the path is a G-code file or may be a directory.
+void onumber_file_changed (const char *path)
+{
+    const char *name = strrchr(path, '/');
+
+    name = name ? name + 1 : path;
+
+    if(*name != '.' && (strchr(name, '.') == NULL || is_gcode_file(name)))
+        onumber_invalidate();
+}
+
+static void onumber_on_mount (const char *path, const vfs_t *fs)
+{
+    onumber_invalidate();
+
+    if(on_vfs_mount)
+        on_vfs_mount(path, fs);
+}
+
+// $FO - list program number index.
+static status_code_t sd_cmd_onumber (sys_state_t state, char *args)
+{
+    uint_fast16_t idx;
+    char buf[ONUMBER_PATHLEN + 20];
+
+    if(scan.building || scan.dirty)
+        report_message("Program number index is being built", Message_Plain);
+    else if(scan.dropped) {
+        sprintf(buf, "Program number index full, %lu files not indexed", (unsigned long)scan.dropped);
+        report_message(buf, Message_Warning);
+    }
+
+    for(idx = 0; idx < ONUMBER_INDEX_SIZE; idx++) {
+        if(onumber_index[idx].onum) {
+            sprintf(buf, "[ONUM:%lu|%s]" ASCII_EOL, (unsigned long)onumber_index[idx].onum, onumber_index[idx].path);
+            hal.stream.write(buf);
+        }
+    }
+
+    return Status_OK;
+}
+
+void onumber_init (void)
+{
+    PROGMEM static const sys_command_t onumber_command_list[] = {
+        {"FO", sd_cmd_onumber, { .noargs = On }, { .str = "list program number index" } }
+    };
+
+    static sys_commands_t onumber_commands = {
+        .n_commands = sizeof(onumber_command_list) / sizeof(sys_command_t),
+        .commands = onumber_command_list
+    };
+
+    system_register_commands(&onumber_commands);
+
+    MEMSTATS_STATIC(MemGroup_Jobs, sizeof(onumber_index));
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = onumber_scan;
+
+    on_vfs_mount = vfs.on_mount;
+    vfs.on_mount = onumber_on_mount;
+}
+
+#endif // SDCARD_ENABLE && SDCARD_ONUMBER_ENABLE
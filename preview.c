@@ -0,0 +1,405 @@
+/*
+  preview.c - toolpath preview generator
+
+  Part of SDCard plugin for grblHAL
+
+  Streams a file through a lightweight motion interpreter in idle time slices
+  and writes a decimated polyline to a .pv sidecar file.
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sdcard.h"
+
+#if SDCARD_ENABLE && SDCARD_PREVIEW_ENABLE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef ARDUINO
+#include "../grbl/state_machine.h"
+#include "../grbl/vfs.h"
+#else
+#include "grbl/state_machine.h"
+#include "grbl/vfs.h"
+#endif
+
+#include "preview.h"
+#include "memstats.h"
+
+#ifndef PREVIEW_MAX_POINTS
+#define PREVIEW_MAX_POINTS 512
+#endif
+
+#define PREVIEW_CHUNK 128
+#define PREVIEW_PATHLEN 128
+
+typedef struct {
+    vfs_file_t *file;
+    char filename[PREVIEW_PATHLEN];
+    preview_header_t hdr;
+    float target[3];
+    float scale;
+    bool absolute;
+    bool rapid;
+    uint8_t motion;
+    uint8_t comment;
+    bool pending;
+    uint_fast16_t llen;
+    uint32_t stride;
+    uint32_t skipped;
+    char line[80];
+    char buf[PREVIEW_CHUNK];
+    float point[PREVIEW_MAX_POINTS][3];
+    uint8_t point_rapid[PREVIEW_MAX_POINTS];
+} preview_job_t;
+
+static preview_job_t *job = NULL;
+static on_execute_realtime_ptr on_execute_realtime;
+
+static void get_sidecar_name (char *sidecar, const char *filename)
+{
+    strcat(strcpy(sidecar, filename), PREVIEW_EXT);
+}
+
+static uint32_t get_mtime (vfs_stat_t *st)
+{
+#ifdef ESP_PLATFORM
+    return (uint32_t)st->st_mtim;
+#else
+    return (uint32_t)st->st_mtime;
+#endif
+}
+
+// Returns true if sidecar exists and matches the size and modification time of the source file.
+static bool preview_is_valid (const char *filename, vfs_stat_t *st)
+{
+    bool ok = false;
+    vfs_file_t *file;
+    preview_header_t hdr;
+    char sidecar[PREVIEW_PATHLEN + sizeof(PREVIEW_EXT)];
+
+    get_sidecar_name(sidecar, filename);
+
+    if((file = vfs_open(sidecar, "r"))) {
+        ok = vfs_read(&hdr, sizeof(preview_header_t), 1, file) == sizeof(preview_header_t) &&
+              !memcmp(hdr.magic, PREVIEW_MAGIC, sizeof(hdr.magic)) &&
+               hdr.src_size == st->st_size && hdr.src_mtime == get_mtime(st);
+        vfs_close(file);
+    }
+
+    return ok;
+}
+
+static void store_point (void)
+{
+    if(job->hdr.n_points == PREVIEW_MAX_POINTS) { // Buffer full, drop every other point and double the stride.
+        bool rapid;                               // The first and the last point are kept.
+        uint_fast16_t idx, src, prev = 0;
+        for(idx = 1; idx < PREVIEW_MAX_POINTS / 2; idx++) {
+            src = idx == PREVIEW_MAX_POINTS / 2 - 1 ? PREVIEW_MAX_POINTS - 1 : idx * 2;
+            rapid = false;
+            while(prev < src)
+                rapid |= job->point_rapid[++prev];
+            memcpy(job->point[idx], job->point[src], sizeof(job->point[0]));
+            job->point_rapid[idx] = rapid;
+        }
+        job->hdr.n_points = PREVIEW_MAX_POINTS / 2;
+        job->stride <<= 1;
+    }
+
+    memcpy(job->point[job->hdr.n_points], job->target, sizeof(job->point[0]));
+    job->point_rapid[job->hdr.n_points++] = job->rapid;
+    job->skipped = 0;
+    job->rapid = job->pending = false;
+}
+
+static void add_point (bool rapid)
+{
+    uint_fast8_t idx = 3;
+
+    do {
+        idx--;
+        if(job->target[idx] < job->hdr.min[idx])
+            job->hdr.min[idx] = job->target[idx];
+        if(job->target[idx] > job->hdr.max[idx])
+            job->hdr.max[idx] = job->target[idx];
+    } while(idx);
+
+    job->rapid |= rapid;
+    job->pending = true;
+
+    if(++job->skipped >= job->stride || job->hdr.n_points == 0)
+        store_point();
+}
+
+// Interprets a line stripped of whitespace and comments and converted to upper case.
+// Lines with expressions or parameters are skipped.
+static void parse_line (char *line)
+{
+    char *end, letter;
+    float value, target[3];
+    bool axis_words = false, non_modal = false, absolute = job->absolute;
+    uint_fast8_t motion = job->motion;
+
+    memcpy(target, job->target, sizeof(target));
+
+    while((letter = *line++)) {
+
+        if(letter < 'A' || letter > 'Z')
+            return;
+
+        value = strtof(line, &end);
+        if(end == line)
+            return;
+        line = end;
+
+        switch(letter) {
+
+            case 'G':
+                switch((uint_fast16_t)(value * 10.0f + 0.5f)) {
+                    case 0:
+                    case 10:
+                    case 20:
+                    case 30:
+                        motion = (uint_fast8_t)value;
+                        break;
+                    case 200:
+                        job->scale = 25.4f;
+                        break;
+                    case 210:
+                        job->scale = 1.0f;
+                        break;
+                    case 900:
+                        absolute = true;
+                        break;
+                    case 910:
+                        absolute = false;
+                        break;
+                    case 800:
+                        motion = 80;
+                        break;
+                    case 40:
+                    case 100:
+                    case 280:
+                    case 300:
+                    case 530:
+                    case 920:
+                        non_modal = true;
+                        break;
+                }
+                break;
+
+            case 'X':
+            case 'Y':
+            case 'Z':
+                target[letter - 'X'] = absolute ? value * job->scale : target[letter - 'X'] + value * job->scale;
+                axis_words = true;
+                break;
+        }
+    }
+
+    job->motion = motion;
+    job->absolute = absolute;
+
+    if(axis_words && !non_modal && motion <= 3) {
+        memcpy(job->target, target, sizeof(target));
+        add_point(motion == 0);
+    }
+}
+
+static void preview_write (void)
+{
+    vfs_file_t *file;
+    char sidecar[PREVIEW_PATHLEN + sizeof(PREVIEW_EXT)];
+
+    if(job->pending)
+        store_point();
+
+    get_sidecar_name(sidecar, job->filename);
+
+    if((file = vfs_open(sidecar, "w"))) {
+
+        uint_fast16_t idx;
+        uint_fast8_t axis;
+        preview_point_t pt;
+        float range[3];
+
+        for(axis = 0; axis < 3; axis++) {
+            if(job->hdr.n_points == 0)
+                job->hdr.min[axis] = job->hdr.max[axis] = 0.0f;
+            range[axis] = job->hdr.max[axis] - job->hdr.min[axis];
+            range[axis] = range[axis] > 0.0f ? 65535.0f / range[axis] : 0.0f;
+        }
+
+        vfs_write(&job->hdr, sizeof(preview_header_t), 1, file);
+
+        for(idx = 0; idx < job->hdr.n_points; idx++) {
+            pt.x = (uint16_t)((job->point[idx][0] - job->hdr.min[0]) * range[0]);
+            pt.y = (uint16_t)((job->point[idx][1] - job->hdr.min[1]) * range[1]);
+            pt.z = (uint16_t)((job->point[idx][2] - job->hdr.min[2]) * range[2]);
+            pt.flags = job->point_rapid[idx] ? 1 : 0;
+            vfs_write(&pt, sizeof(preview_point_t), 1, file);
+        }
+
+        vfs_close(file);
+    }
+}
+
+static void preview_end (bool write)
+{
+    if(job) {
+
+        vfs_close(job->file);
+
+        if(write) {
+            preview_write();
+            report_message("Preview ready", Message_Plain);
+        }
+
+        MEMSTATS_FREE(MemGroup_Jobs, job);
+        job = NULL;
+    }
+}
+
+// Processes one chunk of the file per call when idle.
+static void preview_process (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    if(job && state == STATE_IDLE && hal.stream.type != StreamType_File) {
+
+        char c, *s = job->buf;
+        size_t count = vfs_read(job->buf, 1, PREVIEW_CHUNK, job->file);
+
+        if(count == 0) {
+            if(job->llen && job->llen < sizeof(job->line)) {
+                job->line[job->llen] = '\0';
+                parse_line(job->line);
+            }
+            preview_end(true);
+        } else while(count--) {
+
+            c = *s++;
+
+            if(c == '\n' || c == '\r') {
+                if(job->llen && job->llen < sizeof(job->line)) {
+                    job->line[job->llen] = '\0';
+                    parse_line(job->line);
+                }
+                job->llen = job->comment = 0;
+            } else if(job->comment) {
+                if(c == ')' && job->comment == 1)
+                    job->comment = 0;
+            } else if(c == '(')
+                job->comment = 1;
+            else if(c == ';')
+                job->comment = 2;
+            else if(c > ' ' && job->llen < sizeof(job->line)) {
+                job->line[job->llen++] = CAPS(c);
+                if(job->llen == sizeof(job->line)) // Line too long, skip
+                    job->comment = 2;
+            }
+        }
+    }
+}
+
+static status_code_t preview_start (char *filename)
+{
+    vfs_stat_t st;
+    vfs_file_t *file;
+
+    if(strlen(filename) >= PREVIEW_PATHLEN)
+        return Status_FileOpenFailed;
+
+    if(vfs_stat(filename, &st) != 0)
+        return Status_FileOpenFailed;
+
+    if(preview_is_valid(filename, &st)) {
+        report_message("Preview up to date", Message_Plain);
+        return Status_OK;
+    }
+
+    if(job)
+        return Status_IdleError;
+
+    if((file = vfs_open(filename, "r")) == NULL)
+        return Status_FileOpenFailed;
+
+    if((job = MEMSTATS_ALLOC(MemGroup_Jobs, sizeof(preview_job_t))) == NULL) {
+        vfs_close(file);
+        return Status_FileOpenFailed;
+    }
+
+    memset(job, 0, sizeof(preview_job_t));
+    memcpy(job->hdr.magic, PREVIEW_MAGIC, sizeof(job->hdr.magic));
+    strcpy(job->filename, filename);
+    job->file = file;
+    job->hdr.src_size = st.st_size;
+    job->hdr.src_mtime = get_mtime(&st);
+    job->hdr.min[0] = job->hdr.min[1] = job->hdr.min[2] = 1e30f;
+    job->hdr.max[0] = job->hdr.max[1] = job->hdr.max[2] = -1e30f;
+    job->scale = 1.0f;
+    job->absolute = true;
+    job->stride = 1;
+
+    return Status_OK;
+}
+
+static status_code_t sd_cmd_preview (sys_state_t state, char *args)
+{
+    return args ? preview_start(args) : Status_Unhandled;
+}
+
+static inline const char *skip_root (const char *filename)
+{
+    return *filename == '/' ? filename + 1 : filename;
+}
+
+// Deletes sidecar, called when the source file is written, renamed or deleted.
+// Sidecars are ignored.
+void preview_invalidate (const char *filename)
+{
+    char sidecar[PREVIEW_PATHLEN + sizeof(PREVIEW_EXT)];
+    size_t len = strlen(filename);
+
+    if(len < PREVIEW_PATHLEN && !(len >= sizeof(PREVIEW_EXT) - 1 && !strcmp(filename + len - (sizeof(PREVIEW_EXT) - 1), PREVIEW_EXT))) {
+        if(job && !strcmp(skip_root(job->filename), skip_root(filename)))
+            preview_end(false);
+        get_sidecar_name(sidecar, filename);
+        vfs_unlink(sidecar);
+    }
+}
+
+void preview_init (void)
+{
+    PROGMEM static const sys_command_t preview_command_list[] = {
+        {"FP", sd_cmd_preview, {}, { .str = "$FP=<filename> - generate toolpath preview for file" } }
+    };
+
+    static sys_commands_t preview_commands = {
+        .n_commands = sizeof(preview_command_list) / sizeof(sys_command_t),
+        .commands = preview_command_list
+    };
+
+    system_register_commands(&preview_commands);
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = preview_process;
+}
+
+#endif // SDCARD_ENABLE && SDCARD_PREVIEW_ENABLE
@@ -0,0 +1,55 @@
+/*
+  preview.h - toolpath preview generator
+
+  Part of SDCard plugin for grblHAL
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#define PREVIEW_MAGIC "GPV1"
+#define PREVIEW_EXT ".pv"
+
+/*
+  Preview (.pv) file layout, all values little endian:
+
+  preview_header_t header;
+  preview_point_t point[header.n_points];
+
+  Point coordinates are quantized to 0 - 65535 within the bounding box given
+  by header.min and header.max, coordinates are in mm.
+*/
+
+typedef struct {
+    char magic[4];      // PREVIEW_MAGIC
+    uint32_t src_size;  // Size of the source file, used for invalidation.
+    uint32_t src_mtime; // Modification time of the source file, used for invalidation.
+    uint16_t n_points;
+    uint16_t flags;     // Reserved.
+    float min[3];
+    float max[3];
+} preview_header_t;
+
+typedef struct {
+    uint16_t x;
+    uint16_t y;
+    uint16_t z;
+    uint16_t flags;     // Bit 0 set if point is the end of a rapid (G0) motion.
+} preview_point_t;
+
+void preview_init (void);
+void preview_invalidate (const char *filename);
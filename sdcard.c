@@ -50,6 +50,20 @@
 #include "ymodem.h"
 #include "macros.h"
 #include "fs_fatfs.h"
+#include "preview.h"
+#include "jobcache.h"
+#include "fs_hash.h"
+#include "delta.h"
+#include "fs_journal.h"
+#include "sdlfs.h"
+#include "memstats.h"
+#include "jobevents.h"
+#include "onumber.h"
+#include "trace.h"
+#include "checkpoint.h"
+#include "bundle.h"
+#include "spans.h"
+#include "elide.h"
 
 #if defined(NEW_FATFS)
 static char dev[10] = "";
@@ -61,6 +75,12 @@ static char dev[10] = "";
 
 #define MAX_PATHLEN 128
 
+#if SDCARD_SEQUENTIAL_HINT_ENABLE
+#define JOB_FILE_MODE "rS" // Job files are read front to back, tell the disk driver.
+#else
+#define JOB_FILE_MODE "r"
+#endif
+
 char const *const filetypes[] = {
     "nc",
     "ncc",
@@ -71,6 +91,9 @@ char const *const filetypes[] = {
     "text",
     "tap",
     "macro",
+#if SDCARD_BUNDLE_ENABLE
+    "gjb",
+#endif
     ""
 };
 
@@ -91,6 +114,22 @@ typedef struct
     size_t pos;
     uint32_t line;
     uint8_t eol;
+#if SDCARD_TRACE_ENABLE
+    bool replay;
+#endif
+#if SDCARD_CHECKPOINT_ENABLE
+    char path[64];
+#endif
+#if SDCARD_DIRECT_READ_ENABLE
+    fs_fatfs_getc_ptr getc; // Direct bound FatFs reader, NULL if not on the FatFs mount.
+#endif
+#if SDCARD_ELIDE_ENABLE
+    bool elide;             // Read job lines via the modal word elision stage.
+#endif
+#if SDCARD_ENABLE == 2 && FF_FS_READONLY == 0
+    bool held;
+    ymodem_upload_t *upload;
+#endif
 } file_t;
 
 static file_t file = {
@@ -114,6 +153,10 @@ static stream_read_ptr read_redirected;
 static status_message_ptr status_message = NULL;
 
 static void sdcard_end_job (bool flush);
+static void terminate_job (void *data);
+#if SDCARD_ENABLE == 2 && FF_FS_READONLY == 0
+static void upload_on_commit (ymodem_upload_t *upload);
+#endif
 static void onRealtimeReport (stream_write_ptr stream_write, report_tracking_flags_t report);
 static void trap_state_change_request(uint_fast16_t state);
 static status_code_t trap_status_messages (status_code_t status_code);
@@ -130,15 +173,7 @@ static void sdcard_on_program_completed (program_flow_t program_flow, bool check
 
 DWORD fatfs_getFatTime (void)
 {
-
-    return    ((2007UL-1980) << 25)    // Year = 2007
-            | (6UL << 21)            // Month = June
-            | (5UL << 16)            // Day = 5
-            | (11U << 11)            // Hour = 11
-            | (38U << 5)            // Min = 38
-            | (0U >> 1)                // Sec = 0
-            ;
-
+    return fs_fatfs_get_fattime();
 }
 #endif
 
@@ -246,47 +281,157 @@ static void file_close (void)
     }
 }
 
+static void file_set_name (char *filename)
+{
+    char *leafname = strrchr(filename, '/');
+
+    strncpy(file.name, leafname ? leafname + 1 : filename, sizeof(file.name));
+    file.name[sizeof(file.name) - 1] = '\0';
+}
+
 static bool file_open (char *filename)
 {
     if(file.handle)
         file_close();
 
-    if((cncfile = vfs_open(filename, "r")) != NULL) {
-
-        vfs_stat_t st;
-
-        vfs_stat(filename, &st);
+    SPAN_BEGIN(Span_FileOpen);
 
+    if((cncfile = vfs_open(filename, JOB_FILE_MODE)) != NULL) {
         file.handle = cncfile;
-        file.size = st.st_size;
+        file.size = cncfile->size;
         file.pos = 0;
         file.line = 0;
         file.eol = false;
-        char *leafname = strrchr(filename, '/');
-        strncpy(file.name, leafname ? leafname + 1 : filename, sizeof(file.name));
-        file.name[sizeof(file.name) - 1] = '\0';
+#if SDCARD_TRACE_ENABLE
+        file.replay = false;
+#endif
+#if SDCARD_DIRECT_READ_ENABLE
+        file.getc = fs_fatfs_get_reader(cncfile);
+#endif
+#if SDCARD_ELIDE_ENABLE
+        file.elide = false;
+#endif
+        file_set_name(filename);
     }
 
+    SPAN_END(Span_FileOpen);
+
     return file.handle != NULL;
 }
 
-static int16_t file_read (void)
+// Opens the job, from a cached copy if available and falling back to the file itself if the copy cannot be opened.
+// For a job bundle the bundle is mounted and its main program opened.
+static bool job_open (char *fname)
+{
+#if SDCARD_BUNDLE_ENABLE
+    if((fname = bundle_open(fname)) == NULL)
+        return false;
+#endif
+#if SDCARD_JOBCACHE_ENABLE
+    char *cached = jobcache_lookup(fname);
+
+    if(cached && file_open(cached))
+        return true;
+#endif
+
+    return file_open(fname);
+}
+
+static int16_t file_getc (void)
 {
     signed char c[1];
 
+#if SDCARD_TRACE_ENABLE
+    if(file.replay) {
+        *c = (signed char)trace_replay_read(file.handle, enqueue_realtime_command);
+        file.pos = vfs_tell(file.handle);
+    } else
+#endif
+#if SDCARD_DIRECT_READ_ENABLE
+    if(file.getc) {
+        int16_t ch;
+        if((ch = file.getc(file.handle)) >= 0) {
+            *c = (signed char)ch;
+            file.pos++;
+        } else
+            *c = -1;
+    } else
+#endif
     if(vfs_read(&c, 1, 1, file.handle) == 1)
         file.pos = vfs_tell(file.handle);
     else
         *c = -1;
 
-    if(*c == '\r' || *c == '\n')
+    return (int16_t)*c;
+}
+
+static int16_t file_read (void)
+{
+    int16_t c;
+
+#if SDCARD_ELIDE_ENABLE
+    c = file.elide ? elide_read(file_getc) : file_getc();
+#else
+    c = file_getc();
+#endif
+
+    if(c == '\r' || c == '\n')
         file.eol++;
     else
         file.eol = 0;
 
-    return (int16_t)*c;
+    return c;
+}
+
+#if SDCARD_ENABLE == 2 && FF_FS_READONLY == 0
+
+static bool upload_run = false;
+
+// Reopen file to get access to data committed by the YModem receiver after it was opened.
+static bool file_reopen (void)
+{
+    vfs_close(file.handle);
+
+    if((file.handle = cncfile = vfs_open(file.upload->filename, "r")) != NULL) {
+        vfs_seek(file.handle, file.pos);
+        hal.stream.file = file.handle;
+#if SDCARD_DIRECT_READ_ENABLE
+        file.getc = fs_fatfs_get_reader(file.handle);
+#endif
+    }
+
+    return file.handle != NULL;
+}
+
+// Called on EOF when the file streamed is still being received.
+// Returns next character if more data has been committed, SERIAL_NO_DATA if waiting for data or -1 on EOF.
+static int16_t upload_read (void)
+{
+    int16_t c = -1;
+
+    if(file.pos < file.upload->committed) {
+        if(file_reopen() && (c = file_read()) != -1 && file.held) {
+            file.held = false;
+            if(state_get() == STATE_HOLD)
+                system_set_exec_state_flag(EXEC_CYCLE_START);
+        }
+    } else if(file.upload->active) {
+        c = SERIAL_NO_DATA;
+        if(!file.held && state_get() == STATE_CYCLE) {    // Reader caught up with writer,
+            file.held = true;                               // enter feed hold and wait for more data.
+            system_set_exec_state_flag(EXEC_FEED_HOLD);
+        }
+    } else if(!file.upload->completed) {
+        c = SERIAL_NO_DATA;
+        hal.stream.read = stream_get_null;
+        protocol_enqueue_foreground_task(terminate_job, "SD card job terminated due to failed upload");
+    }
+
+    return c;
 }
 
+#endif
+
 static bool sdcard_mount (void)
 {
     static FATFS *fs = NULL;
@@ -306,7 +451,7 @@ static bool sdcard_mount (void)
     } else {
 
         if(fs == NULL)
-            fs = malloc(sizeof(FATFS));
+            fs = MEMSTATS_ALLOC(MemGroup_FatFs, sizeof(FATFS));
 
 #ifdef NEW_FATFS
         if(fs && (f_mount(fs, dev, 1) == FR_OK))
@@ -324,8 +469,12 @@ static bool sdcard_mount (void)
         grbl.on_realtime_report = onRealtimeReport; // Add mount status changes and job percent complete to real time report
     }
 
-    if(file.fs != NULL)
+    if(file.fs != NULL) {
         fs_fatfs_mount("/");
+#if SDCARD_LFS_ENABLE
+        sdlfs_mount(file.fs);
+#endif
+    }
 
     return file.fs != NULL;
 }
@@ -339,6 +488,9 @@ static void sdcard_auto_mount (void *data)
 static bool sdcard_unmount (void)
 {
     if(file.fs) {
+#if SDCARD_LFS_ENABLE
+        sdlfs_unmount();
+#endif
         if(sdcard.on_unmount)
             mount_changed = sdcard.on_unmount(&file.fs);
 #ifdef NEW_FATFS
@@ -366,8 +518,18 @@ static status_code_t sdcard_ls (bool filtered)
 
 static void sdcard_end_job (bool flush)
 {
+    SPAN_BEGIN(Span_JobEnd);
+
+#if SDCARD_JOBEVENTS_ENABLE
+    jobevents_end(JobEnd_Aborted, Status_OK); // Does nothing if job end is already reported.
+#endif
+
     file_close();
 
+#if SDCARD_BUNDLE_ENABLE
+    bundle_job_end();
+#endif
+
     if(grbl.on_program_completed == sdcard_on_program_completed)
         grbl.on_program_completed = on_program_completed;
 
@@ -394,8 +556,18 @@ static void sdcard_end_job (bool flush)
 
     webui = frewind = false;
 
+#if SDCARD_ENABLE == 2 && FF_FS_READONLY == 0
+    if(file.upload && !file.upload->active)
+        ymodem_set_on_commit(NULL);
+    file.upload = NULL;
+    file.held = false;
+#endif
+
     if(grbl.on_stream_changed)
         grbl.on_stream_changed(hal.stream.type);
+
+    SPAN_END(Span_LineExecute);
+    SPAN_END(Span_JobEnd);
 }
 
 static int16_t sdcard_read (void)
@@ -403,6 +575,8 @@ static int16_t sdcard_read (void)
     int16_t c = SERIAL_NO_DATA;
     sys_state_t state = state_get();
 
+    SPAN_END(Span_LineExecute);
+
     if(file.eol == 1)
         file.line++;
 
@@ -411,6 +585,11 @@ static int16_t sdcard_read (void)
         if(state == STATE_IDLE || (state & (STATE_CYCLE|STATE_HOLD|STATE_CHECK_MODE|STATE_TOOL_CHANGE)))
             c = file_read();
 
+#if SDCARD_ENABLE == 2 && FF_FS_READONLY == 0
+        if(c == -1 && file.upload)
+            c = upload_read();
+#endif
+
         if(c == -1) { // EOF or error reading or grblHAL problem
             file_close();
             if(file.eol == 0) // Return newline if line was incorrectly terminated
@@ -422,6 +601,19 @@ static int16_t sdcard_read (void)
         grbl.report.feedback_message(Message_ProgramEnd);
     }
 
+#if SDCARD_TRACE_ENABLE
+    if(c != SERIAL_NO_DATA)
+        trace_read(c);
+#endif
+
+#if SDCARD_SPANS_ENABLE
+    if(c == '\r' || c == '\n') {
+        SPAN_END(Span_LineRead);
+        SPAN_BEGIN(Span_LineExecute);
+    } else if(c != SERIAL_NO_DATA)
+        SPAN_BEGIN(Span_LineRead);
+#endif
+
     return c;
 }
 
@@ -433,6 +625,10 @@ static int16_t await_cycle_start (void)
 // Drop input from current stream except realtime commands
 ISR_CODE static bool  ISR_FUNC(drop_input_stream)(char c)
 {
+#if SDCARD_TRACE_ENABLE
+    trace_realtime_cmd(c);
+#endif
+
     enqueue_realtime_command(c);
 
     return true;
@@ -442,8 +638,12 @@ static void trap_state_change_request (sys_state_t state)
 {
     if(state == STATE_CYCLE) {
 
-        if(hal.stream.read == await_cycle_start)
+        if(hal.stream.read == await_cycle_start) {
             hal.stream.read = read_redirected;
+#if SDCARD_JOBEVENTS_ENABLE
+            jobevents_start();
+#endif
+        }
 
         if(grbl.on_state_change== trap_state_change_request) {
             grbl.on_state_change = state_change_requested;
@@ -467,6 +667,9 @@ static status_code_t trap_status_messages (status_code_t status_code)
         sprintf(buf, "error:%d in SD file at line " UINT32FMT ASCII_EOL, (uint8_t)status_code, file.line);
         hal.stream.write(buf);
 
+#if SDCARD_JOBEVENTS_ENABLE
+        jobevents_end(JobEnd_Error, status_code);
+#endif
         sdcard_end_job(true);
         grbl.report.status_message(status_code);
     }
@@ -481,15 +684,31 @@ static void sdcard_restart_msg (void *data)
 
 static void sdcard_on_program_completed (program_flow_t program_flow, bool check_mode)
 {
+#if SDCARD_JOBCACHE_ENABLE
+    jobcache_job_completed(check_mode);
+#endif
+
+#if SDCARD_JOBEVENTS_ENABLE
+    jobevents_end(JobEnd_Completed, Status_OK);
+#endif
+
 #if WEBUI_ENABLE // TODO: somehow add run time check?
     frewind = false; // Not (yet?) supported.
 #else
     frewind = frewind || program_flow == ProgramFlow_CompletedM2; // || program_flow == ProgramFlow_CompletedM30;
 #endif
     if(frewind) {
+#if SDCARD_TRACE_ENABLE
+        if(file.replay)
+            trace_replay_start(file.handle);
+        else
+#endif
         vfs_seek(file.handle, 0);
         file.pos = file.line = 0;
         file.eol = false;
+#if SDCARD_ELIDE_ENABLE
+        elide_reset();
+#endif
         hal.stream.read = await_cycle_start;
         if(grbl.on_state_change != trap_state_change_request) {
             state_change_requested = grbl.on_state_change;
@@ -505,6 +724,10 @@ static void sdcard_on_program_completed (program_flow_t program_flow, bool check
 
 ISR_CODE static bool ISR_FUNC(await_toolchange_ack)(char c)
 {
+#if SDCARD_TRACE_ENABLE
+    trace_realtime_cmd(c);
+#endif
+
     if(c == CMD_TOOL_ACK) {
         hal.stream.read = active_stream.read;                           // Restore normal stream input for tool change (jog etc)
         active_stream.set_enqueue_rt_handler(enqueue_realtime_command); // ...
@@ -544,17 +767,21 @@ static void terminate_job (void *data)
 
     sdcard_end_job(false);
 
-    report_message("SD card job terminated due to connection change", Message_Info);
+    report_message((char *)data, Message_Info);
 }
 
 static bool check_input_stream (char c)
 {
     bool ok;
 
+#if SDCARD_TRACE_ENABLE
+    trace_realtime_cmd(c);
+#endif
+
     if(!(ok = enqueue_realtime_command(c))) {
         if(hal.stream.read != stream_get_null) {
             hal.stream.read = stream_get_null;
-            protocol_enqueue_foreground_task(terminate_job, NULL);
+            protocol_enqueue_foreground_task(terminate_job, "SD card job terminated due to connection change");
         }
     }
 
@@ -582,14 +809,14 @@ static void stream_changed (stream_type_t type)
             else                                                                                    // else
                 enqueue_realtime_command = hal.stream.set_enqueue_rt_handler(check_input_stream);   // check for stream takeover
         } else // Terminate job.
-            protocol_enqueue_foreground_task(terminate_job, NULL);
+            protocol_enqueue_foreground_task(terminate_job, "SD card job terminated due to connection change");
     }
 
     if(on_stream_changed)
         on_stream_changed(type);
 }
 
-status_code_t stream_file (sys_state_t state, char *fname)
+static status_code_t stream_start (sys_state_t state, char *fname, bool confirm)
 {
     status_code_t retval = Status_Unhandled;
 
@@ -597,10 +824,27 @@ status_code_t stream_file (sys_state_t state, char *fname)
         retval = Status_SDNotMounted;
     else if(!(state == STATE_IDLE || state == STATE_CHECK_MODE))
         retval = Status_SystemGClock;
-    else if(fname && file_open(fname)) {
+    else if(fname && job_open(fname)) {
+
+        file_set_name(fname);
+#if SDCARD_CHECKPOINT_ENABLE
+        // The name as given, the file opened may be a job cache copy or a bundle member.
+        strncpy(file.path, fname, sizeof(file.path) - 1);
+        file.path[sizeof(file.path) - 1] = '\0';
+#endif
+
+#if SDCARD_ENABLE == 2 && FF_FS_READONLY == 0
+        if((file.upload = ymodem_get_upload(fname)) && file.upload->active) {  // File is still being received?
+            ymodem_set_on_commit(upload_on_commit);                             // Yes, follow the receiver
+            if(file.upload->length)                                             // and use expected length
+                file.size = file.upload->length;                                // for progress reporting.
+        } else
+            file.upload = NULL;
+#endif
 
         gc_state.last_error = Status_OK;            // Start with no errors
-        grbl.report.status_message(Status_OK);      // and confirm command to originator.
+        if(confirm)                                 // and confirm command to originator.
+            grbl.report.status_message(Status_OK);  // ...
         webui = hal.stream.state.webui_connected;   // Did WebUI start this job?
 
         if(!(grbl.on_file_open && (retval = grbl.on_file_open(fname, file.handle, true)) == Status_OK)) {
@@ -631,6 +875,19 @@ status_code_t stream_file (sys_state_t state, char *fname)
                 grbl.on_stream_changed = stream_changed;
             }
 
+#if SDCARD_ELIDE_ENABLE
+            elide_start();
+  #if SDCARD_ENABLE == 2 && FF_FS_READONLY == 0
+            file.elide = file.upload == NULL; // Lines may be split by the YModem receiver.
+  #else
+            file.elide = true;
+  #endif
+#endif
+
+#if SDCARD_JOBEVENTS_ENABLE
+            jobevents_start();
+#endif
+
             retval = Status_OK;
         } else
             file.handle = NULL;
@@ -640,14 +897,105 @@ status_code_t stream_file (sys_state_t state, char *fname)
     return retval;
 }
 
+status_code_t stream_file (sys_state_t state, char *fname)
+{
+    return stream_start(state, fname, true);
+}
+
+#if SDCARD_CHECKPOINT_ENABLE
+
+// Returns path of file being streamed, NULL if none.
+char *sdcard_get_job_path (void)
+{
+    return stream_is_file() && file.handle ? file.path : NULL;
+}
+
+// Starts streaming file from offset, line is the line number at offset.
+status_code_t sdcard_resume_job (sys_state_t state, char *fname, size_t offset, uint32_t line)
+{
+    vfs_stat_t st;
+    status_code_t retval;
+
+    if(vfs_stat(fname, &st) != 0 || offset > st.st_size)
+        return Status_FileOpenFailed;
+
+    if((retval = stream_start(state, fname, true)) == Status_OK && file.handle) {
+        vfs_seek(file.handle, offset);
+        file.pos = offset;
+        file.line = line;
+    }
+
+    return retval;
+}
+
+// Terminates the streamed job on an error not reported by the parser.
+void sdcard_abort_job (status_code_t status)
+{
+    if(hal.stream.read == read_redirected) {
+#if SDCARD_JOBEVENTS_ENABLE
+        jobevents_end(JobEnd_Error, status);
+#endif
+        sdcard_end_job(true);
+    }
+}
+
+#endif
+
+#if SDCARD_ENABLE == 2 && FF_FS_READONLY == 0
+
+static void upload_start_job (void *data)
+{
+    status_code_t status;
+
+    if((status = stream_start(state_get(), ((ymodem_upload_t *)data)->filename, false)) != Status_OK) {
+        char buf[40];
+        sprintf(buf, "SD card upload run failed: %d", (uint8_t)status);
+        report_message(buf, Message_Warning);
+    }
+}
+
+// Called by the YModem receiver on transfer start and end and when data has been committed.
+static void upload_on_commit (ymodem_upload_t *upload)
+{
+    if(file.upload == upload) {
+        if(!upload->active && active_stream.type != StreamType_Null) // Transfer ended, the receiver has restored the real time handler
+            enqueue_realtime_command = hal.stream.set_enqueue_rt_handler(hal.stream.read == stream_get_null ? await_toolchange_ack : drop_input_stream); // so chain in ours again.
+    } else {
+        if(upload_run && (upload->committed || !upload->active)) {
+            upload_run = false;
+            if(upload->active || upload->completed)
+                protocol_enqueue_foreground_task(upload_start_job, upload);
+        }
+        if(!upload->active && !upload_run)
+            ymodem_set_on_commit(NULL);
+    }
+}
+
+static status_code_t sd_cmd_upload_run (sys_state_t state, char *args)
+{
+    if(!file.fs)
+        return Status_SDNotMounted;
+
+    upload_run = true;
+    ymodem_set_on_commit(upload_on_commit);
+
+    return Status_OK;
+}
+
+#endif
+
 static status_code_t sd_cmd_file_filtered (sys_state_t state, char *args)
 {
     status_code_t retval = Status_Unhandled;
 
-    if(args)
+    if(args) {
+#if SDCARD_ONUMBER_ENABLE
+        char *path;
+        if((path = onumber_resolve(args)))  // Program number, e.g. O1234?
+            args = path;                    // Yes, run file with it in header
+#endif
         retval = stream_file(state, args);
-
-    else {
+    } else {
         frewind = false;
         retval = sdcard_ls(true); // (re)use line buffer for reporting filenames
     }
@@ -670,6 +1018,42 @@ static status_code_t sd_cmd_file_all (sys_state_t state, char *args)
     return retval;
 }
 
+#if SDCARD_TRACE_ENABLE
+
+// $FCP=<filename> - replay captured session as a file stream.
+static status_code_t sd_cmd_trace_replay (sys_state_t state, char *args)
+{
+    bool ok;
+    vfs_file_t *trc;
+    status_code_t retval;
+
+    if(args == NULL)
+        return Status_InvalidStatement;
+
+    if(!file.fs)
+        return Status_SDNotMounted;
+
+    if((trc = vfs_open(args, "r")) == NULL)
+        return Status_FileOpenFailed;
+
+    ok = trace_replay_start(trc);
+    vfs_close(trc);
+
+    if(!ok)
+        return Status_FileOpenFailed;
+
+    if((retval = stream_file(state, args)) == Status_OK && file.handle) {
+        file.replay = trace_replay_start(file.handle);
+#if SDCARD_ELIDE_ENABLE
+        file.elide = !file.replay;
+#endif
+    }
+
+    return retval;
+}
+
+#endif
+
 static status_code_t sd_cmd_mount (sys_state_t state, char *args)
 {
     frewind = false;
@@ -734,6 +1118,70 @@ static status_code_t sd_cmd_to_output (sys_state_t state, char *args)
     return retval;
 }
 
+#if SDCARD_JOURNAL_ENABLE
+
+// Lists changes since the token from the previous call, or all files if the token is
+// missing, from before the last card mount or the journal has wrapped.
+static status_code_t sd_cmd_journal (sys_state_t state, char *args)
+{
+    status_code_t retval = Status_OK;
+
+    if(!file.fs)
+        retval = Status_SDNotMounted;
+    else if(!fs_journal_report(args)) {
+        hal.stream.write("[JOURNAL:FULL]" ASCII_EOL);
+        if((retval = sdcard_ls(false)) == Status_OK)
+            fs_journal_report_token();
+    }
+
+    return retval;
+}
+
+#endif // SDCARD_JOURNAL_ENABLE
+
+#if SDCARD_SYNC_ENABLE
+
+// Compares a manifest entry, <path>|<size>|<crc32>, with the file on the card.
+// Reports the entry as NEW or CHANGED if it has to be uploaded, nothing if not.
+static status_code_t sd_cmd_sync (sys_state_t state, char *args)
+{
+    char *size, *crc;
+    uint32_t hash;
+    vfs_stat_t st;
+    const char *result = NULL;
+
+    if(!file.fs)
+        return Status_SDNotMounted;
+
+    if(!(state == STATE_IDLE || state == STATE_CHECK_MODE))
+        return Status_SystemGClock;
+
+    if(args == NULL || (crc = strrchr(args, '|')) == NULL)
+        return Status_InvalidStatement;
+
+    *crc++ = '\0';
+
+    if((size = strrchr(args, '|')) == NULL)
+        return Status_InvalidStatement;
+
+    *size++ = '\0';
+
+    if(vfs_stat(args, &st) != 0)
+        result = "NEW";
+    else if(st.st_size != strtoul(size, NULL, 10) || !fs_file_crc32(args, &hash) || hash != strtoul(crc, NULL, 16))
+        result = "CHANGED";
+
+    if(result) {
+        char buf[MAX_PATHLEN + 20];
+        if((size_t)snprintf(buf, sizeof(buf), "[SYNC:%s|%s]" ASCII_EOL, args, result) < sizeof(buf))
+            hal.stream.write(buf);
+    }
+
+    return Status_OK;
+}
+
+#endif // SDCARD_SYNC_ENABLE
+
 #if FF_FS_READONLY == 0 && FF_FS_MINIMIZE == 0
 
 static status_code_t sd_cmd_unlink (sys_state_t state, char *args)
@@ -774,6 +1222,12 @@ ISR_CODE void ISR_FUNC(sdcard_detect)(bool mount)
 
 static void onRealtimeReport (stream_write_ptr stream_write, report_tracking_flags_t report)
 {
+    SPAN_BEGIN(Span_Report);
+
+#if SDCARD_TRACE_ENABLE
+    trace_realtime_report();
+#endif
+
     if(hal.stream.read == read_redirected) {
 
         char *pct_done = ftoa((float)file.pos / (float)file.size * 100.0f, 1);
@@ -795,6 +1249,8 @@ static void onRealtimeReport (stream_write_ptr stream_write, report_tracking_fla
 
     if(on_realtime_report)
         on_realtime_report(stream_write, report);
+
+    SPAN_END(Span_Report);
 }
 
 static void sd_detect_pin (xbar_t *pin, void *data)
@@ -813,8 +1269,12 @@ static void onReportOptions (bool newopt)
 #else
         hal.stream.write(",SD");
 #endif
-    else
+    else {
         report_plugin("SDCARD", "1.21");
+#if SDCARD_MEMSTATS_ENABLE
+        memstats_report();
+#endif
+    }
 }
 
 sdcard_events_t *sdcard_init (void)
@@ -832,6 +1292,18 @@ sdcard_events_t *sdcard_init (void)
         {"FD", sd_cmd_unlink, {}, { .str = "$FD=<filename> - delete SD card file" } },
     #endif
         {"F<", sd_cmd_to_output, {}, { .str = "$F<=<filename> - dump SD card file to output" } },
+    #if SDCARD_JOURNAL_ENABLE
+        {"FJ", sd_cmd_journal, {}, { .str = "$FJ[=<token>] - list file changes since token" } },
+    #endif
+    #if SDCARD_SYNC_ENABLE
+        {"FS", sd_cmd_sync, {}, { .str = "$FS=<filename>|<size>|<crc32> - check file against manifest entry" } },
+    #endif
+    #if SDCARD_TRACE_ENABLE
+        {"FCP", sd_cmd_trace_replay, {}, { .str = "$FCP=<filename> - replay captured file stream session" } },
+    #endif
+    #if SDCARD_ENABLE == 2 && FF_FS_READONLY == 0
+        {"FY", sd_cmd_upload_run, { .noargs = On }, { .str = "run next file uploaded by YModem while it is being received" } },
+    #endif
     };
 
     static sys_commands_t sdcard_commands = {
@@ -874,6 +1346,46 @@ sdcard_events_t *sdcard_init (void)
 
     fs_macros_init();
 
+#if SDCARD_PREVIEW_ENABLE
+    preview_init();
+#endif
+
+#if SDCARD_JOBCACHE_ENABLE
+    jobcache_init();
+#endif
+
+#if SDCARD_DELTA_ENABLE && FF_FS_READONLY == 0
+    delta_init();
+#endif
+
+#if SDCARD_JOBEVENTS_ENABLE
+    jobevents_init();
+#endif
+
+#if SDCARD_ONUMBER_ENABLE
+    onumber_init();
+#endif
+
+#if SDCARD_TRACE_ENABLE
+    trace_init();
+#endif
+
+#if SDCARD_CHECKPOINT_ENABLE
+    checkpoint_init();
+#endif
+
+#if SDCARD_BUNDLE_ENABLE
+    bundle_init();
+#endif
+
+#if SDCARD_SPANS_ENABLE
+    spans_init();
+#endif
+
+#if SDCARD_ELIDE_ENABLE
+    elide_init();
+#endif
+
     if(settings.fs_options.sd_mount_on_boot)
         protocol_enqueue_foreground_task(sdcard_auto_mount, NULL);
 
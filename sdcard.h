@@ -34,6 +34,117 @@
 
 #if SDCARD_ENABLE
 
+#ifndef SDCARD_PREVIEW_ENABLE
+#define SDCARD_PREVIEW_ENABLE 0
+#endif
+
+#ifndef SDCARD_SYNC_ENABLE
+#define SDCARD_SYNC_ENABLE 0
+#endif
+
+#ifndef SDCARD_DELTA_ENABLE
+#define SDCARD_DELTA_ENABLE 0
+#endif
+
+#ifndef SDCARD_JOURNAL_ENABLE
+#define SDCARD_JOURNAL_ENABLE 0
+#endif
+
+#ifndef SDCARD_DEFERRED_DELETE_ENABLE
+#define SDCARD_DEFERRED_DELETE_ENABLE 0
+#endif
+
+#ifndef SDCARD_VFS_PROFILE_ENABLE
+#define SDCARD_VFS_PROFILE_ENABLE 0
+#endif
+
+#ifndef SDCARD_MEMSTATS_ENABLE
+#define SDCARD_MEMSTATS_ENABLE 0
+#endif
+
+#ifndef SDCARD_ONUMBER_ENABLE
+#define SDCARD_ONUMBER_ENABLE 0
+#endif
+
+#ifndef SDCARD_JOBEVENTS_ENABLE
+#define SDCARD_JOBEVENTS_ENABLE 0
+#endif
+#ifndef SDCARD_JOBEVENTS_STEP
+#define SDCARD_JOBEVENTS_STEP 0 // Progress step in percent at boot, 0 to disable events until enabled by $FE.
+#endif
+
+#ifndef SDCARD_HANDLE_CACHE_ENABLE
+#define SDCARD_HANDLE_CACHE_ENABLE 0
+#endif
+
+#ifndef SDCARD_FATTIME_GEN_ENABLE
+#define SDCARD_FATTIME_GEN_ENABLE 0
+#endif
+
+#ifndef SDCARD_TRACE_ENABLE
+#define SDCARD_TRACE_ENABLE 0
+#endif
+
+#ifndef SDCARD_META_ENABLE
+#define SDCARD_META_ENABLE 0
+#endif
+
+#ifndef SDCARD_CHECKPOINT_ENABLE
+#define SDCARD_CHECKPOINT_ENABLE 0
+#endif
+
+#ifndef SDCARD_BUNDLE_ENABLE
+#define SDCARD_BUNDLE_ENABLE 0
+#endif
+
+#ifndef SDCARD_SEQUENTIAL_HINT_ENABLE
+#define SDCARD_SEQUENTIAL_HINT_ENABLE 0
+#endif
+
+#ifndef SDCARD_DIRECT_READ_ENABLE
+#define SDCARD_DIRECT_READ_ENABLE 0
+#endif
+
+#ifndef SDCARD_SPANS_ENABLE
+#define SDCARD_SPANS_ENABLE 0
+#endif
+
+#ifndef SDCARD_ELIDE_ENABLE
+#define SDCARD_ELIDE_ENABLE 0
+#endif
+
+#if !LITTLEFS_ENABLE
+#undef SDCARD_JOBCACHE_ENABLE
+#endif
+#ifndef SDCARD_JOBCACHE_ENABLE
+#define SDCARD_JOBCACHE_ENABLE 0
+#endif
+
+#if !LITTLEFS_ENABLE || defined(ESP_PLATFORM)
+#undef SDCARD_LFS_ENABLE
+#endif
+#ifndef SDCARD_LFS_ENABLE
+#define SDCARD_LFS_ENABLE 0
+#endif
+
+#if SDCARD_LFS_ENABLE
+#ifndef SDCARD_LFS_PATH
+#define SDCARD_LFS_PATH "/sdlfs"
+#endif
+#ifndef SDCARD_LFS_IMAGE
+#define SDCARD_LFS_IMAGE "/littlefs.img"
+#endif
+#ifndef SDCARD_LFS_SIZE
+#define SDCARD_LFS_SIZE (4UL * 1024UL * 1024UL)
+#endif
+#ifndef SDCARD_LFS_BLOCK_SIZE
+#define SDCARD_LFS_BLOCK_SIZE 4096
+#endif
+#ifndef SDCARD_LFS_START_SECTOR
+#define SDCARD_LFS_START_SECTOR 0 // Set to use a reserved region outside the FAT file system instead of an image file.
+#endif
+#endif
+
 #if defined(ESP_PLATFORM)
 #include "esp_vfs_fat.h"
 #elif defined(__LPC176x__) || defined(__MSP432E401Y__)
@@ -72,6 +183,11 @@ FATFS *sdcard_getfs (void);
 sdcard_job_t *sdcard_get_job_info (void);
 void sdcard_detect (bool mount);
 status_code_t stream_file (sys_state_t state, char *fname);
+#if SDCARD_CHECKPOINT_ENABLE
+char *sdcard_get_job_path (void);
+status_code_t sdcard_resume_job (sys_state_t state, char *fname, size_t offset, uint32_t line);
+void sdcard_abort_job (status_code_t status);
+#endif
 
 #endif // SDCARD_ENABLE
 
@@ -0,0 +1,200 @@
+/*
+  sdlfs.c - littlefs file system in a reserved region of the SD card
+
+  Part of SDCard plugin for grblHAL
+
+  Mounts littlefs on a block device backed by the sector I/O of the SD card for
+  power safe, copy-on-write appends with bounded latency, e.g. for logging.
+  The region is either a contiguous, read only image file allocated in the FAT
+  file system or a range of sectors reserved outside of it.
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sdcard.h"
+
+#if SDCARD_ENABLE && SDCARD_LFS_ENABLE
+
+#include <string.h>
+
+#include "../littlefs/lfs.h"
+
+#include "fs_littlefs.h"
+#include "sdlfs.h"
+
+// The image file is only protected from being deleted or truncated, freeing clusters littlefs
+// still writes to, by its read only attribute. Without f_chmod() it cannot be set.
+#if !SDCARD_LFS_START_SECTOR && (!FF_USE_CHMOD || FF_FS_READONLY)
+#error "SD card littlefs image requires FF_USE_CHMOD enabled in ffconf.h, or set SDCARD_LFS_START_SECTOR to use a reserved region."
+#endif
+
+#if FF_MAX_SS == FF_MIN_SS
+#define SECTOR_SIZE(fs) FF_MAX_SS
+#else
+#define SECTOR_SIZE(fs) ((fs)->ssize)
+#endif
+
+#if FF_LBA64
+typedef QWORD sdlfs_lba_t;
+#else
+typedef DWORD sdlfs_lba_t;
+#endif
+
+static struct {
+    BYTE pdrv;
+    bool mounted;
+    sdlfs_lba_t start;
+    uint32_t sectors_per_block;
+    uint32_t sector_size;
+    struct lfs_config config;
+    uint32_t read_buffer[FF_MAX_SS / sizeof(uint32_t)];
+    uint32_t prog_buffer[FF_MAX_SS / sizeof(uint32_t)];
+    uint32_t lookahead_buffer[4];
+} sdlfs = {0};
+
+static inline sdlfs_lba_t block_sector (lfs_block_t block, lfs_off_t off)
+{
+    return sdlfs.start + (sdlfs_lba_t)block * sdlfs.sectors_per_block + off / sdlfs.sector_size;
+}
+
+static int sdlfs_read (const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
+{
+    return disk_read(sdlfs.pdrv, (BYTE *)buffer, block_sector(block, off), size / sdlfs.sector_size) == RES_OK ? LFS_ERR_OK : LFS_ERR_IO;
+}
+
+static int sdlfs_prog (const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
+{
+    return disk_write(sdlfs.pdrv, (const BYTE *)buffer, block_sector(block, off), size / sdlfs.sector_size) == RES_OK ? LFS_ERR_OK : LFS_ERR_IO;
+}
+
+// The card erases internally on write, nothing to do.
+static int sdlfs_erase (const struct lfs_config *c, lfs_block_t block)
+{
+    return LFS_ERR_OK;
+}
+
+static int sdlfs_sync (const struct lfs_config *c)
+{
+    return disk_ioctl(sdlfs.pdrv, CTRL_SYNC, NULL) == RES_OK ? LFS_ERR_OK : LFS_ERR_IO;
+}
+
+#if SDCARD_LFS_START_SECTOR
+
+static uint32_t sdlfs_locate (FATFS *fs)
+{
+    sdlfs.start = SDCARD_LFS_START_SECTOR;
+
+    return SDCARD_LFS_SIZE;
+}
+
+#else
+
+// Returns the size of the image file and sets the start sector, 0 if the file
+// does not exist and cannot be created, is not contiguous or cannot be protected.
+// Without FF_USE_EXPAND the image has to be created on a computer.
+static uint32_t sdlfs_locate (FATFS *fs)
+{
+    FIL fil;
+    FRESULT res;
+    FSIZE_t ofs, size = 0;
+    DWORD bcs = (DWORD)fs->csize * SECTOR_SIZE(fs);
+
+#if FF_USE_EXPAND
+    if((res = f_open(&fil, SDCARD_LFS_IMAGE, FA_READ)) == FR_NO_FILE &&
+         (res = f_open(&fil, SDCARD_LFS_IMAGE, FA_CREATE_NEW|FA_WRITE)) == FR_OK) {
+        res = f_expand(&fil, SDCARD_LFS_SIZE, 1); // Allocate contiguous clusters
+        f_close(&fil);
+        if(res == FR_OK)
+            res = f_open(&fil, SDCARD_LFS_IMAGE, FA_READ);
+        else
+            f_unlink(SDCARD_LFS_IMAGE);
+    }
+#else
+    res = f_open(&fil, SDCARD_LFS_IMAGE, FA_READ);
+#endif
+
+    if(res == FR_OK) {
+
+        f_close(&fil);
+
+        // Protect from being deleted or truncated, also when the image was created on a computer.
+        if((res = f_chmod(SDCARD_LFS_IMAGE, AM_RDO|AM_HID|AM_SYS, AM_RDO|AM_HID|AM_SYS)) == FR_OK)
+            res = f_open(&fil, SDCARD_LFS_IMAGE, FA_READ);
+    }
+
+    if(res == FR_OK) {
+
+        size = f_size(&fil);
+
+        // Seeking to a cluster boundary leaves the current cluster at the one holding the preceding byte.
+        for(ofs = bcs; size && ofs <= size; ofs += bcs) {
+            if(f_lseek(&fil, ofs) != FR_OK || fil.clust != fil.obj.sclust + ofs / bcs - 1)
+                size = 0;
+        }
+
+        if(size)
+            sdlfs.start = fs->database + (sdlfs_lba_t)fs->csize * (fil.obj.sclust - 2);
+
+        f_close(&fil);
+    }
+
+    return (uint32_t)size;
+}
+
+#endif // SDCARD_LFS_START_SECTOR
+
+void sdlfs_mount (FATFS *fs)
+{
+    uint32_t size;
+
+    if(sdlfs.mounted || (sdlfs.sector_size = SECTOR_SIZE(fs)) > FF_MAX_SS || SDCARD_LFS_BLOCK_SIZE % sdlfs.sector_size)
+        return;
+
+    if((size = sdlfs_locate(fs)) < SDCARD_LFS_BLOCK_SIZE * 2) {
+        report_message("SD card littlefs region not available", Message_Warning);
+        return;
+    }
+
+    sdlfs.pdrv = fs->pdrv;
+    sdlfs.sectors_per_block = SDCARD_LFS_BLOCK_SIZE / sdlfs.sector_size;
+
+    memset(&sdlfs.config, 0, sizeof(struct lfs_config));
+    sdlfs.config.read = sdlfs_read;
+    sdlfs.config.prog = sdlfs_prog;
+    sdlfs.config.erase = sdlfs_erase;
+    sdlfs.config.sync = sdlfs_sync;
+    sdlfs.config.read_size = sdlfs.config.prog_size = sdlfs.config.cache_size = sdlfs.sector_size;
+    sdlfs.config.block_size = SDCARD_LFS_BLOCK_SIZE;
+    sdlfs.config.block_count = size / SDCARD_LFS_BLOCK_SIZE;
+    sdlfs.config.block_cycles = -1; // The card does its own wear leveling
+    sdlfs.config.lookahead_size = sizeof(sdlfs.lookahead_buffer);
+    sdlfs.config.read_buffer = sdlfs.read_buffer;
+    sdlfs.config.prog_buffer = sdlfs.prog_buffer;
+    sdlfs.config.lookahead_buffer = sdlfs.lookahead_buffer;
+
+    sdlfs.mounted = fs_littlefs_mount(SDCARD_LFS_PATH, &sdlfs.config);
+}
+
+// To be called before the FAT file system is unmounted.
+void sdlfs_unmount (void)
+{
+    if(sdlfs.mounted) {
+        fs_littlefs_unmount(SDCARD_LFS_PATH);
+        sdlfs.mounted = false;
+    }
+}
+
+#endif // SDCARD_ENABLE && SDCARD_LFS_ENABLE
@@ -0,0 +1,243 @@
+/*
+  spans.c - timeline instrumentation
+
+  Part of SDCard plugin for grblHAL
+
+  Records the start time and duration of card reads, job line execution, real
+  time reports, macro runs and YModem packet handling and writes them to a file
+  in the Chrome trace event format, the file can be loaded into the Perfetto UI
+  or chrome://tracing to show how the activities interleave on a timeline.
+
+  Instrumentation points are placed with the SPAN_BEGIN() and SPAN_END() macros
+  that compile to nothing unless SDCARD_SPANS_ENABLE is set. A host build can
+  provide its own spans_begin() and spans_end() for the same points.
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sdcard.h"
+
+#if SDCARD_ENABLE && SDCARD_SPANS_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef ARDUINO
+#include "../grbl/state_machine.h"
+#include "../grbl/vfs.h"
+#else
+#include "grbl/state_machine.h"
+#include "grbl/vfs.h"
+#endif
+
+#include "spans.h"
+#include "memstats.h"
+
+#ifndef SPANS_BUFFER_SIZE
+#define SPANS_BUFFER_SIZE 128   // Records, must be a power of 2.
+#endif
+#define SPANS_PATHLEN 64
+#define SPANS_WRITE_CHUNK 384
+
+typedef struct {
+    uint32_t ts;
+    uint32_t dur;
+    uint8_t id;
+} span_record_t;
+
+typedef struct {
+    vfs_file_t *file;
+    bool ms;                // Timestamps are in ms.
+    uint32_t start;
+    uint32_t events;
+    uint32_t dropped;
+    uint32_t active;        // Bitmap of spans begun, by span_id_t.
+    uint32_t begin[Span_N];
+    uint_fast16_t head;
+    uint_fast16_t tail;
+    char filename[SPANS_PATHLEN];
+    span_record_t buf[SPANS_BUFFER_SIZE];
+} spans_t;
+
+// Names and timeline rows, thread ids in the trace, of spans by span_id_t.
+static const struct {
+    const char *name;
+    uint8_t tid;
+} span_info[Span_N] = {
+    { "file open", 1 },
+    { "line read", 1 },
+    { "line execute", 2 },
+    { "job end", 1 },
+    { "report", 3 },
+    { "macro open", 4 },
+    { "macro", 4 },
+    { "ymodem packet", 5 },
+    { "ymodem write", 5 },
+    { "ymodem commit", 5 },
+    { "span flush", 6 }
+};
+
+static spans_t *spans = NULL;
+static on_execute_realtime_ptr on_execute_realtime;
+
+static inline uint32_t spans_time (void)
+{
+    return (hal.get_micros ? hal.get_micros() : hal.get_elapsed_ticks()) - spans->start;
+}
+
+static void spans_add (span_id_t id, uint32_t ts, uint32_t dur)
+{
+    uint_fast16_t next = (spans->head + 1) & (SPANS_BUFFER_SIZE - 1);
+
+    if(next == spans->tail)
+        spans->dropped++;
+    else {
+        spans->buf[spans->head].ts = ts;
+        spans->buf[spans->head].dur = dur;
+        spans->buf[spans->head].id = (uint8_t)id;
+        spans->head = next;
+    }
+}
+
+// Begins span, does nothing if already begun.
+void spans_begin (span_id_t id)
+{
+    if(spans && !(spans->active & (1UL << id))) {
+        spans->active |= (1UL << id);
+        spans->begin[id] = spans_time();
+    }
+}
+
+// Ends span and records it, does nothing if not begun.
+void spans_end (span_id_t id)
+{
+    if(spans && (spans->active & (1UL << id))) {
+        spans->active &= ~(1UL << id);
+        spans_add(id, spans->begin[id], spans_time() - spans->begin[id]);
+    }
+}
+
+// Writes buffered spans as trace events. Stops writing on error.
+static void spans_flush (void)
+{
+    size_t len = 0;
+    uint32_t ts = spans_time();
+    span_record_t *rec;
+    char out[SPANS_WRITE_CHUNK];
+
+    while(spans->tail != spans->head) {
+
+        rec = &spans->buf[spans->tail];
+        spans->tail = (spans->tail + 1) & (SPANS_BUFFER_SIZE - 1);
+
+        // Trace event timestamps are in us.
+        len += sprintf(out + len, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lu%s,\"dur\":%lu%s,\"pid\":1,\"tid\":%d}", spans->events++ ? "," ASCII_EOL : "",
+                        span_info[rec->id].name, (unsigned long)rec->ts, spans->ms ? "000" : "", (unsigned long)rec->dur, spans->ms ? "000" : "", span_info[rec->id].tid);
+
+        if(len > SPANS_WRITE_CHUNK - 128 || spans->tail == spans->head) {
+            if(vfs_write(out, 1, len, spans->file) != len) {
+                spans->dropped += (spans->head - spans->tail) & (SPANS_BUFFER_SIZE - 1);
+                spans->tail = spans->head;
+            }
+            len = 0;
+        }
+    }
+
+    spans_add(Span_Flush, ts, spans_time() - ts);
+}
+
+static void spans_stop (void)
+{
+    char buf[SPANS_PATHLEN + 30];
+    spans_t *s = spans;
+
+    spans_flush();
+    spans->tail = spans->head; // Drop flush span.
+    spans = NULL;
+
+    vfs_puts(ASCII_EOL "]" ASCII_EOL, s->file);
+    vfs_close(s->file);
+
+    sprintf(buf, "[SPANS:%s|%lu|%lu]" ASCII_EOL, s->filename, (unsigned long)s->events, (unsigned long)s->dropped);
+    hal.stream.write(buf);
+
+    MEMSTATS_FREE(MemGroup_Jobs, s);
+}
+
+// Flushes span buffer when half full or when idle.
+static void spans_process (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    if(spans) {
+
+        uint_fast16_t pending = (spans->head - spans->tail) & (SPANS_BUFFER_SIZE - 1);
+
+        if(pending >= SPANS_BUFFER_SIZE / 2 || (state == STATE_IDLE && pending > 1))
+            spans_flush();
+    }
+}
+
+// $FX[=<filename>] - start recording spans to file, stop if no filename is given.
+static status_code_t sd_cmd_spans (sys_state_t state, char *args)
+{
+    if(args == NULL) {
+        if(spans)
+            spans_stop();
+        return Status_OK;
+    }
+
+    if(spans)
+        return Status_IdleError;
+
+    if(strlen(args) >= SPANS_PATHLEN || (spans = MEMSTATS_ALLOC(MemGroup_Jobs, sizeof(spans_t))) == NULL)
+        return Status_FileOpenFailed;
+
+    memset(spans, 0, sizeof(spans_t));
+
+    if((spans->file = vfs_open(args, "w")) == NULL || vfs_puts("[" ASCII_EOL, spans->file) == 0) {
+        if(spans->file)
+            vfs_close(spans->file);
+        MEMSTATS_FREE(MemGroup_Jobs, spans);
+        spans = NULL;
+        return Status_FileOpenFailed;
+    }
+
+    strcpy(spans->filename, args);
+    spans->ms = hal.get_micros == NULL;
+    spans->start = hal.get_micros ? hal.get_micros() : hal.get_elapsed_ticks();
+
+    return Status_OK;
+}
+
+void spans_init (void)
+{
+    PROGMEM static const sys_command_t spans_command_list[] = {
+        {"FX", sd_cmd_spans, {}, { .str = "$FX[=<filename>] - start recording timeline to file, stop if no filename" } }
+    };
+
+    static sys_commands_t spans_commands = {
+        .n_commands = sizeof(spans_command_list) / sizeof(sys_command_t),
+        .commands = spans_command_list
+    };
+
+    system_register_commands(&spans_commands);
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = spans_process;
+}
+
+#endif // SDCARD_ENABLE && SDCARD_SPANS_ENABLE
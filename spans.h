@@ -0,0 +1,53 @@
+/*
+  spans.h - timeline instrumentation
+
+  Part of SDCard plugin for grblHAL
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+typedef enum {
+    Span_FileOpen = 0,  // Job file opened.
+    Span_LineRead,      // Job line read from file, from first character to end of line.
+    Span_LineExecute,   // Job line parsed and executed, from end of line to next read.
+    Span_JobEnd,        // Job terminated and stream restored.
+    Span_Report,        // Real time report.
+    Span_MacroOpen,     // Macro file opened.
+    Span_Macro,         // Macro run, outermost macro only.
+    Span_YModemPacket,  // YModem packet received.
+    Span_YModemWrite,   // YModem payload written to file.
+    Span_YModemCommit,  // YModem data committed.
+    Span_Flush,         // Span buffer written to file.
+    Span_N
+} span_id_t;
+
+#if SDCARD_ENABLE && SDCARD_SPANS_ENABLE
+
+void spans_init (void);
+void spans_begin (span_id_t id);
+void spans_end (span_id_t id);
+
+#define SPAN_BEGIN(id) spans_begin(id)
+#define SPAN_END(id) spans_end(id)
+
+#else
+
+#define SPAN_BEGIN(id)
+#define SPAN_END(id)
+
+#endif
@@ -0,0 +1,248 @@
+#!/usr/bin/env python3
+#
+# delta_send.py - reference host sender for delta uploads
+#
+# Part of SDCard plugin for grblHAL
+#
+# Copyright (c) 2025 Terje Io
+#
+# grblHAL is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# grblHAL is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+#
+# Updates a file on the controller by sending only the parts that changed:
+#
+#   1. $FB=<filename> reports block signatures of the current version.
+#   2. The new version is searched for matching blocks with the rolling checksum,
+#      a delta file with copy and literal records is built, see delta.h.
+#   3. The delta file is uploaded as <filename>.gdl with YModem.
+#   4. $FA=<filename>|<filename>.gdl rebuilds and verifies the new version on the controller.
+#
+# If the file does not exist on the controller the delta holds the whole file.
+#
+# Usage: delta_send.py <port> <local file> [<remote filename>] [--baud <baud>] [--block-size <size>]
+#
+# Requires pyserial.
+
+import argparse
+import re
+import struct
+import sys
+import time
+import zlib
+
+import serial
+
+DELTA_MAGIC = b'GDL1'
+DEFAULT_BLOCK_SIZE = 1024
+
+SOH = 0x01
+STX = 0x02
+EOT = 0x04
+ACK = 0x06
+NAK = 0x15
+CAN = 0x18
+
+
+def weak_sum(data):
+    a = b = 0
+    for c in data:
+        a = (a + c) & 0xFFFF
+        b = (b + a) & 0xFFFF
+    return a, b
+
+
+def read_line(port, timeout=10.0):
+    end = time.monotonic() + timeout
+    line = b''
+    while time.monotonic() < end:
+        c = port.read(1)
+        if c == b'\n':
+            return line.decode('ascii', 'replace').strip()
+        if c and c != b'\r':
+            line += c
+    raise TimeoutError('no response from controller')
+
+
+def command(port, cmd):
+    port.write((cmd + '\n').encode('ascii'))
+    while True:
+        line = read_line(port)
+        if line == 'ok':
+            return
+        if line.startswith('error'):
+            raise RuntimeError('%s failed: %s' % (cmd, line))
+
+
+def get_signatures(port, filename, block_size):
+    """Returns (block size, {weak: [(block, crc), ...]}, number of blocks), None if the file does not exist."""
+    cmd = '$FB=' + filename + ('|%d' % block_size if block_size else '')
+    port.write((cmd + '\n').encode('ascii'))
+    sigs = {}
+    n_blocks = 0
+    while True:
+        line = read_line(port, 60.0)
+        if line.startswith('error'):
+            return None
+        m = re.match(r'\[DELTASIG:.*\|(\d+)\|(\d+)\]$', line)
+        if m:
+            block_size = int(m.group(2))
+            continue
+        m = re.match(r'\[BLK:([0-9A-F]{8}),([0-9A-F]{8})\]$', line)
+        if m:
+            sigs.setdefault(int(m.group(1), 16), []).append((n_blocks, int(m.group(2), 16)))
+            n_blocks += 1
+        elif line == '[DELTASIG:END]':
+            return block_size, sigs, n_blocks
+
+
+def build_delta(data, block_size, sigs):
+    ops = []
+    literal = bytearray()
+
+    def copy(block):
+        if literal:
+            ops.append(struct.pack('<cI', b'L', len(literal)) + bytes(literal))
+            literal.clear()
+        if ops and ops[-1][0:1] == b'C':
+            first, count = struct.unpack('<II', ops[-1][1:])
+            if first + count == block:
+                ops[-1] = struct.pack('<cII', b'C', first, count + 1)
+                return
+        ops.append(struct.pack('<cII', b'C', block, 1))
+
+    def match(pos, length, a, b):
+        for block, crc in sigs.get(a | (b << 16), ()):
+            if zlib.crc32(data[pos:pos + length]) == crc:
+                return block
+        return None
+
+    pos = 0
+    n = block_size
+    if sigs and len(data) >= n:
+        a, b = weak_sum(data[0:n])
+    while sigs and pos + n <= len(data):
+        block = match(pos, n, a, b)
+        if block is not None:
+            copy(block)
+            pos += n
+            if pos + n <= len(data):
+                a, b = weak_sum(data[pos:pos + n])
+            continue
+        out = data[pos]
+        literal.append(out)
+        if pos + n < len(data):
+            a = (a - out + data[pos + n]) & 0xFFFF
+            b = (b - n * out + a) & 0xFFFF
+        pos += 1
+
+    # The last block of the current version may be shorter than the block size.
+    tail = len(data) - pos
+    if sigs and 0 < tail < n:
+        a, b = weak_sum(data[pos:])
+        block = match(pos, tail, a, b)
+        if block is not None:
+            copy(block)
+            pos = len(data)
+
+    literal.extend(data[pos:])
+    if literal:
+        ops.append(struct.pack('<cI', b'L', len(literal)) + bytes(literal))
+
+    header = DELTA_MAGIC + struct.pack('<III', block_size, len(data), zlib.crc32(data) & 0xFFFFFFFF)
+
+    return header + b''.join(ops)
+
+
+def crc16(data):
+    crc = 0
+    for c in data:
+        crc ^= c << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+
+def send_packet(port, seq, payload):
+    packet = bytes([SOH if len(payload) == 128 else STX, seq & 0xFF, 0xFF - (seq & 0xFF)]) + payload + struct.pack('>H', crc16(payload))
+    for _ in range(10):
+        port.write(packet)
+        end = time.monotonic() + 5.0
+        while time.monotonic() < end:
+            c = port.read(1)
+            if c and c[0] == ACK:
+                return
+            if c and c[0] == CAN:
+                raise RuntimeError('upload cancelled by controller')
+            if c and c[0] == NAK:
+                break
+    raise TimeoutError('upload failed')
+
+
+def ymodem_send(port, filename, data):
+    send_packet(port, 0, (filename.encode('ascii') + b'\0' + str(len(data)).encode('ascii') + b'\0').ljust(128, b'\0'))
+    seq = 1
+    for pos in range(0, len(data), 1024):
+        send_packet(port, seq, data[pos:pos + 1024].ljust(1024, b'\x1A'))
+        seq += 1
+    port.write(bytes([EOT]))
+    end = time.monotonic() + 5.0
+    while time.monotonic() < end and port.read(1) != bytes([ACK]):
+        pass
+    send_packet(port, 0, bytes(128)) # End of batch
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Update a file on a grblHAL controller with a delta upload.')
+    parser.add_argument('port')
+    parser.add_argument('file')
+    parser.add_argument('remote', nargs='?')
+    parser.add_argument('--baud', type=int, default=115200)
+    parser.add_argument('--block-size', type=int, default=0)
+    args = parser.parse_args()
+
+    remote = args.remote or '/' + args.file.replace('\\', '/').split('/')[-1]
+    deltafile = remote + '.gdl'
+
+    with open(args.file, 'rb') as f:
+        data = f.read()
+
+    with serial.Serial(args.port, args.baud, timeout=0.1) as port:
+
+        port.write(b'\n')
+        time.sleep(0.2)
+        port.reset_input_buffer()
+
+        sig = get_signatures(port, remote, args.block_size)
+        if sig is None:
+            block_size, sigs, n_blocks = args.block_size or DEFAULT_BLOCK_SIZE, {}, 0
+        else:
+            block_size, sigs, n_blocks = sig
+
+        delta = build_delta(data, block_size, sigs)
+        print('%s: %d bytes, %d blocks on controller, sending %d bytes' % (remote, len(data), n_blocks, len(delta)))
+
+        ymodem_send(port, deltafile, delta)
+        time.sleep(0.2)
+        port.reset_input_buffer()
+
+        command(port, '$FA=' + remote + '|' + deltafile)
+        while True:
+            line = read_line(port, 120.0)
+            if line.startswith('[DELTA:'):
+                print(line)
+                return 0 if line.endswith('|OK]') else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())
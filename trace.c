@@ -0,0 +1,393 @@
+/*
+  trace.c - capture and replay of file stream sessions
+
+  Part of SDCard plugin for grblHAL
+
+  Records characters read from the file stream, realtime commands, real time
+  reports and state changes with timestamps to a trace file. Records are kept
+  in RAM buffers, one filled from the foreground and one from interrupt context,
+  and merged in time order when written to the file.
+
+  A trace can be replayed as a file stream by $FCP, the recorded characters are
+  fed back and realtime commands are injected at the same position in the stream
+  as they were received. Capture can be active during replay so that timing of
+  the same session can be compared between firmware versions by $FCS.
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sdcard.h"
+
+#if SDCARD_ENABLE && SDCARD_TRACE_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef ARDUINO
+#include "../grbl/state_machine.h"
+#include "../grbl/vfs.h"
+#else
+#include "grbl/state_machine.h"
+#include "grbl/vfs.h"
+#endif
+
+#include "trace.h"
+#include "memstats.h"
+
+#ifndef TRACE_BUFFER_SIZE
+#define TRACE_BUFFER_SIZE 128   // Records, must be a power of 2.
+#endif
+#define TRACE_ISR_BUFFER_SIZE 32
+#define TRACE_WRITE_CHUNK 16
+#define TRACE_PATHLEN 64
+
+typedef struct {
+    vfs_file_t *file;
+    bool ms;
+    uint32_t start;
+    uint32_t records;
+    uint32_t dropped;
+    uint_fast16_t head;
+    uint_fast16_t tail;
+    volatile uint_fast16_t isr_head;
+    volatile uint_fast16_t isr_tail;
+    volatile uint32_t isr_dropped;
+    char filename[TRACE_PATHLEN];
+    trace_record_t buf[TRACE_BUFFER_SIZE];
+    trace_record_t isr_buf[TRACE_ISR_BUFFER_SIZE];
+} trace_t;
+
+typedef struct {
+    vfs_file_t *file;
+    bool ms;
+    uint32_t count[4];
+    uint32_t last_read;
+    uint32_t max_gap;
+    uint32_t time;
+    char filename[TRACE_PATHLEN];
+} trace_summary_t;
+
+static trace_t *volatile trace = NULL; // Read from interrupt context.
+static trace_t *retired = NULL; // Stopped capture, freed on the next realtime cycle as an interrupt may still hold it.
+static trace_summary_t *summary = NULL;
+static on_execute_realtime_ptr on_execute_realtime;
+static on_state_change_ptr on_state_change;
+
+static inline uint32_t trace_time (trace_t *t)
+{
+    return (hal.get_micros ? hal.get_micros() : hal.get_elapsed_ticks()) - t->start;
+}
+
+static void trace_add (trace_event_t event, int16_t data)
+{
+    uint_fast16_t next = (trace->head + 1) & (TRACE_BUFFER_SIZE - 1);
+
+    if(next == trace->tail)
+        trace->dropped++;
+    else {
+        trace->buf[trace->head].time = trace_time(trace);
+        trace->buf[trace->head].event = (uint8_t)event;
+        trace->buf[trace->head].flags = 0;
+        trace->buf[trace->head].data = data;
+        trace->head = next;
+    }
+}
+
+// Writes buffered records to file, merged in time order. Stops capture on write error.
+static void trace_flush (void)
+{
+    bool fg, isr;
+    uint_fast16_t count;
+    trace_record_t out[TRACE_WRITE_CHUNK];
+
+    do {
+        count = 0;
+        while(count < TRACE_WRITE_CHUNK) {
+            fg = trace->tail != trace->head;
+            isr = trace->isr_tail != trace->isr_head;
+            if(fg && (!isr || (int32_t)(trace->buf[trace->tail].time - trace->isr_buf[trace->isr_tail].time) <= 0)) {
+                out[count++] = trace->buf[trace->tail];
+                trace->tail = (trace->tail + 1) & (TRACE_BUFFER_SIZE - 1);
+            } else if(isr) {
+                out[count++] = trace->isr_buf[trace->isr_tail];
+                trace->isr_tail = (trace->isr_tail + 1) & (TRACE_ISR_BUFFER_SIZE - 1);
+            } else
+                break;
+        }
+        if(count) {
+            if(vfs_write(out, sizeof(trace_record_t), count, trace->file) != count * sizeof(trace_record_t)) {
+                trace->tail = trace->head;
+                trace->isr_tail = trace->isr_head;
+                trace->dropped += count;
+                count = 0;
+            } else
+                trace->records += count;
+        }
+    } while(count == TRACE_WRITE_CHUNK);
+}
+
+static void trace_stop (void)
+{
+    char buf[TRACE_PATHLEN + 30];
+    trace_t *t = trace;
+
+    trace_flush();
+    trace = NULL; // Stops capture, also from interrupt context.
+
+    vfs_close(t->file);
+
+    sprintf(buf, "[TRACE:%s|%lu|%lu]" ASCII_EOL, t->filename, (unsigned long)t->records, (unsigned long)(t->dropped + t->isr_dropped));
+    hal.stream.write(buf);
+
+    if(retired) // Stopped earlier without a realtime cycle in between, no longer in use.
+        MEMSTATS_FREE(MemGroup_Jobs, retired);
+
+    retired = t;
+}
+
+void trace_read (int16_t c)
+{
+    if(trace)
+        trace_add(Trace_Read, c);
+}
+
+void trace_realtime_report (void)
+{
+    if(trace)
+        trace_add(Trace_RealtimeReport, 0);
+}
+
+// May be called from interrupt context.
+void trace_realtime_cmd (char c)
+{
+    trace_t *t = trace; // Read once, capture may be stopped from the foreground.
+
+    if(t) {
+
+        uint_fast16_t next = (t->isr_head + 1) & (TRACE_ISR_BUFFER_SIZE - 1);
+
+        if(next == t->isr_tail)
+            t->isr_dropped++;
+        else {
+            t->isr_buf[t->isr_head].time = trace_time(t);
+            t->isr_buf[t->isr_head].event = (uint8_t)Trace_RealtimeCmd;
+            t->isr_buf[t->isr_head].flags = 0;
+            t->isr_buf[t->isr_head].data = (uint8_t)c;
+            t->isr_head = next;
+        }
+    }
+}
+
+// Rewinds trace file to the first record, returns false if not a trace file.
+bool trace_replay_start (vfs_file_t *file)
+{
+    trace_header_t hdr;
+
+    return vfs_seek(file, 0) == 0 &&
+            vfs_read(&hdr, sizeof(trace_header_t), 1, file) == sizeof(trace_header_t) &&
+             !memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+}
+
+// Returns next recorded character, realtime commands recorded before it are injected first. Returns -1 on end of trace.
+int16_t trace_replay_read (vfs_file_t *file, enqueue_realtime_command_ptr enqueue_realtime_command)
+{
+    trace_record_t rec;
+
+    while(vfs_read(&rec, sizeof(trace_record_t), 1, file) == sizeof(trace_record_t)) {
+        switch((trace_event_t)rec.event) {
+
+            case Trace_Read:
+                return rec.data;
+
+            case Trace_RealtimeCmd:
+                if(trace) // Recorded from the foreground, the interrupt buffer has a single producer.
+                    trace_add(Trace_RealtimeCmd, (uint8_t)rec.data);
+                enqueue_realtime_command((char)rec.data);
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    return -1;
+}
+
+static void summary_end (void)
+{
+    char buf[TRACE_PATHLEN + 80];
+    uint32_t scale = summary->ms ? 1000 : 1;
+
+    vfs_close(summary->file);
+
+    sprintf(buf, "[TRACESUM:%s|%lu|%lu|%lu|%lu|%lu|%lu]" ASCII_EOL, summary->filename,
+             (unsigned long)(summary->time * scale), (unsigned long)summary->count[Trace_Read], (unsigned long)(summary->max_gap * scale),
+              (unsigned long)summary->count[Trace_RealtimeCmd], (unsigned long)summary->count[Trace_RealtimeReport],
+               (unsigned long)summary->count[Trace_StateChange]);
+    hal.stream.write(buf);
+
+    MEMSTATS_FREE(MemGroup_Jobs, summary);
+    summary = NULL;
+}
+
+static void summary_process (void)
+{
+    uint_fast8_t count = TRACE_WRITE_CHUNK;
+    trace_record_t rec;
+
+    while(count--) {
+
+        if(vfs_read(&rec, sizeof(trace_record_t), 1, summary->file) != sizeof(trace_record_t)) {
+            summary_end();
+            break;
+        }
+
+        if(rec.event <= Trace_StateChange)
+            summary->count[rec.event]++;
+
+        if(rec.event == Trace_Read) {
+            if(summary->count[Trace_Read] > 1 && rec.time - summary->last_read > summary->max_gap)
+                summary->max_gap = rec.time - summary->last_read;
+            summary->last_read = rec.time;
+        }
+
+        summary->time = rec.time;
+    }
+}
+
+// Flushes capture buffers when half full or when idle and summarizes traces in idle time slices.
+static void trace_process (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    if(retired) {
+        MEMSTATS_FREE(MemGroup_Jobs, retired);
+        retired = NULL;
+    }
+
+    if(trace) {
+
+        uint_fast16_t pending = (trace->head - trace->tail) & (TRACE_BUFFER_SIZE - 1),
+                      isr_pending = (trace->isr_head - trace->isr_tail) & (TRACE_ISR_BUFFER_SIZE - 1);
+
+        if(pending >= TRACE_BUFFER_SIZE / 2 || isr_pending >= TRACE_ISR_BUFFER_SIZE / 2 || (state == STATE_IDLE && (pending || isr_pending)))
+            trace_flush();
+    }
+
+    if(summary && state == STATE_IDLE && hal.stream.type != StreamType_File)
+        summary_process();
+}
+
+static void trace_state_change (sys_state_t state)
+{
+    if(trace)
+        trace_add(Trace_StateChange, (int16_t)state);
+
+    if(on_state_change)
+        on_state_change(state);
+}
+
+// $FC[=<filename>] - start capture to file, stop capture if no filename is given.
+static status_code_t sd_cmd_capture (sys_state_t state, char *args)
+{
+    trace_header_t hdr = {0};
+
+    if(args == NULL) {
+        if(trace)
+            trace_stop();
+        return Status_OK;
+    }
+
+    if(trace)
+        return Status_IdleError;
+
+    if(strlen(args) >= TRACE_PATHLEN || (trace = MEMSTATS_ALLOC(MemGroup_Jobs, sizeof(trace_t))) == NULL)
+        return Status_FileOpenFailed;
+
+    memset(trace, 0, sizeof(trace_t));
+
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.flags = hal.get_micros ? 0 : 1;
+
+    if((trace->file = vfs_open(args, "w")) == NULL || vfs_write(&hdr, sizeof(trace_header_t), 1, trace->file) != sizeof(trace_header_t)) {
+        if(trace->file)
+            vfs_close(trace->file);
+        MEMSTATS_FREE(MemGroup_Jobs, trace);
+        trace = NULL;
+        return Status_FileOpenFailed;
+    }
+
+    strcpy(trace->filename, args);
+    trace->ms = hdr.flags == 1;
+    trace->start = hal.get_micros ? hal.get_micros() : hal.get_elapsed_ticks();
+
+    return Status_OK;
+}
+
+// $FCS=<filename> - summarize trace file.
+static status_code_t sd_cmd_summary (sys_state_t state, char *args)
+{
+    trace_header_t hdr;
+
+    if(args == NULL)
+        return Status_InvalidStatement;
+
+    if(summary)
+        return Status_IdleError;
+
+    if(strlen(args) >= TRACE_PATHLEN || (summary = MEMSTATS_ALLOC(MemGroup_Jobs, sizeof(trace_summary_t))) == NULL)
+        return Status_FileOpenFailed;
+
+    memset(summary, 0, sizeof(trace_summary_t));
+
+    if((summary->file = vfs_open(args, "r")) == NULL ||
+        vfs_read(&hdr, sizeof(trace_header_t), 1, summary->file) != sizeof(trace_header_t) ||
+         memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic))) {
+        if(summary->file)
+            vfs_close(summary->file);
+        MEMSTATS_FREE(MemGroup_Jobs, summary);
+        summary = NULL;
+        return Status_FileOpenFailed;
+    }
+
+    strcpy(summary->filename, args);
+    summary->ms = !!(hdr.flags & 1);
+
+    return Status_OK;
+}
+
+void trace_init (void)
+{
+    PROGMEM static const sys_command_t trace_command_list[] = {
+        {"FC", sd_cmd_capture, {}, { .str = "$FC[=<filename>] - start capture of file stream session, stop if no filename" } },
+        {"FCS", sd_cmd_summary, {}, { .str = "$FCS=<filename> - report timing summary of captured session" } }
+    };
+
+    static sys_commands_t trace_commands = {
+        .n_commands = sizeof(trace_command_list) / sizeof(sys_command_t),
+        .commands = trace_command_list
+    };
+
+    system_register_commands(&trace_commands);
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = trace_process;
+
+    on_state_change = grbl.on_state_change;
+    grbl.on_state_change = trace_state_change;
+}
+
+#endif // SDCARD_ENABLE && SDCARD_TRACE_ENABLE
@@ -0,0 +1,59 @@
+/*
+  trace.h - capture and replay of file stream sessions
+
+  Part of SDCard plugin for grblHAL
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#define TRACE_MAGIC "GTR1"
+
+/*
+  Trace (.trc) file layout, all values little endian:
+
+  trace_header_t header;
+  trace_record_t record[];
+
+  Records are in time order, time is in microseconds from start of capture.
+*/
+
+typedef enum {
+    Trace_Read = 0,         // Character returned from the file stream, data is the character.
+    Trace_RealtimeCmd,      // Realtime command received while streaming, data is the command.
+    Trace_RealtimeReport,   // Real time report requested.
+    Trace_StateChange       // data is the new state.
+} trace_event_t;
+
+typedef struct {
+    char magic[4];          // TRACE_MAGIC
+    uint32_t flags;         // Bit 0 set if timestamps are in ms resolution.
+} trace_header_t;
+
+typedef struct {
+    uint32_t time;
+    uint8_t event;          // trace_event_t
+    uint8_t flags;          // Reserved.
+    int16_t data;
+} trace_record_t;
+
+void trace_init (void);
+void trace_read (int16_t c);
+void trace_realtime_cmd (char c);
+void trace_realtime_report (void);
+bool trace_replay_start (vfs_file_t *file);
+int16_t trace_replay_read (vfs_file_t *file, enqueue_realtime_command_ptr enqueue_realtime_command);
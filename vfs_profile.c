@@ -0,0 +1,307 @@
+/*
+  vfs_profile.c - VFS profiling shim
+
+  Part of SDCard plugin for grblHAL
+
+  Wraps the vfs_t of a file system adapter and records the number of calls,
+  bytes transferred and a latency histogram per operation type.
+
+  Copyright (c) 2025 Terje Io
+
+  grblHAL is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  grblHAL is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "sdcard.h"
+
+#if SDCARD_ENABLE && SDCARD_VFS_PROFILE_ENABLE
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef ARDUINO
+#include "../grbl/vfs.h"
+#else
+#include "grbl/vfs.h"
+#endif
+
+#include "vfs_profile.h"
+
+#ifndef VFS_PROFILE_MAX_MOUNTS
+#define VFS_PROFILE_MAX_MOUNTS 4
+#elif VFS_PROFILE_MAX_MOUNTS < 1 || VFS_PROFILE_MAX_MOUNTS > 4
+#error "VFS_PROFILE_MAX_MOUNTS must be in the range 1 - 4!"
+#endif
+
+#define VFS_PROFILE_BUCKETS 8 // <16us, <64us, <256us, <1ms, <4ms, <16ms, <64ms, >=64ms
+
+typedef enum {
+    VFSOp_Open = 0,
+    VFSOp_Close,
+    VFSOp_Read,
+    VFSOp_Write,
+    VFSOp_Seek,
+    VFSOp_Stat,
+    VFSOp_Readdir,
+    VFSOp_N
+} vfs_op_t;
+
+typedef struct {
+    uint32_t count;
+    uint32_t max_us;
+    uint32_t bytes;     // Wraps at 4 GB.
+    uint32_t histogram[VFS_PROFILE_BUCKETS];
+} vfs_op_stats_t;
+
+typedef struct {
+    vfs_t vfs;          // Shim, must be first.
+    const vfs_t *fs;    // Wrapped file system.
+    char path[32];
+    vfs_op_stats_t op[VFSOp_N];
+} vfs_profile_t;
+
+static const char *const op_name[VFSOp_N] = { "open", "close", "read", "write", "seek", "stat", "readdir" };
+
+static vfs_profile_t profile[VFS_PROFILE_MAX_MOUNTS] = {0};
+
+static inline uint32_t get_us (void)
+{
+    return hal.get_micros ? hal.get_micros() : hal.get_elapsed_ticks() * 1000;
+}
+
+static void record (vfs_profile_t *p, vfs_op_t op, uint32_t start, size_t bytes)
+{
+    uint32_t us = get_us() - start, t = us >> 4;
+    uint_fast8_t bucket = 0;
+    vfs_op_stats_t *stats = &p->op[op];
+
+    while(t && bucket < VFS_PROFILE_BUCKETS - 1) {
+        t >>= 2;
+        bucket++;
+    }
+
+    stats->count++;
+    stats->bytes += bytes;
+    stats->histogram[bucket]++;
+    if(us > stats->max_us)
+        stats->max_us = us;
+}
+
+// File and directory level functions, the core sets the fs member to the mounted vfs_t, i.e. the shim.
+
+static void profile_close (vfs_file_t *file)
+{
+    vfs_profile_t *p = (vfs_profile_t *)file->fs;
+    uint32_t start = get_us();
+
+    p->fs->fclose(file);
+    record(p, VFSOp_Close, start, 0);
+}
+
+static size_t profile_read (void *buffer, size_t size, size_t count, vfs_file_t *file)
+{
+    vfs_profile_t *p = (vfs_profile_t *)file->fs;
+    uint32_t start = get_us();
+    size_t bytes = p->fs->fread(buffer, size, count, file);
+
+    record(p, VFSOp_Read, start, bytes);
+
+    return bytes;
+}
+
+static size_t profile_write (const void *buffer, size_t size, size_t count, vfs_file_t *file)
+{
+    vfs_profile_t *p = (vfs_profile_t *)file->fs;
+    uint32_t start = get_us();
+    size_t bytes = p->fs->fwrite(buffer, size, count, file);
+
+    record(p, VFSOp_Write, start, bytes);
+
+    return bytes;
+}
+
+static int profile_seek (vfs_file_t *file, size_t offset)
+{
+    vfs_profile_t *p = (vfs_profile_t *)file->fs;
+    uint32_t start = get_us();
+    int res = p->fs->fseek(file, offset);
+
+    record(p, VFSOp_Seek, start, 0);
+
+    return res;
+}
+
+static char *profile_readdir (vfs_dir_t *dir, vfs_dirent_t *dirent)
+{
+    vfs_profile_t *p = (vfs_profile_t *)dir->fs;
+    uint32_t start = get_us();
+    char *name = p->fs->readdir(dir, dirent);
+
+    record(p, VFSOp_Readdir, start, 0);
+
+    return name;
+}
+
+// Path based functions are not passed the file system, a set bound to the shim is thus needed per mount.
+
+static vfs_file_t *profile_open (vfs_profile_t *p, const char *filename, const char *mode)
+{
+    uint32_t start = get_us();
+    vfs_file_t *file = p->fs->fopen(filename, mode);
+
+    record(p, VFSOp_Open, start, 0);
+
+    return file;
+}
+
+static int profile_stat (vfs_profile_t *p, const char *filename, vfs_stat_t *st)
+{
+    uint32_t start = get_us();
+    int res = p->fs->fstat(filename, st);
+
+    record(p, VFSOp_Stat, start, 0);
+
+    return res;
+}
+
+#define VFS_PROFILE_BIND(n) \
+static vfs_file_t *profile_open_##n (const char *filename, const char *mode) { return profile_open(&profile[n], filename, mode); } \
+static int profile_stat_##n (const char *filename, vfs_stat_t *st) { return profile_stat(&profile[n], filename, st); }
+
+VFS_PROFILE_BIND(0)
+#if VFS_PROFILE_MAX_MOUNTS > 1
+VFS_PROFILE_BIND(1)
+#endif
+#if VFS_PROFILE_MAX_MOUNTS > 2
+VFS_PROFILE_BIND(2)
+#endif
+#if VFS_PROFILE_MAX_MOUNTS > 3
+VFS_PROFILE_BIND(3)
+#endif
+
+static const struct {
+    vfs_open_ptr fopen;
+    int (*fstat)(const char *filename, vfs_stat_t *st);
+} bound[VFS_PROFILE_MAX_MOUNTS] = {
+    { profile_open_0, profile_stat_0 },
+#if VFS_PROFILE_MAX_MOUNTS > 1
+    { profile_open_1, profile_stat_1 },
+#endif
+#if VFS_PROFILE_MAX_MOUNTS > 2
+    { profile_open_2, profile_stat_2 },
+#endif
+#if VFS_PROFILE_MAX_MOUNTS > 3
+    { profile_open_3, profile_stat_3 }
+#endif
+};
+
+// $FT[=R] - report VFS profile, R resets it.
+static status_code_t sd_cmd_profile (sys_state_t state, char *args)
+{
+    uint_fast8_t idx, op, bucket;
+    char buf[200], *s;
+    vfs_op_stats_t *stats;
+
+    if(args && !(CAPS(*args) == 'R' && args[1] == '\0'))
+        return Status_InvalidStatement;
+
+    for(idx = 0; idx < VFS_PROFILE_MAX_MOUNTS; idx++) {
+
+        if(profile[idx].fs == NULL)
+            continue;
+
+        if(args) {
+            memset(profile[idx].op, 0, sizeof(profile[idx].op));
+            continue;
+        }
+
+        for(op = 0; op < VFSOp_N; op++) {
+            if((stats = &profile[idx].op[op])->count) {
+                s = buf + sprintf(buf, "[VFSPROF:%s|%s|%lu|%lu|%lu|", profile[idx].path, op_name[op],
+                                   (unsigned long)stats->count, (unsigned long)stats->bytes, (unsigned long)stats->max_us);
+                for(bucket = 0; bucket < VFS_PROFILE_BUCKETS; bucket++)
+                    s += sprintf(s, bucket ? ",%lu" : "%lu", (unsigned long)stats->histogram[bucket]);
+                strcpy(s, "]" ASCII_EOL);
+                hal.stream.write(buf);
+            }
+        }
+    }
+
+    return Status_OK;
+}
+
+// Returns a shim for the file system to be mounted at path, or the file system itself if no slot is available.
+// Statistics are kept when a path is remounted, e.g. on SD card change.
+const vfs_t *vfs_profile_wrap (const char *path, const vfs_t *fs)
+{
+    PROGMEM static const sys_command_t profile_command_list[] = {
+        {"FT", sd_cmd_profile, {}, { .str = "$FT[=R] - report file system call profile, R to reset" } }
+    };
+
+    static sys_commands_t profile_commands = {
+        .n_commands = sizeof(profile_command_list) / sizeof(sys_command_t),
+        .commands = profile_command_list
+    };
+
+    static bool registered = false;
+
+    uint_fast8_t idx;
+    vfs_profile_t *p = NULL;
+
+    if(strlen(path) >= sizeof(profile[0].path))
+        return fs;
+
+    for(idx = 0; idx < VFS_PROFILE_MAX_MOUNTS; idx++) {
+        if(profile[idx].fs && !strcmp(profile[idx].path, path)) {
+            p = &profile[idx];
+            break;
+        }
+        if(p == NULL && profile[idx].fs == NULL)
+            p = &profile[idx];
+    }
+
+    if(p == NULL)
+        return fs;
+
+    if(!registered) {
+        registered = true;
+        system_register_commands(&profile_commands);
+    }
+
+    if(p->fs == NULL)
+        strcpy(p->path, path);
+
+    idx = p - profile;
+
+    memcpy(&p->vfs, fs, sizeof(vfs_t));
+    p->fs = fs;
+
+    if(fs->fopen)
+        p->vfs.fopen = bound[idx].fopen;
+    if(fs->fclose)
+        p->vfs.fclose = profile_close;
+    if(fs->fread)
+        p->vfs.fread = profile_read;
+    if(fs->fwrite)
+        p->vfs.fwrite = profile_write;
+    if(fs->fseek)
+        p->vfs.fseek = profile_seek;
+    if(fs->fstat)
+        p->vfs.fstat = bound[idx].fstat;
+    if(fs->readdir)
+        p->vfs.readdir = profile_readdir;
+
+    return &p->vfs;
+}
+
+#endif // SDCARD_ENABLE && SDCARD_VFS_PROFILE_ENABLE
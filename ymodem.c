@@ -8,6 +8,10 @@
   NOTE: Receiver only, does not send initial 'C' to start transfer.
         Start transfer by sending SOH or STX.
 
+        When a commit handler is registered data received is committed to the
+        file system every YMODEM_COMMIT_SIZE bytes so that the file can be read
+        while the transfer is in progress.
+
   Copyright (c) 2021-2025 Terje Io
 
   grblHAL is free software: you can redistribute it and/or modify
@@ -40,6 +44,14 @@
 #include "grbl/vfs.h"
 #endif
 
+#include "ymodem.h"
+#include "memstats.h"
+#include "spans.h"
+
+#ifndef YMODEM_COMMIT_SIZE
+#define YMODEM_COMMIT_SIZE 8192
+#endif
+
 typedef enum {
     YModem_NOOP = 0,
     YModem_ACK,
@@ -58,6 +70,7 @@ typedef struct {
     char filename[32];
     uint32_t filelength;
     uint32_t received;
+    uint32_t written;
     uint16_t crc;
     uint_fast16_t idx;
     uint_fast16_t errors;
@@ -73,7 +86,9 @@ typedef struct {
 } ymodem_t;
 
 static ymodem_t ymodem;
+static ymodem_upload_t upload = {0};
 static stream_rx_buffer_t rx_buffer;
+static ymodem_on_commit_ptr on_commit = NULL;
 
 static driver_reset_ptr driver_reset;
 static on_execute_realtime_ptr on_execute_realtime;
@@ -123,12 +138,38 @@ static void end_transfer (bool send_ack)
     if(ymodem.handle) {
         vfs_close(ymodem.handle);
         ymodem.handle = NULL;
+        upload.committed = ymodem.written;
+        upload.completed = send_ack;
     }
 
     if(send_ack) {
         hal.stream.write_char(ASCII_ACK);
         hal.stream.write_char('C');
     }
+
+    if(upload.active) {
+        upload.active = false;
+        if(on_commit)
+            on_commit(&upload);
+    }
+}
+
+// Commit data received so far by closing the file and reopening it in append mode.
+static bool commit_file (void)
+{
+    SPAN_BEGIN(Span_YModemCommit);
+
+    vfs_close(ymodem.handle);
+
+    if((ymodem.handle = vfs_open(ymodem.filename, "a")) != NULL) {
+        upload.committed = ymodem.written;
+        if(on_commit)
+            on_commit(&upload);
+    }
+
+    SPAN_END(Span_YModemCommit);
+
+    return ymodem.handle != NULL;
 }
 
 // Cancel handler. Waits for second cancel character.
@@ -158,6 +199,7 @@ static ymodem_status_t await_soh (uint8_t c)
     ymodem_status_t status = YModem_NOOP;
 
     if(c == ASCII_SOH || c == ASCII_STX) {
+        SPAN_BEGIN(Span_YModemPacket);
         ymodem.idx = ymodem.crc = 0;
         ymodem.crc_lsb = ymodem.seq_inv = ymodem.repeated = false;
         ymodem.packet_len = c == ASCII_SOH ? 128 : 1024;
@@ -205,6 +247,7 @@ static ymodem_status_t get_payload (uint8_t c)
 // CRC handler. Reads and validates CRC, open file on packet 0 writes payload to file when valid.
 static ymodem_status_t await_crc (uint8_t c)
 {
+    size_t written;
     ymodem_status_t status = YModem_NOOP;
 
     if(!ymodem.crc_lsb) {
@@ -215,6 +258,8 @@ static ymodem_status_t await_crc (uint8_t c)
         ymodem.process = await_soh;                                                         // Set active handler to wait for next packet
         ymodem.crc = (ymodem.crc << 8) | c;
 
+        SPAN_END(Span_YModemPacket);
+
         if(ccitt_crc16((const uint8_t *)&ymodem.payload, ymodem.packet_len) != ymodem.crc)  // If CRC invalid
             return YModem_Purge;                                                            // purge input stream and return NAK.
 
@@ -233,6 +278,15 @@ static ymodem_status_t await_crc (uint8_t c)
 
                 if((ymodem.handle = vfs_open(ymodem.filename, "w")) == NULL)
                     status = YModem_CAN;
+                else {
+                    upload.filename = ymodem.filename;
+                    upload.length = ymodem.filelength;
+                    upload.committed = 0;
+                    upload.completed = false;
+                    upload.active = true;
+                    if(on_commit)
+                        on_commit(&upload);
+                }
             }
 
             ymodem.packet_num++;
@@ -248,9 +302,16 @@ static ymodem_status_t await_crc (uint8_t c)
                     ymodem.packet_len -= ymodem.received - ymodem.filelength;
 
                 // Write payload
-                if(vfs_write(ymodem.payload, ymodem.packet_len, 1, ymodem.handle) == ymodem.packet_len) {
+                SPAN_BEGIN(Span_YModemWrite);
+                written = vfs_write(ymodem.payload, ymodem.packet_len, 1, ymodem.handle);
+                SPAN_END(Span_YModemWrite);
+
+                if(written == ymodem.packet_len) {
                     status = YModem_ACK;
-                    if(ymodem.completed) {
+                    ymodem.written += ymodem.packet_len;
+                    if(on_commit && ymodem.written - upload.committed >= YMODEM_COMMIT_SIZE && !commit_file())
+                        status = YModem_CAN;
+                    else if(ymodem.completed) {
                         ymodem.idx = 0;
                         ymodem.process = await_eot; // Set active handler to wait for end of transfer
                     }
@@ -379,9 +440,34 @@ static bool trap_initial_soh (char c)
     return on_unknown_realtime_cmd == NULL || on_unknown_realtime_cmd(c);
 }
 
+// Returns upload info if filename is, or was, the last file transferred.
+// If filename is NULL info for the last transfer is returned.
+ymodem_upload_t *ymodem_get_upload (const char *filename)
+{
+    if(upload.filename == NULL)
+        return NULL;
+
+    if(filename == NULL)
+        return &upload;
+
+    if(*filename == '/')
+        filename++;
+
+    return strcmp(filename, *upload.filename == '/' ? upload.filename + 1 : upload.filename) ? NULL : &upload;
+}
+
+// Set handler to be called when transfer starts, data is committed to the file system and on transfer end.
+// NOTE: setting a handler enables periodic commits which slows down transfer somewhat.
+void ymodem_set_on_commit (ymodem_on_commit_ptr handler)
+{
+    on_commit = handler;
+}
+
 // Add YModem protocol to chain of unknown real-time command handlers
 void ymodem_init (void)
 {
+    MEMSTATS_STATIC(MemGroup_YModem, sizeof(ymodem) + sizeof(rx_buffer));
+
     driver_reset = hal.driver_reset;
     hal.driver_reset = on_soft_reset;
 
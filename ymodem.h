@@ -19,4 +19,16 @@
   along with grblHAL. If not, see <http://www.gnu.org/licenses/>.
 */
 
+typedef struct {
+    char *filename;
+    uint32_t length;    // Expected file length, 0 if not known.
+    uint32_t committed; // Number of bytes written and committed to the file system, readable by others.
+    bool active;        // Transfer in progress.
+    bool completed;     // Transfer ended successfully.
+} ymodem_upload_t;
+
+typedef void (*ymodem_on_commit_ptr)(ymodem_upload_t *upload);
+
 void ymodem_init (void);
+ymodem_upload_t *ymodem_get_upload (const char *filename);
+void ymodem_set_on_commit (ymodem_on_commit_ptr handler);